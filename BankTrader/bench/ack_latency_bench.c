@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+
+#include "server.h"
+#include "listener.h"
+#include "protocol.h"
+#include "account.h"
+#include "trader.h"
+#include "csapp.h"
+
+/*
+ * Round-trip ACK latency over loopback TCP and over a Unix-domain socket.
+ *
+ * The server modules run in this process with one listener of each kind,
+ * served by the same acceptors and session workers as the real server.
+ * A client logs in over each transport and times STATUS requests until
+ * their ACK comes back.
+ *
+ * Usage: ack_latency_bench [round trips]
+ */
+
+#define BENCH_SOCK_PATH "/tmp/bourse_bench.sock"
+
+static double now_us(void) {
+    struct timespec currTime;
+    clock_gettime(CLOCK_MONOTONIC, &currTime);
+    return currTime.tv_sec * 1e6 + currTime.tv_nsec / 1e3;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(double *)a;
+    double y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+static void request(int fd, uint8_t type, void *payload, uint16_t size) {
+    BRS_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.size = htons(size);
+    proto_send_packet(fd, &hdr, payload);
+
+    // Wait for the response, skipping any notifications
+    void *data = NULL;
+    do {
+        if(data != NULL) Free(data);
+        data = NULL;
+        if(proto_recv_packet(fd, &hdr, &data) != 0) unix_error("Connection closed");
+    } while(hdr.type != BRS_ACK_PKT && hdr.type != BRS_NACK_PKT);
+    if(data != NULL) Free(data);
+}
+
+static void run(char *label, int fd, int rounds) {
+    double *latency = Malloc(rounds * sizeof(double));
+
+    // Log in under a name of the transport, then warm up
+    request(fd, BRS_LOGIN_PKT, label, strlen(label));
+    for(int i = 0; i < 1000; i++) request(fd, BRS_STATUS_PKT, NULL, 0);
+
+    double start = now_us();
+    for(int i = 0; i < rounds; i++) {
+        double sent = now_us();
+        request(fd, BRS_STATUS_PKT, NULL, 0);
+        latency[i] = now_us() - sent;
+    }
+    double total = now_us() - start;
+
+    qsort(latency, rounds, sizeof(double), compare);
+    printf("%-5s %d round trips: p50 %.1f us p99 %.1f us max %.1f us, %.0f req/s\n", label, rounds,
+           latency[rounds / 2], latency[rounds * 99 / 100], latency[rounds - 1], rounds / total * 1e6);
+    Free(latency);
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = (argc > 1) ? atoi(argv[1]) : 50000;
+
+    client_registry = creg_init();
+    accounts_init();
+    traders_init();
+    exchange = exchange_init();
+
+    // TCP listener on an ephemeral loopback port
+    int tcpListenfd = listener_open_tcp("0", 0);
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    getsockname(tcpListenfd, (SA *)&addr, &addrlen);
+    char port[16];
+    snprintf(port, sizeof(port), "%d", ntohs(((struct sockaddr_in *)&addr)->sin_port));
+
+    // Unix-domain listener
+    int unixListenfd = listener_open_unix(BENCH_SOCK_PATH);
+    if(unixListenfd < 0) unix_error("Open Unix listener error");
+
+    listener_start(tcpListenfd, -1);
+    listener_start(unixListenfd, -1);
+
+    // Loopback TCP client
+    int optval = 1;
+    int tcpfd = Open_clientfd("127.0.0.1", port);
+    setsockopt(tcpfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    run("tcp", tcpfd, rounds);
+
+    // Unix-domain client
+    struct sockaddr_un unixAddr;
+    memset(&unixAddr, 0, sizeof(unixAddr));
+    unixAddr.sun_family = AF_UNIX;
+    strcpy(unixAddr.sun_path, BENCH_SOCK_PATH);
+    int unixfd = Socket(AF_UNIX, SOCK_STREAM, 0);
+    if(connect(unixfd, (SA *)&unixAddr, sizeof(unixAddr)) < 0) unix_error("Connect error");
+    run("unix", unixfd, rounds);
+
+    unlink(BENCH_SOCK_PATH);
+    return EXIT_SUCCESS;
+}
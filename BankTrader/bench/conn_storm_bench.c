@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "server.h"
+#include "listener.h"
+#include "protocol.h"
+#include "account.h"
+#include "trader.h"
+#include "csapp.h"
+
+/*
+ * Connection storm: accept rate and time to first ACK.
+ *
+ * The server modules run in this process.  Client threads repeatedly
+ * connect, log in, wait for the response to the login and disconnect,
+ * first against a single acceptor, then against several acceptors whose
+ * sockets share a port through SO_REUSEPORT.  Each client thread logs in
+ * under a name of its own, so the number of accounts stays bounded.
+ *
+ * Usage: conn_storm_bench [clients] [connections per client] [acceptors]
+ */
+
+typedef struct storm {
+    char *port;                 // Port to connect to
+    int client;                 // Client number, for its login name
+    int rounds;                 // Connections to make
+    double *latency;            // Time from connect to first response, per connection
+} STORM;
+
+static double now_us(void) {
+    struct timespec currTime;
+    clock_gettime(CLOCK_MONOTONIC, &currTime);
+    return currTime.tv_sec * 1e6 + currTime.tv_nsec / 1e3;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(double *)a;
+    double y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+static void *storm_client(void *arg) {
+    STORM *storm = arg;
+    char name[32];
+    snprintf(name, sizeof(name), "storm%d", storm->client);
+
+    for(int i = 0; i < storm->rounds; i++) {
+        double start = now_us();
+        int fd = Open_clientfd("127.0.0.1", storm->port);
+
+        // Log in and wait for the ACK, or the NACK if the previous session
+        // under this name has not been torn down yet
+        BRS_PACKET_HEADER hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.type = BRS_LOGIN_PKT;
+        hdr.size = htons(strlen(name));
+        proto_send_packet(fd, &hdr, name);
+        void *data = NULL;
+        do {
+            if(data != NULL) Free(data);
+            data = NULL;
+            if(proto_recv_packet(fd, &hdr, &data) != 0) unix_error("Connection closed");
+        } while(hdr.type != BRS_ACK_PKT && hdr.type != BRS_NACK_PKT);
+        if(data != NULL) Free(data);
+
+        storm->latency[i] = now_us() - start;
+        close(fd);
+    }
+    return NULL;
+}
+
+// Open numAcceptors listening sockets on one ephemeral port and start their acceptors
+static void start_acceptors(char *port, size_t portLen, int numAcceptors) {
+    int listenfd = listener_open_tcp("0", numAcceptors > 1);
+    if(listenfd < 0) unix_error("Open listener error");
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    getsockname(listenfd, (SA *)&addr, &addrlen);
+    snprintf(port, portLen, "%d", ntohs(((struct sockaddr_in *)&addr)->sin_port));
+    listener_start(listenfd, -1);
+
+    for(int i = 1; i < numAcceptors; i++) {
+        if((listenfd = listener_open_tcp(port, 1)) < 0) unix_error("Open listener error");
+        listener_start(listenfd, -1);
+    }
+}
+
+static void run(int numAcceptors, int numClients, int rounds) {
+    char port[16];
+    start_acceptors(port, sizeof(port), numAcceptors);
+
+    STORM *storms = Malloc(numClients * sizeof(STORM));
+    pthread_t *tids = Malloc(numClients * sizeof(pthread_t));
+    double start = now_us();
+    for(int i = 0; i < numClients; i++) {
+        storms[i].port = port;
+        storms[i].client = i;
+        storms[i].rounds = rounds;
+        storms[i].latency = Malloc(rounds * sizeof(double));
+        Pthread_create(&tids[i], NULL, storm_client, &storms[i]);
+    }
+    for(int i = 0; i < numClients; i++) Pthread_join(tids[i], NULL);
+    double total = now_us() - start;
+
+    // Gather every connection's latency
+    int count = numClients * rounds;
+    double *latency = Malloc(count * sizeof(double));
+    for(int i = 0; i < numClients; i++) {
+        memcpy(&latency[i * rounds], storms[i].latency, rounds * sizeof(double));
+        Free(storms[i].latency);
+    }
+    qsort(latency, count, sizeof(double), compare);
+    printf("%d acceptor%s: %d connections in %.0f ms, %.0f accepts/s, first ACK p50 %.1f us p99 %.1f us\n",
+           numAcceptors, (numAcceptors > 1) ? "s" : " ", count, total / 1e3, count / total * 1e6,
+           latency[count / 2], latency[count * 99 / 100]);
+
+    Free(latency);
+    Free(tids);
+    Free(storms);
+}
+
+int main(int argc, char *argv[]) {
+    int numClients = (argc > 1) ? atoi(argv[1]) : 32;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 500;
+    int numAcceptors = (argc > 3) ? atoi(argv[3]) : 4;
+    if(numClients < 1 || numClients > 32 || rounds < 1 || numAcceptors < 1) {
+        fprintf(stderr, "Usage: %s [clients (1-32)] [connections per client] [acceptors]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    client_registry = creg_init();
+    accounts_init();
+    traders_init();
+    exchange = exchange_init();
+
+    run(1, numClients, rounds);
+    run(numAcceptors, numClients, rounds);
+    return EXIT_SUCCESS;
+}
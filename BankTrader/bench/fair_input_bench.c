@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+
+#include "server.h"
+#include "listener.h"
+#include "input_sched.h"
+#include "protocol.h"
+#include "account.h"
+#include "trader.h"
+#include "csapp.h"
+
+/*
+ * Latency of light traders while heavy traders flood the exchange.
+ *
+ * Heavy traders pipeline batches of BUY and SELL orders at a single price,
+ * so they keep trading with each other, and each trade is broadcast to
+ * everyone.  Light traders meanwhile post one BUY far from the market,
+ * wait for its ACK, cancel it and wait again.  The light traders' request
+ * latencies are reported with every session carrying out its own requests
+ * (the sessions race for the exchange lock), then with the requests going
+ * through the fair input stage.
+ *
+ * Usage: fair_input_bench [seconds] [heavy traders] [light traders] [batch]
+ */
+
+#define MAX_SAMPLES (1024 * 1024)
+
+typedef struct client {
+    char *port;                 // Server port
+    int id;                     // Client number, for its login name
+    int batch;                  // Orders per batch (heavy traders)
+    int fd;                     // Connection, closed once the server is gone
+    double end;                 // When to stop
+    double *buyLatency;         // Latencies of the light trader's BUYs
+    double *cancelLatency;      // Latencies of the light trader's CANCELs
+    long count;                 // Requests or round trips done
+} CLIENT;
+
+static double now_us(void) {
+    struct timespec currTime;
+    clock_gettime(CLOCK_MONOTONIC, &currTime);
+    return currTime.tv_sec * 1e6 + currTime.tv_nsec / 1e3;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(double *)a;
+    double y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+static void send_request(int fd, uint8_t type, void *payload, uint16_t size) {
+    BRS_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.size = htons(size);
+    proto_send_packet(fd, &hdr, payload);
+}
+
+// Wait for the response to a request, skipping notifications, and return its type
+static int wait_response(int fd, BRS_STATUS_INFO *status) {
+    BRS_PACKET_HEADER hdr;
+    void *data = NULL;
+    while(1) {
+        if(proto_recv_packet(fd, &hdr, &data) != 0) unix_error("Connection closed");
+        if(hdr.type == BRS_ACK_PKT || hdr.type == BRS_NACK_PKT) break;
+        if(data != NULL) Free(data);
+        data = NULL;
+    }
+    if(status != NULL && data != NULL && ntohs(hdr.size) >= sizeof(BRS_STATUS_INFO)) {
+        memcpy(status, data, sizeof(BRS_STATUS_INFO));
+    }
+    if(data != NULL) Free(data);
+    return hdr.type;
+}
+
+static int connect_trader(char *port, char *name) {
+    int optval = 1;
+    int fd = Open_clientfd("127.0.0.1", port);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    send_request(fd, BRS_LOGIN_PKT, name, strlen(name));
+    if(wait_response(fd, NULL) != BRS_ACK_PKT) unix_error("Login refused");
+
+    // Enough funds and inventory for the whole run
+    BRS_FUNDS_INFO funds = {htonl(2000000000)};
+    send_request(fd, BRS_DEPOSIT_PKT, &funds, sizeof(funds));
+    wait_response(fd, NULL);
+    BRS_ESCROW_INFO escrow = {htonl(2000000000)};
+    send_request(fd, BRS_ESCROW_PKT, &escrow, sizeof(escrow));
+    wait_response(fd, NULL);
+    return fd;
+}
+
+static void *heavy_trader(void *arg) {
+    CLIENT *client = arg;
+    char name[32];
+    snprintf(name, sizeof(name), "heavy%d", client->id);
+    int fd = client->fd = connect_trader(client->port, name);
+
+    // Pipeline a batch of orders in one write, then collect their responses
+    size_t recordSize = sizeof(BRS_PACKET_HEADER) + sizeof(BRS_ORDER_INFO);
+    char *batch = Malloc(client->batch * recordSize);
+    for(int i = 0; i < client->batch; i++) {
+        BRS_PACKET_HEADER *hdr = (BRS_PACKET_HEADER *)(batch + i * recordSize);
+        BRS_ORDER_INFO *order = (BRS_ORDER_INFO *)(hdr + 1);
+        memset(hdr, 0, sizeof(BRS_PACKET_HEADER));
+        hdr->type = ((i + client->id) % 2) ? BRS_SELL_PKT : BRS_BUY_PKT;
+        hdr->size = htons(sizeof(BRS_ORDER_INFO));
+        order->quantity = htonl(1);
+        order->price = htonl(100);
+    }
+    while(now_us() < client->end) {
+        Rio_writen(fd, batch, client->batch * recordSize);
+        for(int i = 0; i < client->batch; i++) wait_response(fd, NULL);
+        client->count = client->count + client->batch;
+    }
+
+    Free(batch);
+    return NULL;
+}
+
+static void *light_trader(void *arg) {
+    CLIENT *client = arg;
+    char name[32];
+    snprintf(name, sizeof(name), "light%d", client->id);
+    int fd = client->fd = connect_trader(client->port, name);
+
+    while(now_us() < client->end && client->count < MAX_SAMPLES) {
+        // A BUY far below the market, then its CANCEL
+        BRS_STATUS_INFO status;
+        memset(&status, 0, sizeof(status));
+        BRS_ORDER_INFO order = {htonl(1), htonl(1)};
+        double sent = now_us();
+        send_request(fd, BRS_BUY_PKT, &order, sizeof(order));
+        if(wait_response(fd, &status) != BRS_ACK_PKT) continue;
+        double posted = now_us();
+
+        BRS_CANCEL_INFO cancel = {status.orderid};
+        send_request(fd, BRS_CANCEL_PKT, &cancel, sizeof(cancel));
+        wait_response(fd, NULL);
+        double canceled = now_us();
+
+        client->buyLatency[client->count] = posted - sent;
+        client->cancelLatency[client->count] = canceled - posted;
+        client->count = client->count + 1;
+    }
+
+    return NULL;
+}
+
+static void report(char *label, double *latency, long count) {
+    qsort(latency, count, sizeof(double), compare);
+    printf("  %-6s %7ld requests: p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n", label,
+           count, count ? latency[count / 2] : 0, count ? latency[count * 99 / 100] : 0,
+           count ? latency[count * 999 / 1000] : 0, count ? latency[count - 1] : 0);
+}
+
+static void run(char *label, int fair, double seconds, int numHeavy, int numLight, int batchSize) {
+    // Server in a child process, so each run starts from an empty exchange
+    int pipefd[2];
+    if(pipe(pipefd) < 0) unix_error("pipe error");
+    fflush(stdout);
+    pid_t pid = Fork();
+    if(pid == 0) {
+        close(pipefd[0]);
+        client_registry = creg_init();
+        accounts_init();
+        traders_init();
+        exchange = exchange_init();
+        if(fair) input_sched_start();
+
+        int listenfd = listener_open_tcp("0", 0);
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        getsockname(listenfd, (SA *)&addr, &addrlen);
+        int portNum = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+        if(write(pipefd[1], &portNum, sizeof(portNum)) < 0) _exit(EXIT_FAILURE);
+        listener_run(listenfd, -1);
+    }
+    close(pipefd[1]);
+    int portNum = 0;
+    if(read(pipefd[0], &portNum, sizeof(portNum)) != sizeof(portNum)) unix_error("Server did not start");
+    close(pipefd[0]);
+    char port[16];
+    snprintf(port, sizeof(port), "%d", portNum);
+
+    // Heavy and light traders run side by side until the time is up
+    int numClients = numHeavy + numLight;
+    CLIENT *clients = Malloc(numClients * sizeof(CLIENT));
+    pthread_t *tids = Malloc(numClients * sizeof(pthread_t));
+    double end = now_us() + seconds * 1e6;
+    for(int i = 0; i < numClients; i++) {
+        memset(&clients[i], 0, sizeof(CLIENT));
+        clients[i].port = port;
+        clients[i].id = i;
+        clients[i].batch = batchSize;
+        clients[i].end = end;
+        if(i < numHeavy) Pthread_create(&tids[i], NULL, heavy_trader, &clients[i]);
+        else {
+            clients[i].buyLatency = Malloc(MAX_SAMPLES * sizeof(double));
+            clients[i].cancelLatency = Malloc(MAX_SAMPLES * sizeof(double));
+            Pthread_create(&tids[i], NULL, light_trader, &clients[i]);
+        }
+    }
+    for(int i = 0; i < numClients; i++) Pthread_join(tids[i], NULL);
+
+    // Pool the light traders' latencies
+    long heavyOrders = 0, lightCount = 0;
+    for(int i = 0; i < numHeavy; i++) heavyOrders = heavyOrders + clients[i].count;
+    for(int i = numHeavy; i < numClients; i++) lightCount = lightCount + clients[i].count;
+    double *buys = Malloc((lightCount + 1) * sizeof(double));
+    double *cancels = Malloc((lightCount + 1) * sizeof(double));
+    long n = 0;
+    for(int i = numHeavy; i < numClients; i++) {
+        memcpy(&buys[n], clients[i].buyLatency, clients[i].count * sizeof(double));
+        memcpy(&cancels[n], clients[i].cancelLatency, clients[i].count * sizeof(double));
+        n = n + clients[i].count;
+        Free(clients[i].buyLatency);
+        Free(clients[i].cancelLatency);
+    }
+    printf("%s: heavy traders sent %.0f orders/s\n", label, heavyOrders / seconds);
+    report("BUY", buys, lightCount);
+    report("CANCEL", cancels, lightCount);
+
+    // Closing a connection while the server is broadcasting to it would end the server early
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    for(int i = 0; i < numClients; i++) close(clients[i].fd);
+    Free(buys);
+    Free(cancels);
+    Free(tids);
+    Free(clients);
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 3;
+    int numHeavy = (argc > 2) ? atoi(argv[2]) : 4;
+    int numLight = (argc > 3) ? atoi(argv[3]) : 4;
+    int batchSize = (argc > 4) ? atoi(argv[4]) : 64;
+    if(numHeavy < 0 || numLight < 1 || numHeavy + numLight > MAX_TRADERS || batchSize < 1) {
+        fprintf(stderr, "Usage: %s [seconds] [heavy traders] [light traders] [batch]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    run("direct", 0, seconds, numHeavy, numLight, batchSize);
+    run("fair input", 1, seconds, numHeavy, numLight, batchSize);
+    return EXIT_SUCCESS;
+}
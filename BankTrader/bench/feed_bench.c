@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "exchange.h"
+#include "trader.h"
+#include "account.h"
+#include "structs.h"
+#include "csapp.h"
+
+/*
+ * Market-data fanout benchmark.
+ *
+ * A set of sessions, each a logged-in trader whose connection is one end of
+ * a socket pair, watch a maker and a taker trade one unit at a time.  Each
+ * trade is two POSTED and one TRADED notification.  The sessions are
+ * subscribed to them or not in turn, from all of them down to none, and the
+ * trades are timed through the exchange for each share.  A thread reads
+ * the other ends of the socket pairs so the writes never block.
+ *
+ * Usage: feed_bench [sessions] [trades]
+ */
+
+static int numSessions;
+static int readEnds[MAX_TRADERS];
+static volatile int draining = 1;
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *drain(void *arg) {
+    struct pollfd fds[MAX_TRADERS];
+    char buf[65536];
+    for(int i = 0; i < numSessions; i++) {
+        fds[i].fd = readEnds[i];
+        fds[i].events = POLLIN;
+    }
+    while(draining) {
+        if(poll(fds, numSessions, 10) <= 0) continue;
+        for(int i = 0; i < numSessions; i++) {
+            if(fds[i].revents & POLLIN) (void)read(fds[i].fd, buf, sizeof(buf));
+        }
+    }
+    return NULL;
+}
+
+static int book_empty(EXCHANGE *xchg) {
+    pthread_mutex_lock(&xchg->mLock);
+    int empty = (xchg->asks == NULL && xchg->bids == NULL);
+    pthread_mutex_unlock(&xchg->mLock);
+    return empty;
+}
+
+int main(int argc, char *argv[]) {
+    numSessions = (argc > 1) ? atoi(argv[1]) : 48;
+    int trades = (argc > 2) ? atoi(argv[2]) : 20000;
+    if(numSessions > MAX_TRADERS - 2) numSessions = MAX_TRADERS - 2;
+    int shares[] = {100, 50, 25, 10, 0};
+
+    accounts_init();
+    traders_init();
+    EXCHANGE *xchg = exchange_init();
+
+    // The maker and taker are logged in without a connection, so only the sessions are written to
+    TRADER *maker = trader_login(-1, "maker");
+    TRADER *taker = trader_login(-1, "taker");
+    account_increase_inventory(trader_get_account(maker), trades * 5);
+    account_increase_balance(trader_get_account(taker), trades * 5 * 100);
+
+    TRADER *sessions[MAX_TRADERS];
+    char name[32];
+    for(int i = 0; i < numSessions; i++) {
+        int pair[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        readEnds[i] = pair[1];
+        snprintf(name, sizeof(name), "session%d", i);
+        sessions[i] = trader_login(pair[0], name);
+    }
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drain, NULL);
+
+    for(int s = 0; s < 5; s++) {
+        // The first share of the sessions get the trades and postings, the others nothing
+        int subscribed = numSessions * shares[s] / 100;
+        for(int i = 0; i < numSessions; i++) {
+            trader_set_feeds(sessions[i], BRS_FEED_ALL, (i < subscribed) ? BRS_FEED_DEFAULT : 0);
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int t = 0; t < trades; t++) {
+            exchange_post_sell(xchg, maker, 1, 100);
+            exchange_post_buy(xchg, taker, 1, 100);
+        }
+        while(!book_empty(xchg)) sched_yield();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double time = elapsed(&start, &end);
+        printf("%3d%% of %d sessions subscribed: %8.0f trades/s, %.2f us/trade\n",
+               shares[s], numSessions, trades / time, time / trades * 1e6);
+    }
+
+    draining = 0;
+    pthread_join(drainer, NULL);
+    return EXIT_SUCCESS;
+}
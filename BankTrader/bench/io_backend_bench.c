@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+
+#include "server.h"
+#include "listener.h"
+#include "event_loop.h"
+#include "protocol.h"
+#include "account.h"
+#include "trader.h"
+#include "csapp.h"
+
+/*
+ * Request throughput and latency of the session I/O backends.
+ *
+ * For each backend (a session worker per connection, epoll, and io_uring
+ * when built with IO_URING=1) and each session count, a server is started
+ * in a child process and the benchmark opens that many connections to it.
+ * Every connection keeps one STATUS request outstanding for the duration
+ * of the run.  The connections do not log in, since the server has room
+ * for only MAX_TRADERS traders, so each request is answered with a NACK
+ * by the same request handler as always; what is measured is the cost of
+ * getting requests in and responses out.
+ *
+ * Usage: io_backend_bench [seconds] [sessions ...]
+ */
+
+#define CLIENT_MAX_EVENTS 256
+#define MAX_SAMPLES (4 * 1024 * 1024)
+
+typedef struct bench_conn {
+    int fd;                     // Client end of the connection
+    double sent;                // When the outstanding request was sent
+    size_t got;                 // Bytes of the response received so far
+} BENCH_CONN;
+
+static double now_us(void) {
+    struct timespec currTime;
+    clock_gettime(CLOCK_MONOTONIC, &currTime);
+    return currTime.tv_sec * 1e6 + currTime.tv_nsec / 1e3;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(double *)a;
+    double y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+// Run a server with a backend in a child process, returning its port through a pipe
+static pid_t start_server(int backend, char *port, size_t portLen) {
+    int pipefd[2];
+    if(pipe(pipefd) < 0) unix_error("pipe error");
+    fflush(stdout);
+    pid_t pid = Fork();
+    if(pid == 0) {
+        close(pipefd[0]);
+        client_registry = creg_init();
+        accounts_init();
+        traders_init();
+        exchange = exchange_init();
+        if(evloop_start(backend) == EXIT_FAILURE) _exit(EXIT_FAILURE);
+
+        int listenfd = listener_open_tcp("0", 0);
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        getsockname(listenfd, (SA *)&addr, &addrlen);
+        int portNum = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+        if(write(pipefd[1], &portNum, sizeof(portNum)) < 0) _exit(EXIT_FAILURE);
+        close(pipefd[1]);
+        listener_run(listenfd, -1);
+    }
+
+    close(pipefd[1]);
+    int portNum = 0;
+    ssize_t n = read(pipefd[0], &portNum, sizeof(portNum));
+    close(pipefd[0]);
+    if(n != sizeof(portNum)) {
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    snprintf(port, portLen, "%d", portNum);
+    return pid;
+}
+
+static void send_request(BENCH_CONN *conn) {
+    BRS_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = BRS_STATUS_PKT;
+    conn->sent = now_us();
+    conn->got = 0;
+    if(write(conn->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) unix_error("Write error");
+}
+
+static void run(char *label, int backend, int numSessions, double seconds) {
+    char port[16];
+    pid_t pid = start_server(backend, port, sizeof(port));
+    if(pid < 0) {
+        printf("%-8s %6d sessions: backend not available\n", label, numSessions);
+        return;
+    }
+
+    // Open the sessions
+    int optval = 1;
+    int epfd = epoll_create1(0);
+    BENCH_CONN *conns = Malloc(numSessions * sizeof(BENCH_CONN));
+    for(int i = 0; i < numSessions; i++) {
+        conns[i].fd = Open_clientfd("127.0.0.1", port);
+        setsockopt(conns[i].fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &event);
+    }
+
+    // Keep a request outstanding on every session until the time is up
+    double *latency = Malloc(MAX_SAMPLES * sizeof(double));
+    long count = 0;
+    struct epoll_event events[CLIENT_MAX_EVENTS];
+    for(int i = 0; i < numSessions; i++) send_request(&conns[i]);
+    double start = now_us();
+    double end = start + seconds * 1e6;
+    double now = start;
+    while(now < end) {
+        int numEvents = epoll_wait(epfd, events, CLIENT_MAX_EVENTS, 100);
+        if(numEvents < 0 && errno != EINTR) unix_error("epoll_wait error");
+        now = now_us();
+        for(int i = 0; i < numEvents; i++) {
+            BENCH_CONN *conn = events[i].data.ptr;
+            char buf[sizeof(BRS_PACKET_HEADER)];
+            ssize_t n = read(conn->fd, buf, sizeof(BRS_PACKET_HEADER) - conn->got);
+            if(n <= 0) unix_error("Connection closed");
+            conn->got = conn->got + n;
+            if(conn->got < sizeof(BRS_PACKET_HEADER)) continue;
+
+            if(count < MAX_SAMPLES) latency[count] = now - conn->sent;
+            count++;
+            send_request(conn);
+        }
+    }
+    double total = now_us() - start;
+
+    long samples = (count < MAX_SAMPLES) ? count : MAX_SAMPLES;
+    qsort(latency, samples, sizeof(double), compare);
+    printf("%-8s %6d sessions: %8ld round trips, %8.0f req/s, p50 %8.1f us p99 %8.1f us\n", label,
+           numSessions, count, count / total * 1e6,
+           samples ? latency[samples / 2] : 0, samples ? latency[samples * 99 / 100] : 0);
+
+    // Stop the server and drop the sessions
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    for(int i = 0; i < numSessions; i++) close(conns[i].fd);
+    close(epfd);
+    Free(conns);
+    Free(latency);
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = (argc > 1) ? atof(argv[1]) : 2;
+    int defaultSessions[] = {1000, 10000};
+    int numCounts = (argc > 2) ? argc - 2 : 2;
+
+    // Each process holds one end of every session
+    struct rlimit fdLimit;
+    getrlimit(RLIMIT_NOFILE, &fdLimit);
+    fdLimit.rlim_cur = fdLimit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fdLimit);
+
+    for(int c = 0; c < numCounts; c++) {
+        int numSessions = (argc > 2) ? atoi(argv[c + 2]) : defaultSessions[c];
+        if(numSessions + 64 > fdLimit.rlim_cur) {
+            numSessions = fdLimit.rlim_cur - 64;
+            printf("Open file limit allows %d sessions\n", numSessions);
+        }
+        run("threads", EVLOOP_THREADS, numSessions, seconds);
+        run("epoll", EVLOOP_EPOLL, numSessions, seconds);
+        run("io_uring", EVLOOP_URING, numSessions, seconds);
+    }
+    return EXIT_SUCCESS;
+}
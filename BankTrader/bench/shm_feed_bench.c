@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "shm_feed.h"
+
+/*
+ * Latency benchmark for the shared-memory market data feed.
+ *
+ * A writer thread publishes trades at a fixed pace, and a reader thread
+ * mapping the segment read-only spins on it.  The latency is the time
+ * from just before a trade is published until the reader has copied it.
+ * Both threads use the same clock as the feed timestamps.
+ *
+ * Usage: shm_feed_bench [trades] [gap ns]
+ */
+
+#define BENCH_SHM_NAME "/bourse_feed_bench"
+
+static uint64_t numTrades;
+static uint64_t gapNs;
+static uint64_t *sentAt;
+
+static uint64_t now_ns(void) {
+    struct timespec currTime;
+    timespec_get(&currTime, TIME_UTC);
+    return (uint64_t)currTime.tv_sec * 1000000000 + currTime.tv_nsec;
+}
+
+static void *writer(void *arg) {
+    for(uint64_t n = 1; n <= numTrades; n++) {
+        // Busy-wait to pace the trades without sleeping
+        uint64_t start = now_ns();
+        while(now_ns() - start < gapNs);
+        sentAt[n] = now_ns();
+        shm_feed_trade(n, n, 1, n);
+    }
+    return NULL;
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = *(uint64_t *)a;
+    uint64_t y = *(uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    numTrades = (argc > 1) ? atol(argv[1]) : 100000;
+    gapNs = (argc > 2) ? atol(argv[2]) : 2000;
+    sentAt = calloc(numTrades + 1, sizeof(uint64_t));
+    uint64_t *latency = calloc(numTrades + 1, sizeof(uint64_t));
+
+    if(shm_feed_init(BENCH_SHM_NAME) == EXIT_FAILURE) {
+        fprintf(stderr, "Unable to create %s\n", BENCH_SHM_NAME);
+        exit(EXIT_FAILURE);
+    }
+    SHM_FEED *feed = shm_feed_open(BENCH_SHM_NAME);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, writer, NULL);
+
+    // Spin on the ring and time each trade as it shows up
+    SHM_TRADE trade;
+    uint64_t received = 0, lost = 0;
+    uint64_t next = 1;
+    while(next <= numTrades) {
+        int ret = shm_feed_read_trade(feed, next, &trade);
+        if(ret == 1) continue;
+        if(ret == 0) latency[received++] = now_ns() - sentAt[next];
+        else lost++;
+        next++;
+    }
+    pthread_join(tid, NULL);
+
+    qsort(latency, received, sizeof(uint64_t), compare);
+    printf("trades %lu received %lu lost %lu\n", numTrades, received, lost);
+    if(received > 0) {
+        printf("latency ns: p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n",
+               latency[received / 2], latency[received * 9 / 10], latency[received * 99 / 100],
+               latency[received * 999 / 1000], latency[received - 1]);
+    }
+
+    shm_feed_close(feed);
+    shm_feed_fini();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "exchange.h"
+#include "trader.h"
+#include "account.h"
+#include "structs.h"
+#include "csapp.h"
+
+/*
+ * Sweep benchmark for the matchmaker.
+ *
+ * A set of makers rest one-unit asks on many price levels, then a taker
+ * posts a single buy that sweeps all of them.  The first part times the
+ * whole sweep through the exchange.  The second part replays the same
+ * fills against the accounts twice: once with the per-fill account calls
+ * the matchmaker used to make, and once with the per-pass settlement it
+ * makes now.
+ *
+ * Traders are logged in without a connection, so no packets are written
+ * and only the matching and settlement work is measured.
+ *
+ * Usage: sweep_bench [levels] [rounds]
+ */
+
+#define NUM_MAKERS 16
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int book_empty(EXCHANGE *xchg) {
+    pthread_mutex_lock(&xchg->mLock);
+    int empty = (xchg->asks == NULL);
+    pthread_mutex_unlock(&xchg->mLock);
+    return empty;
+}
+
+int main(int argc, char *argv[]) {
+    int levels = (argc > 1) ? atoi(argv[1]) : 1000;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 20;
+
+    accounts_init();
+    traders_init();
+    EXCHANGE *xchg = exchange_init();
+
+    // Log in the makers and the taker without a client connection
+    TRADER *makers[NUM_MAKERS];
+    char name[32];
+    for(int i = 0; i < NUM_MAKERS; i++) {
+        snprintf(name, sizeof(name), "maker%d", i);
+        makers[i] = trader_login(-1, name);
+        account_increase_inventory(trader_get_account(makers[i]), levels * rounds);
+    }
+    TRADER *taker = trader_login(-1, "taker");
+    account_increase_balance(trader_get_account(taker), (funds_t)levels * (levels + 1) * rounds);
+
+    // Full sweeps through the exchange
+    double sweepTime = 0;
+    struct timespec start, end;
+    for(int r = 0; r < rounds; r++) {
+        for(int l = 0; l < levels; l++) {
+            exchange_post_sell(xchg, makers[l % NUM_MAKERS], 1, l + 1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        exchange_post_buy(xchg, taker, levels, levels);
+        while(!book_empty(xchg)) sched_yield();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        sweepTime += elapsed(&start, &end);
+    }
+    printf("sweep: %d levels x %d rounds, %.1f us/sweep, %.0f fills/s\n",
+           levels, rounds, sweepTime / rounds * 1e6, (double)levels * rounds / sweepTime);
+
+    // Settlement of the same fills, one locked update per account call
+    ACCOUNT *takerAcc = trader_get_account(taker);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int r = 0; r < rounds; r++) {
+        for(int l = 0; l < levels; l++) {
+            ACCOUNT *buyerAcc = trader_get_account(taker);
+            ACCOUNT *sellerAcc = trader_get_account(makers[l % NUM_MAKERS]);
+            account_increase_inventory(buyerAcc, 1);
+            account_increase_balance(sellerAcc, l + 1);
+            account_increase_balance(buyerAcc, levels - (l + 1));
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double perFill = elapsed(&start, &end);
+
+    // Settlement of the same fills, accumulated and applied once per account per pass
+    LEDGER_DELTA delta[NUM_MAKERS + 1];
+    account_hold_balance(takerAcc, (funds_t)levels * levels * rounds);
+    for(int i = 0; i < NUM_MAKERS; i++) account_hold_inventory(makers[i]->currAccount, levels * rounds / NUM_MAKERS);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int r = 0; r < rounds; r++) {
+        memset(delta, 0, sizeof(delta));
+        for(int l = 0; l < levels; l++) {
+            delta[l % NUM_MAKERS].heldInventory += 1;
+            delta[l % NUM_MAKERS].proceeds += l + 1;
+            delta[NUM_MAKERS].heldFunds += levels;
+            delta[NUM_MAKERS].paidFunds += l + 1;
+            delta[NUM_MAKERS].bought += 1;
+        }
+        for(int i = 0; i < NUM_MAKERS; i++) account_settle(makers[i]->currAccount, &delta[i]);
+        account_settle(takerAcc, &delta[NUM_MAKERS]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double batched = elapsed(&start, &end);
+
+    printf("settlement per fill: %.1f us/sweep\n", perFill / rounds * 1e6);
+    printf("settlement batched:  %.1f us/sweep (%.1fx)\n", batched / rounds * 1e6, perFill / batched);
+    return EXIT_SUCCESS;
+}
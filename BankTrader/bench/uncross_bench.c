@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "exchange.h"
+#include "trader.h"
+#include "account.h"
+#include "structs.h"
+#include "csapp.h"
+
+/*
+ * Uncross benchmark for call-auction mode.
+ *
+ * Traders rest bids and asks spread over the same range of prices, so
+ * about half of the book is crossed, then the whole book is uncrossed at
+ * one clearing price.  The same book is then built again and matched the
+ * way continuous matching does, one pair of orders at a time.  Both are
+ * timed under the exchange lock for book sizes growing tenfold up to the
+ * maximum.
+ *
+ * The exchange is put in call-auction mode with an interval longer than
+ * the run, so the matchmaker leaves the book alone while it is built.
+ * Traders are logged in without a connection, so no packets are written.
+ *
+ * Usage: uncross_bench [max orders] [rounds]
+ */
+
+#define NUM_TRADERS 16
+#define LOW_PRICE 900
+#define NUM_PRICES 201
+#define ORDER_QUANTITY 10
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Rest half the orders as bids and half as asks, each side posted from the back of
+// the book to the front so every order is inserted next to the head
+static void build_book(EXCHANGE *xchg, TRADER **traders, int numOrders) {
+    int perSide = numOrders / 2;
+    for(int i = 0; i < perSide; i++) {
+        funds_t price = LOW_PRICE + (funds_t)((long)i * NUM_PRICES / perSide);
+        exchange_post_order(xchg, traders[i % NUM_TRADERS], ORDER_QUANTITY, price, 1, 0);
+    }
+    for(int i = 0; i < perSide; i++) {
+        funds_t price = LOW_PRICE + NUM_PRICES - 1 - (funds_t)((long)i * NUM_PRICES / perSide);
+        exchange_post_order(xchg, traders[(i + 1) % NUM_TRADERS], ORDER_QUANTITY, price, 0, 0);
+    }
+}
+
+static void clear_book(EXCHANGE *xchg, TRADER **traders) {
+    quantity_t quantity;
+    for(int i = 0; i < NUM_TRADERS; i++) exchange_cancel_all(xchg, traders[i], &quantity);
+}
+
+// Time one pass over a freshly built book, then empty the book again
+static double time_pass(EXCHANGE *xchg, TRADER **traders, int numOrders, void (*pass)(EXCHANGE *)) {
+    struct timespec start, end;
+    build_book(xchg, traders, numOrders);
+    pthread_mutex_lock(&xchg->mLock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pass(xchg);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_unlock(&xchg->mLock);
+    clear_book(xchg, traders);
+    return elapsed(&start, &end);
+}
+
+int main(int argc, char *argv[]) {
+    int maxOrders = (argc > 1) ? atoi(argv[1]) : 100000;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 5;
+    if(maxOrders < 1000 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [max orders (at least 1000)] [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    accounts_init();
+    traders_init();
+    EXCHANGE *xchg = exchange_init();
+    exchange_set_auction(xchg, 1000ULL * 1000000);
+
+    // Log in the traders without a client connection, with enough for every round
+    // (the funds and the inventory of all the accounts together fit in 32 bits)
+    TRADER *traders[NUM_TRADERS];
+    char name[32];
+    for(int i = 0; i < NUM_TRADERS; i++) {
+        snprintf(name, sizeof(name), "trader%d", i);
+        traders[i] = trader_login(-1, name);
+        account_increase_balance(trader_get_account(traders[i]), UINT32_MAX / NUM_TRADERS);
+        account_increase_inventory(trader_get_account(traders[i]), UINT32_MAX / NUM_TRADERS);
+    }
+
+    for(int numOrders = 1000; numOrders <= maxOrders; numOrders = numOrders * 10) {
+        double uncrossTime = 0, matchTime = 0;
+        for(int r = 0; r < rounds; r++) {
+            uncrossTime += time_pass(xchg, traders, numOrders, exchange_uncross);
+            matchTime += time_pass(xchg, traders, numOrders, exchange_match);
+        }
+        printf("%7d orders: uncross %9.1f us, continuous match %9.1f us (%.1fx)\n", numOrders,
+               uncrossTime / rounds * 1e6, matchTime / rounds * 1e6, matchTime / uncrossTime);
+    }
+    return EXIT_SUCCESS;
+}
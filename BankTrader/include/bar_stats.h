@@ -0,0 +1,78 @@
+#ifndef BAR_STATS_H
+#define BAR_STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+
+/*
+ * Trade statistics in bars (OHLC, volume and VWAP).
+ *
+ * The exchange adds every fill to a series of bars for each interval
+ * length, so clients that only want bars can ask for them instead of
+ * building them from the TRADED notifications.  A bar covers one interval
+ * in which there were trades; intervals without trades have none.  The
+ * session series has a single bar that starts with the first trade.
+ *
+ * Each series keeps its last BAR_HISTORY bars in a ring, bar n (counting
+ * from 0) in slot n % BAR_HISTORY.  There is a single writer (the exchange,
+ * under its lock), so every bar is protected by a sequence lock, as in the
+ * shared-memory feed, and readers copy the bars without any lock: a reader
+ * retries a bar that was written while it copied it, and skips one the
+ * writer has already reused for a newer bar.
+ */
+
+#define BAR_HISTORY (BRS_MAX_BARS + 1)  // Bars kept, one more than a reader can ask for
+#define BAR_NUM_SERIES 4            // Interval lengths kept, the session included
+
+typedef struct bar {
+    _Atomic uint64_t seq;       // Sequence lock, odd while being written
+    uint64_t number;            // Number of the bar in its series
+    uint64_t start;             // Start of the interval (seconds since the epoch)
+    funds_t open;               // Price of the first trade
+    funds_t high;               // Highest price
+    funds_t low;                // Lowest price
+    funds_t close;              // Price of the last trade
+    uint64_t volume;            // Quantity traded
+    uint64_t notional;          // Sum of quantity times price, for the VWAP
+    uint32_t trades;            // Number of trades
+} BAR;
+
+typedef struct bar_series {
+    uint32_t seconds;           // Length of the intervals, 0 for the session
+    _Atomic uint64_t numBars;   // Bars started so far
+    BAR bars[BAR_HISTORY];
+} BAR_SERIES;
+
+typedef struct bar_stats {
+    BAR_SERIES series[BAR_NUM_SERIES];  // 1, 60 and 3600 seconds, then the session
+} BAR_STATS;
+
+/*
+ * Set up empty series.
+ */
+void stats_init(BAR_STATS *stats);
+
+/*
+ * Add a trade to the bar of its interval in each series, starting a new
+ * bar where the interval has changed.  Must only be called by one thread
+ * at a time.
+ *
+ * @param when  Time of the trade, in seconds since the epoch.
+ */
+void stats_trade(BAR_STATS *stats, uint64_t when, quantity_t quantity, funds_t price);
+
+/*
+ * Copy the most recent bars of a series, without locking.
+ *
+ * @param seconds  Length of the intervals, 0 for the session.
+ * @param count  Number of bars wanted, at most BRS_MAX_BARS.
+ * @param info  The reply, with room for count bars.
+ * @return The size of the reply in bytes, or 0 if there is no series of
+ * that interval length.
+ */
+size_t stats_bars(BAR_STATS *stats, uint32_t seconds, int count, BRS_STATS_INFO *info);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef BOOK_DEPTH_H
+#define BOOK_DEPTH_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+
+/*
+ * Aggregated depth of the order book (L2).
+ *
+ * Each side of the book is summarized as an array of price levels, best
+ * price first, holding the total quantity shown at the price and the
+ * number of orders there.  The exchange reports every change to the
+ * quantity shown on the book, so a snapshot of the top N levels is a copy
+ * of the front of each array, without walking the orders.
+ *
+ * Levels that change are remembered until the next flush, which turns them
+ * into one DEPTH_UPDATE per flush (more if there are too many levels for a
+ * packet), each with the next sequence number of the book.  A level whose
+ * last order leaves stays in its array with nothing shown until then, so
+ * it can be reported as removed, and is dropped by the flush.
+ *
+ * A BOOK_DEPTH is not locked; the exchange lock protects it.
+ */
+
+typedef struct depth_level {
+    funds_t price;              // Price of the level
+    quantity_t quantity;        // Total quantity shown at the price
+    uint32_t numOrders;         // Number of orders at the price, 0 until the flush drops the level
+    int changed;                // Changed since the last flush
+} DEPTH_LEVEL;
+
+typedef struct depth_side {
+    DEPTH_LEVEL *levels;        // Best price first
+    int numLevels;              // Levels in use
+    int maxLevels;              // Levels allocated
+    int descending;             // Highest price first (bids)
+} DEPTH_SIDE;
+
+typedef struct depth_change {
+    int isBid;                  // Side of the level
+    funds_t price;              // Price of the level
+} DEPTH_CHANGE;
+
+// Called with each DEPTH_UPDATE a flush makes, and the argument given to the flush
+typedef int (*DEPTH_SINK)(BRS_PACKET_HEADER *pkt, void *data, void *arg);
+
+typedef struct book_depth {
+    DEPTH_SIDE bids;            // Bid levels, highest price first
+    DEPTH_SIDE asks;            // Ask levels, lowest price first
+    DEPTH_CHANGE *changes;      // Levels changed since the last flush, each once
+    int numChanges;
+    int maxChanges;
+    uint32_t seq;               // Sequence number of the last DEPTH_UPDATE
+} BOOK_DEPTH;
+
+/*
+ * Set up an empty book at sequence number 0.
+ */
+void depth_init(BOOK_DEPTH *depth);
+
+/*
+ * Free the levels of a book.
+ */
+void depth_fini(BOOK_DEPTH *depth);
+
+/*
+ * Change the quantity shown at a price level, and its number of orders.
+ *
+ * @param depth  The book.
+ * @param isBid  Nonzero for the bid side, 0 for the ask side.
+ * @param price  The price of the level, which is created if needed.
+ * @param quantity  Quantity added to the level, negative if taken off.
+ * @param orders  Orders added to the level, negative if taken off.
+ */
+void depth_update(BOOK_DEPTH *depth, int isBid, funds_t price, int64_t quantity, int orders);
+
+/*
+ * Copy the best levels of each side into a snapshot.
+ *
+ * @param info  The snapshot, with room for maxLevels levels of each side.
+ * @return The size of the snapshot, in bytes.
+ */
+size_t depth_snapshot(BOOK_DEPTH *depth, int maxLevels, BRS_DEPTH_INFO *info);
+
+/*
+ * Hand the levels changed since the last flush to a sink as DEPTH_UPDATE
+ * packets, with arg, and drop the levels left without orders.  Nothing is sent if
+ * no level has changed.
+ */
+void depth_flush(BOOK_DEPTH *depth, DEPTH_SINK sink, void *arg);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/*
+ * Event-driven I/O backends for client sessions.
+ *
+ * By default every client connection is served by a session worker that
+ * blocks in Read for each request.  An event loop instead serves every
+ * connection from a single thread: it waits for input on all of them at
+ * once, frames the bytes received into packets and hands each packet to
+ * brs_session_request, the same code the session workers run.  Only the
+ * receive side goes through the event loop; responses and notifications
+ * go through the output queue of each session (see out_queue.h), whose
+ * sends never wait, so a client that does not read holds up neither the
+ * loop nor any other connection, and is disconnected once too much is
+ * waiting for it.  Connections served by the loop are made non-blocking.
+ *
+ * Two backends are available:
+ *
+ *   epoll     epoll_wait reports the readable connections, each of which
+ *             is then drained with non-blocking recv calls.
+ *   io_uring  Each connection has one multishot receive armed, which keeps
+ *             delivering data into buffers taken from a ring of provided
+ *             buffers registered with the kernel, so a single
+ *             io_uring_enter returns the input of many connections.  This
+ *             backend is only compiled in when the server is built with
+ *             "make IO_URING=1".
+ */
+
+typedef enum {
+    EVLOOP_THREADS,             // No event loop, a session worker per connection
+    EVLOOP_EPOLL,               // epoll readiness loop
+    EVLOOP_URING                // io_uring completion loop
+} EVLOOP_BACKEND;
+
+/*
+ * Look up a backend by name ("threads", "epoll" or "io_uring").
+ *
+ * @return The backend, or -1 if the name is unknown.
+ */
+int evloop_backend(char *name);
+
+/*
+ * Start the event loop thread for a backend.  Connections accepted after
+ * this call are served by the event loop instead of session workers.
+ *
+ * @param backend  The backend to use.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the backend is not available
+ * (io_uring not compiled in or not supported by the kernel).
+ */
+int evloop_start(EVLOOP_BACKEND backend);
+
+/*
+ * Whether connections are being served by an event loop.
+ */
+int evloop_active(void);
+
+/*
+ * Hand an accepted connection to the event loop, which registers it
+ * and serves it until it is closed.
+ *
+ * @param fileDesc  The connection.
+ */
+void evloop_add(int fileDesc);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef INPUT_SCHED_H
+#define INPUT_SCHED_H
+
+#include "protocol.h"
+
+/*
+ * Input stage between the client sessions and the exchange.
+ *
+ * Without it, every session carries out its own requests and they all race
+ * for the exchange lock, so a trader pipelining orders from a fast loop
+ * gets most of the turns.  With it, sessions queue the requests of their
+ * trader that go to the exchange (BUY, SELL, QUOTE, CANCEL and
+ * MASS_CANCEL), and one sequencer thread carries them out:
+ *
+ *   - CANCEL and MASS_CANCEL requests go into a priority lane, which is
+ *     always served first, so that reducing risk never waits behind new
+ *     orders.  A MASS_CANCEL also drops (with a NACK each) the orders and
+ *     quotes of its trader that are still queued.
+ *   - Orders and quotes wait in a queue per trader, and the queues of the
+ *     traders with queued requests are served by deficit round robin: on
+ *     its turn a trader gets INPUT_QUANTUM units of credit, one per
+ *     request carried out.  A trader with a long queue therefore gets the
+ *     same share of turns as one with a single request.
+ *
+ * Requests of one trader are carried out in the order they were received,
+ * except that cancels can overtake that trader's own queued requests.
+ * Account requests (STATUS, DEPOSIT, WITHDRAW, ESCROW, RELEASE, STATS and
+ * the like) are answered by the session right away, so they can overtake
+ * queued orders as well.  Replies go through the session's output queue
+ * (see out_queue.h), so the sequencer never waits for a client.
+ */
+
+#define INPUT_QUANTUM 4             // Credit a trader gets on each turn
+#define INPUT_MAX_QUEUED 4096       // Requests a trader may have queued
+
+struct trader;
+
+/*
+ * Start the sequencer thread.  Requests of logged-in traders are queued
+ * from then on.
+ */
+void input_sched_start(void);
+
+/*
+ * Whether requests are going through the input stage.
+ */
+int input_sched_active(void);
+
+/*
+ * Queue a request of a trader.
+ *
+ * @param trader  The trader that sent the request.
+ * @param hdr  The request header, which is copied.
+ * @param payload  The request payload, or NULL.  The input stage frees it
+ * once the request has been carried out.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the trader already has
+ * INPUT_MAX_QUEUED requests queued, in which case the payload is left
+ * to the caller.
+ */
+int input_submit(struct trader *trader, BRS_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Drop the queued requests of a trader whose session is ending, and wait
+ * until the sequencer is not carrying out one of its requests.
+ *
+ * @param trader  The trader.
+ */
+void input_drop(struct trader *trader);
+
+#endif
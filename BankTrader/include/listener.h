@@ -0,0 +1,73 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/*
+ * Listening sockets, acceptor threads and session workers for the server.
+ *
+ * An acceptor thread accepts connections on one listening socket and
+ * hands each connection straight to a session worker, which runs the
+ * client service loop (brs_client_session) for it.  Workers are kept in
+ * a pool: a worker whose client has disconnected waits for the next
+ * connection instead of exiting, so a burst of reconnections does not
+ * pay for a thread creation per connection.  New workers are only
+ * started when every existing one is busy.
+ *
+ * To spread a connection storm over several cores, several TCP listening
+ * sockets can be bound to the same port with SO_REUSEPORT, in which case
+ * the kernel balances incoming connections between them, each with its
+ * own acceptor thread.
+ */
+
+/*
+ * Open a TCP socket listening on a port.
+ *
+ * @param port  The port number, as a string.
+ * @param reusePort  Nonzero to set SO_REUSEPORT, so that several sockets
+ * can listen on the same port.
+ * @return The listening file descriptor, or -1 on error.
+ */
+int listener_open_tcp(char *port, int reusePort);
+
+/*
+ * Open a Unix-domain stream socket listening at a path.
+ * A stale socket file left at the path, one that refuses connections, is
+ * removed first.  A socket that a server is still listening on is left
+ * alone and the call fails with EADDRINUSE; a file of any other kind is
+ * left alone and the call fails with EEXIST.
+ *
+ * @param path  Path of the socket in the file system.
+ * @return The listening file descriptor, or -1 with errno set on error.
+ */
+int listener_open_unix(char *path);
+
+/*
+ * Close a Unix-domain listening socket and remove its path.
+ *
+ * @param listenfd  The listening file descriptor.
+ * @param path  Path the socket was bound to.
+ */
+void listener_close_unix(int listenfd, char *path);
+
+/*
+ * Start an acceptor thread for a listening socket.
+ *
+ * @param listenfd  The listening file descriptor.
+ * @param cpu  CPU to pin the acceptor thread to, or -1 to leave it unpinned.
+ */
+void listener_start(int listenfd, int cpu);
+
+/*
+ * Run an acceptor on the calling thread.  Does not return.
+ *
+ * @param listenfd  The listening file descriptor.
+ * @param cpu  CPU to pin the calling thread to, or -1 to leave it unpinned.
+ *
+ * Accepted TCP connections have Nagle's algorithm disabled, since every
+ * packet is a latency-sensitive request or response.  When the process
+ * runs out of descriptors, the connection waiting to be accepted is
+ * closed at once, using a descriptor held in reserve, and the acceptor
+ * pauses briefly before trying again.
+ */
+void listener_run(int listenfd, int cpu);
+
+#endif
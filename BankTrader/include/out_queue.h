@@ -0,0 +1,59 @@
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "protocol.h"
+
+/*
+ * Output queue of a client connection.
+ *
+ * Everything sent to a client goes through the queue of its session, from
+ * whichever thread sends it: the session itself, an event loop, the
+ * sequencer or the matchmaker.  A packet is written with a non-blocking
+ * send; what the connection cannot take at once is kept in the queue, and
+ * a flusher thread writes it out as the connection becomes writable, so
+ * no sender ever waits for a client that does not read.  Packets stay in
+ * the order they were sent, and are never interleaved.
+ *
+ * A client that lets more than OUTQ_MAX_BYTES pile up is disconnected:
+ * its connection is shut down, which ends its session through the usual
+ * path, and whatever is sent to it from then on is dropped.
+ */
+
+#define OUTQ_MAX_BYTES (8 << 20)    // Bytes a connection may leave unread
+
+typedef struct out_queue {
+    pthread_mutex_t lock;       // Orders the writers, and protects what follows
+    int fileDesc;               // The connection
+    char *buf;                  // Bytes the connection has not taken yet, from buf + head
+    size_t head;
+    size_t len;                 // Number of bytes waiting
+    size_t cap;                 // Capacity of buf
+    int watched;                // Registered with the flusher
+    int failed;                 // Write error or overflow, nothing more is sent
+} OUT_QUEUE;
+
+/*
+ * Set up the queue of a connection.
+ */
+void outq_init(OUT_QUEUE *queue, int fileDesc);
+
+/*
+ * Send a packet without waiting, queueing what the connection cannot take
+ * at once.  The timestamps of the header are set, as by proto_send_packet.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the connection failed or the
+ * client was disconnected for not reading.
+ */
+int outq_send(OUT_QUEUE *queue, BRS_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Stop flushing a queue and free it, dropping what has not been written.
+ * Nothing may be sent to the queue any more, and the connection is closed
+ * afterwards.
+ */
+void outq_fini(OUT_QUEUE *queue);
+
+#endif
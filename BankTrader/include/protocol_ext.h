@@ -0,0 +1,368 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Extensions to the "Bourse" protocol.
+ *
+ * protocol.h is kept as-is, so packet types added after the original
+ * protocol continue the numbering of BRS_PACKET_TYPE here, and their
+ * payload structures live next to them.  All multibyte fields are in
+ * network byte order, as in the original protocol.
+ *
+ * Client-to-server requests:
+ *   LOGIN:    The payload may be the username followed by a NUL byte and
+ *             BRS_LOGIN_RESUME_INFO, to resume a session.  BOUGHT and SOLD
+ *             are numbered per username, across sessions, and the server
+ *             keeps the last BRS_REPLAY_SLOTS of them.  The ACK carries
+ *             BRS_RESUME_INFO, and is followed by the kept notifications
+ *             numbered after the one the client saw last, in order.  If
+ *             the first of them is not the next one the client expected,
+ *             some were lost and the account has to be requeried.  For
+ *             the rest of the session, BOUGHT and SOLD carry their
+ *             numbers.  A sequence number of 0 resumes nothing and only
+ *             turns the numbering on, so a client that may want to resume
+ *             has to send even its first LOGIN as the username, a NUL and
+ *             0: after a plain LOGIN, BOUGHT and SOLD carry no numbers and
+ *             the client has nothing to resume from.
+ *             Only BOUGHT and SOLD are numbered and replayed; any other
+ *             notification (CANCELED, MASS_CANCELED, market data, ...)
+ *             sent while the client was away is lost.  And since a
+ *             trader's orders are all canceled when its connection closes,
+ *             nothing trades for it while it is away: the replay covers the
+ *             BOUGHT and SOLD that were in flight when the connection
+ *             dropped, and the resumed session starts without orders.
+ *   DEPOSIT, ESCROW: Refused with a NACK (and then answered with the
+ *             account status as usual) if the funds, or the inventory, of
+ *             all the accounts together would go beyond UINT32_MAX.  Trades
+ *             only move funds and inventory between accounts, so none can
+ *             then receive more than its 32-bit balance or inventory holds.
+ *   BUY, SELL: The payload may be BRS_ORDER_EXT_INFO instead of
+ *             BRS_ORDER_INFO, to give the order an expiry time.  When it
+ *             passes, the order is canceled with a CANCELED notification,
+ *             as if its trader had canceled it.  A time of 0 means the
+ *             order lives until it is filled or canceled, as does an
+ *             order sent with BRS_ORDER_INFO.  An order whose expiry time
+ *             has already passed is refused.
+ *             The payload may also be BRS_ORDER_STOP_INFO, to make it a
+ *             stop order.  A stop is acknowledged and its funds or
+ *             inventory held, but it is not POSTED and does not trade
+ *             until the last trade price reaches its stop price (rises to
+ *             it for a BUY, falls to it for a SELL).  Then a stop-limit is
+ *             POSTED and trades like any order, while a stop-market trades
+ *             what it can at once, no further away than its price, and the
+ *             rest is CANCELED.  Stops triggered together are activated
+ *             buys first, each side from the nearest stop price, and each
+ *             order is matched before the next is activated.  In
+ *             call-auction mode, triggered stops of both kinds rest until
+ *             the next uncross.  A stop price of 0 makes no stop order.
+ *             The payload may also be BRS_ORDER_ICEBERG_INFO, to make it
+ *             an iceberg order that shows only part of its quantity.  It is
+ *             POSTED with its first tip and the rest is held in reserve.
+ *             Each time the tip is filled, a new tip is taken from the
+ *             reserve and POSTED again under the same order id, behind the
+ *             orders already at its price.  CANCEL and CANCELED cover the
+ *             tip and the reserve together.  A display quantity of 0, or
+ *             one not less than the order quantity, shows it all.
+ *   MASS_CANCEL: Cancel every pending order of the requesting trader
+ *             Payload: none
+ *   QUOTE:    Replace all of the trader's quotes (orders posted by an
+ *             earlier QUOTE) with a new set, as one request: the old
+ *             quotes are canceled and the new ones posted together, with
+ *             one change to the funds and inventory held, or nothing
+ *             happens if the account cannot cover the new set.  Quotes are
+ *             limit orders that trade like any other.  A QUOTE without
+ *             levels pulls all of the trader's quotes.
+ *             Payload: BRS_QUOTE_INFO, with the bid levels first
+ *   DEPTH:    Request the best price levels of each side of the book, with
+ *             the total quantity shown and the number of orders at each
+ *             price.  It can also subscribe the session to DEPTH_UPDATE, or
+ *             unsubscribe it, at the point in the update sequence the
+ *             snapshot was taken.
+ *             Payload: BRS_DEPTH_REQ_INFO
+ *   SUBSCRIBE: Choose the classes of market-data notifications sent to the
+ *             session, replacing its choice so far.  A session starts with
+ *             the POSTED, CANCELED and TRADED classes, without DEPTH, which
+ *             DEPTH can also turn on or off, and without CONFLATED.  A
+ *             client that cannot keep up with the market takes CONFLATED
+ *             instead of the other classes.  Notifications to a
+ *             trader about its own orders (ACK, NACK, BOUGHT, SOLD) are
+ *             always sent.  Acknowledged with an ACK without payload.
+ *             Payload: BRS_SUBSCRIBE_INFO
+ *   STATS:    Request the most recent bars of an interval length: the
+ *             open, high, low and close prices, volume, number of trades
+ *             and VWAP of each interval in which there were trades.  The
+ *             exchange keeps bars of 1, 60 and 3600 seconds, and one bar
+ *             for the whole session (interval 0), the last BRS_MAX_BARS
+ *             of each.  Answered without waiting for the exchange.
+ *             Payload: BRS_STATS_REQ_INFO
+ *   HEARTBEAT: Sign of life, accepted with or without a login and never
+ *             answered.  Servers that time out idle sessions count any
+ *             packet as a sign of life; a client with nothing else to
+ *             send replies to each HEARTBEAT from the server with one.
+ *             Payload: none
+ *
+ * Server-to-client responses (synchronous):
+ *   ACK:      Requests that return account status carry BRS_STATUS_EXT_INFO,
+ *             which is BRS_STATUS_INFO followed by the account ledger.
+ *             Clients that only know BRS_STATUS_INFO can ignore the rest
+ *             of the payload.  The ACK to a QUOTE carries the order id of
+ *             the first new quote; the others follow it consecutively, in
+ *             the order of the levels.  The ACK to a DEPTH carries
+ *             BRS_DEPTH_INFO with up to the requested number of levels of
+ *             each side, best price first, and the sequence number of the
+ *             last DEPTH_UPDATE the snapshot includes.  The ACK to a STATS
+ *             carries BRS_STATS_INFO with up to the requested number of
+ *             bars, oldest first; the last one may still be open.
+ *
+ * Server-to-client notifications (asynchronous):
+ *   BOUGHT, SOLD  In a session whose LOGIN gave a sequence number, the
+ *             payload is BRS_NOTIFY_SEQ_INFO, BRS_NOTIFY_INFO followed by
+ *             the notification's sequence number.
+ *   CANCELED  Also sent when an order expires, and when self-trade
+ *             prevention takes quantity off an order whose trader's own
+ *             order on the other side crosses it.  The quantity is what was
+ *             canceled; under the "decrement" mode the larger of the two
+ *             orders stays on the book with the rest.
+ *   MASS_CANCELED  Notification that a batch of pending orders has been
+ *             canceled for some client (mass cancel or disconnect)
+ *             Payload: array of BRS_NOTIFY_INFO, one per canceled order
+ *   UNCROSSED      Notification that the book has been uncrossed in a call
+ *             auction.  The traders whose orders were filled get BOUGHT and
+ *             SOLD as usual, but the individual trades are not broadcast
+ *             with TRADED; this one notification stands for all of them.
+ *             Payload: BRS_NOTIFY_INFO, with the clearing price, the total
+ *             quantity executed and both order ids 0.  Not sent when
+ *             self-trade prevention left nothing to execute
+ *   QUOTED         Notification that a trader's quotes have been replaced,
+ *             standing for the CANCELED and POSTED of each order
+ *             Payload: BRS_QUOTED_INFO
+ *   DEPTH_UPDATE   Notification of the price levels that have changed, sent
+ *             to the sessions subscribed with DEPTH.  Each carries the
+ *             next sequence number of the book, so a subscriber applies the
+ *             updates numbered after its snapshot in order, setting each
+ *             level to the quantity and number of orders given, or removing
+ *             it if the quantity is 0, and knows an update is missing if the
+ *             numbers skip.  Levels beyond those of its snapshot become
+ *             known as they change.
+ *             Payload: BRS_DEPTH_INFO
+ *   CONFLATED      Summary of the market since the last CONFLATED, sent to
+ *             the sessions subscribed to it: the top of book now, and the
+ *             trades (or uncrosses) in between.  The server keeps only this
+ *             summary for each session and sends it once the connection can
+ *             take it without waiting, so a client that reads slowly gets
+ *             fewer, larger summaries instead of falling behind.  Sent when
+ *             the session subscribes, then whenever the top of book changes
+ *             or a trade is made.
+ *             Payload: BRS_CONFLATED_INFO
+ *   HEARTBEAT      Sent by servers that have heartbeats enabled when the
+ *             client has sent nothing for a heartbeat interval
+ *             Payload: none
+ *
+ * Market-data classes (BRS_FEED_CLASS), and the notifications in each:
+ *   POSTED:   POSTED, QUOTED
+ *   CANCELED: CANCELED, MASS_CANCELED
+ *   TRADED:   TRADED, UNCROSSED
+ *   DEPTH:    DEPTH_UPDATE
+ *   CONFLATED: CONFLATED
+ */
+
+/*
+ * Extended packet types.
+ */
+typedef enum {
+    /* Client-to-server*/
+    BRS_MASS_CANCEL_PKT = BRS_TRADED_PKT + 1,
+    /* Server-to_client notifications (asynchronous) */
+    BRS_MASS_CANCELED_PKT,
+    /* Both directions */
+    BRS_HEARTBEAT_PKT,
+    /* Server-to_client notifications (asynchronous) */
+    BRS_UNCROSSED_PKT,
+    /* Client-to-server*/
+    BRS_QUOTE_PKT,
+    /* Server-to_client notifications (asynchronous) */
+    BRS_QUOTED_PKT,
+    /* Client-to-server*/
+    BRS_DEPTH_PKT,
+    /* Server-to_client notifications (asynchronous) */
+    BRS_DEPTH_UPDATE_PKT,
+    /* Client-to-server*/
+    BRS_SUBSCRIBE_PKT,
+    /* Server-to_client notifications (asynchronous) */
+    BRS_CONFLATED_PKT,
+    /* Client-to-server*/
+    BRS_STATS_PKT
+} BRS_EXT_PACKET_TYPE;
+
+/*
+ * Market-data classes, as bits of a subscription.
+ */
+typedef enum {
+    BRS_FEED_POSTED = 0x1,
+    BRS_FEED_CANCELED = 0x2,
+    BRS_FEED_TRADED = 0x4,
+    BRS_FEED_DEPTH = 0x8,
+    BRS_FEED_CONFLATED = 0x10
+} BRS_FEED_CLASS;
+
+#define BRS_FEED_ALL (BRS_FEED_POSTED | BRS_FEED_CANCELED | BRS_FEED_TRADED | BRS_FEED_DEPTH | \
+                      BRS_FEED_CONFLATED)
+#define BRS_FEED_DEFAULT (BRS_FEED_POSTED | BRS_FEED_CANCELED | BRS_FEED_TRADED)
+
+/*
+ * Maximum number of BRS_NOTIFY_INFO entries that fit in the 16-bit
+ * payload size of a single batch notification.
+ */
+#define BRS_MAX_BATCH_NOTIFY (UINT16_MAX / sizeof(BRS_NOTIFY_INFO))
+
+/*
+ * Number of BOUGHT and SOLD notifications kept for each username, to be
+ * replayed when a session is resumed.
+ */
+#define BRS_REPLAY_SLOTS 256
+
+/*
+ * Maximum number of levels in a QUOTE, so that the QUOTED notification
+ * of the quotes it replaces and the ones it posts fits in one packet.
+ */
+#define BRS_MAX_QUOTE_LEVELS 2000
+
+/*
+ * Maximum number of price levels of each side in a DEPTH snapshot, and of
+ * both sides together in a DEPTH_UPDATE, so that either fits in one packet.
+ */
+#define BRS_MAX_DEPTH_LEVELS 2000
+
+/*
+ * Number of bars kept for each interval length, and so the most a STATS
+ * can ask for.
+ */
+#define BRS_MAX_BARS 255
+
+/*
+ * Payload structures.
+ *
+ * In BRS_STATUS_INFO, balance and inventory are the amounts available for
+ * new orders, withdrawal and release.  The ledger adds what is held by
+ * pending orders and the running totals received through trades.
+ */
+typedef struct brs_ledger_info {
+    funds_t held_balance;          // Funds held by pending buy orders
+    funds_t settled_balance;       // Funds received from sales
+    quantity_t held_inventory;     // Inventory held by pending sell orders
+    quantity_t settled_inventory;  // Inventory received from purchases
+} BRS_LEDGER_INFO;
+
+typedef struct brs_login_resume_info {   // For LOGIN, after the username and a NUL byte
+    uint32_t last_seq;             // Sequence number of the last BOUGHT or SOLD seen, 0 for none
+} BRS_LOGIN_RESUME_INFO;
+
+typedef struct brs_resume_info {   // For the ACK to a LOGIN that resumes a session
+    uint32_t first_seq;            // Oldest notification kept, 0 if there is none
+    uint32_t last_seq;             // Newest notification, with which the replay ends
+} BRS_RESUME_INFO;
+
+typedef struct brs_notify_seq_info {   // For BOUGHT and SOLD once LOGIN gave a sequence number
+    BRS_NOTIFY_INFO notify;        // Original notification
+    uint32_t seq;                  // Sequence number of the notification for the username
+} BRS_NOTIFY_SEQ_INFO;
+
+typedef struct brs_order_ext_info {   // For BUY and SELL with an expiry time
+    BRS_ORDER_INFO order;          // Original order information
+    uint32_t expire_sec;           // Expiry time, seconds since the epoch (UTC)
+    uint32_t expire_nsec;          // and nanoseconds
+} BRS_ORDER_EXT_INFO;
+
+typedef enum {
+    BRS_STOP_LIMIT,                // Rests on the book once triggered
+    BRS_STOP_MARKET                // Trades at once when triggered, the rest is canceled
+} BRS_STOP_TYPE;
+
+typedef struct brs_order_stop_info {   // For BUY and SELL held back until a trigger price
+    BRS_ORDER_EXT_INFO ext;        // Order and its expiry time (0 for none)
+    funds_t stop_price;            // Last trade price that triggers the order
+    uint32_t stop_type;            // One of BRS_STOP_TYPE
+} BRS_ORDER_STOP_INFO;
+
+typedef struct brs_order_iceberg_info {   // For BUY and SELL showing part of their quantity at a time
+    BRS_ORDER_STOP_INFO stop;      // Order, expiry time and stop price (0 for none)
+    quantity_t display_quantity;   // Quantity shown at a time
+} BRS_ORDER_ICEBERG_INFO;
+
+typedef struct brs_quote_info {   // For QUOTE
+    uint32_t num_bids;             // Number of bid levels
+    uint32_t num_asks;             // Number of ask levels
+    BRS_ORDER_INFO levels[];       // Bid levels, then ask levels
+} BRS_QUOTE_INFO;
+
+typedef struct brs_quoted_info {   // For QUOTED
+    uint32_t num_canceled;         // Number of quotes canceled
+    uint32_t num_posted;           // Number of quotes posted
+    BRS_NOTIFY_INFO orders[];      // Canceled quotes, then posted quotes
+} BRS_QUOTED_INFO;
+
+typedef struct brs_depth_req_info {   // For DEPTH
+    uint32_t levels;               // Levels wanted on each side, 1 to BRS_MAX_DEPTH_LEVELS
+    uint32_t subscribe;            // Nonzero to receive DEPTH_UPDATE from now on, 0 to stop
+} BRS_DEPTH_REQ_INFO;
+
+typedef struct brs_subscribe_info {   // For SUBSCRIBE
+    uint32_t feeds;                // Bits of BRS_FEED_CLASS to receive, the others are stopped
+} BRS_SUBSCRIBE_INFO;
+
+typedef struct brs_conflated_info {   // For CONFLATED
+    funds_t bid;                   // Highest bid price now, 0 if none
+    funds_t ask;                   // Lowest ask price now, 0 if none
+    funds_t last;                  // Last trade price now
+    uint32_t trades;               // Trades since the last CONFLATED, an uncross counting as one
+    quantity_t volume;             // Quantity they traded
+    funds_t high;                  // Highest price among them, 0 if none
+    funds_t low;                   // Lowest price among them, 0 if none
+    funds_t vwap;                  // Their volume-weighted average price, rounded down, 0 if none
+} BRS_CONFLATED_INFO;
+
+typedef struct brs_stats_req_info {   // For STATS
+    uint32_t interval;             // Length of the intervals in seconds, 1, 60 or 3600, or 0 for the session
+    uint32_t count;                // Most recent bars wanted, 1 to BRS_MAX_BARS
+} BRS_STATS_REQ_INFO;
+
+typedef struct brs_bar_info {
+    uint32_t start;                // Start of the interval (seconds since the epoch), or of the first trade for the session
+    funds_t open;                  // Price of the first trade
+    funds_t high;                  // Highest price
+    funds_t low;                   // Lowest price
+    funds_t close;                 // Price of the last trade so far
+    quantity_t volume;             // Quantity traded
+    uint32_t trades;               // Number of trades
+    funds_t vwap;                  // Volume-weighted average price, rounded down
+} BRS_BAR_INFO;
+
+typedef struct brs_stats_info {    // For the ACK to STATS
+    uint32_t interval;             // Length of the intervals, as requested
+    uint32_t num_bars;             // Number of bars
+    BRS_BAR_INFO bars[];           // Oldest first
+} BRS_STATS_INFO;
+
+typedef struct brs_level_info {
+    funds_t price;                 // Price of the level
+    quantity_t quantity;           // Total quantity shown at the price, 0 once the level is gone
+    uint32_t orders;               // Number of orders at the price
+} BRS_LEVEL_INFO;
+
+typedef struct brs_depth_info {    // For the ACK to DEPTH, and DEPTH_UPDATE
+    uint32_t seq;                  // Sequence number of the update, or of the last one in a snapshot
+    uint32_t num_bids;             // Number of bid levels
+    uint32_t num_asks;             // Number of ask levels
+    BRS_LEVEL_INFO levels[];       // Bid levels, then ask levels
+} BRS_DEPTH_INFO;
+
+typedef struct brs_status_ext_info {   // For ACK with account status
+    BRS_STATUS_INFO status;        // Original status information
+    BRS_LEDGER_INFO ledger;        // Account ledger
+} BRS_STATUS_EXT_INFO;
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Admission control for requests that reach the exchange.
+ *
+ * BUY, SELL and QUOTE requests each take the exchange lock and usually
+ * cause a broadcast to every trader, so one trader sending them as fast
+ * as it can slows down everyone else.  Before such a request touches the
+ * exchange, it has to take a token from the trader's bucket and one from
+ * a bucket shared by all traders.  A request for which there is no token
+ * is answered with a NACK right away.
+ *
+ * CANCEL and MASS_CANCEL are exempt: they only take risk off the book,
+ * and a trader that has run its bucket dry with orders must still be
+ * able to pull them.
+ *
+ * Each bucket is a token bucket with a refill rate (tokens per second)
+ * and a burst size (capacity), kept as a single atomic word using the
+ * generic cell rate algorithm: the word holds the time at which the
+ * bucket would be full again, and taking a token moves that time forward
+ * by one refill interval with a compare-and-swap, unless it would end up
+ * more than a burst ahead of now.  No lock is taken.
+ *
+ * A rate of 0 means no limit, which is the default.
+ */
+
+typedef struct rate_bucket {
+    _Atomic uint64_t fullTime;  // When the bucket is full again (ns, CLOCK_MONOTONIC)
+    uint64_t interval;          // Refill interval of one token (ns), 0 for no limit
+    uint64_t tolerance;         // How far fullTime may be ahead of now (ns)
+} RATE_BUCKET;
+
+typedef struct rate_limit_stats {
+    uint64_t admitted;          // Requests admitted
+    uint64_t traderThrottled;   // Requests refused by a trader's bucket
+    uint64_t globalThrottled;   // Requests refused by the shared bucket
+} RATE_LIMIT_STATS;
+
+/*
+ * Parse a limit of the form "<rate>" or "<rate>:<burst>".
+ * The burst defaults to one second's worth of tokens.
+ *
+ * @return 0 if the limit is valid, otherwise -1.
+ */
+int rate_limit_parse(char *spec, double *rate, unsigned int *burst);
+
+/*
+ * Set the per-trader and shared limits.  Must be called before any
+ * trader logs in.
+ */
+void rate_limit_configure(double traderRate, unsigned int traderBurst,
+                          double globalRate, unsigned int globalBurst);
+
+/*
+ * Set up a bucket with the per-trader limit, full.
+ */
+void rate_limit_trader_init(RATE_BUCKET *bucket);
+
+/*
+ * Take a token from a trader's bucket and one from the shared bucket.
+ *
+ * @param bucket  The trader's bucket.
+ * @param throttled  The trader's count of refused requests, incremented
+ * if the request is refused.
+ * @return 1 if the request is admitted, 0 if it must be refused.
+ */
+int rate_limit_admit(RATE_BUCKET *bucket, _Atomic uint64_t *throttled);
+
+/*
+ * Read the admission counters.
+ */
+void rate_limit_get_stats(RATE_LIMIT_STATS *stats);
+
+/*
+ * Print the admission counters and those of each logged-in trader.
+ */
+void rate_limit_report(FILE *out);
+
+#endif
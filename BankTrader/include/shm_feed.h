@@ -0,0 +1,124 @@
+#ifndef SHM_FEED_H
+#define SHM_FEED_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "protocol.h"
+
+/*
+ * Shared-memory market data feed.
+ *
+ * The server can publish the top of book and every trade into a POSIX
+ * shared-memory segment.  Processes on the same host map the segment
+ * read-only and poll it, so they see market data without logging in,
+ * without any system calls once mapped, and without adding work to the
+ * broadcasts done by the matchmaker.
+ *
+ * There is a single writer (the exchange, under its lock), so every slot
+ * is protected by a sequence lock: the writer makes the sequence number
+ * odd, writes the slot and makes it even again, and a reader retries if
+ * the number was odd or changed while it copied the slot.
+ *
+ * Trades go into a ring of SHM_FEED_RING slots.  Trade n (counting from 1)
+ * lives in slot n % SHM_FEED_RING, whose sequence number is 2n once it is
+ * complete.  A reader that falls more than a ring behind loses trades and
+ * is told so.
+ */
+
+#define SHM_FEED_NAME "/bourse_feed"
+#define SHM_FEED_MAGIC 0x46535242   // "BRSF"
+#define SHM_FEED_RING 4096          // Must be a power of two
+
+/*
+ * Top of book.  Prices are in host byte order.
+ */
+typedef struct shm_quote {
+    _Atomic uint64_t seq;       // Sequence lock, odd while being written
+    uint64_t timestamp;         // Time of the update (ns since the epoch)
+    funds_t bid;                // Highest bid price, 0 if none
+    funds_t ask;                // Lowest ask price, 0 if none
+    funds_t last;               // Last trade price
+} __attribute__((aligned(64))) SHM_QUOTE;
+
+/*
+ * One trade.  Fields are in host byte order.
+ */
+typedef struct shm_trade {
+    _Atomic uint64_t seq;       // 2n when trade n is complete, odd while being written
+    uint64_t timestamp;         // Time of the trade (ns since the epoch)
+    orderid_t buyer;            // Buy order ID
+    orderid_t seller;           // Sell order ID
+    quantity_t quantity;        // Quantity traded
+    funds_t price;              // Trade price
+} SHM_TRADE;
+
+/*
+ * Layout of the shared-memory segment.
+ */
+typedef struct shm_feed {
+    uint32_t magic;             // SHM_FEED_MAGIC once the segment is ready
+    uint32_t ringSize;          // Number of slots in trades
+    SHM_QUOTE quote;            // Top of book
+    _Atomic uint64_t numTrades __attribute__((aligned(64)));  // Trades published so far
+    SHM_TRADE trades[SHM_FEED_RING] __attribute__((aligned(64)));
+} SHM_FEED;
+
+/*
+ * Create the segment and start publishing into it.  Until this is called,
+ * or if it fails, the publishing functions do nothing.  A segment that
+ * already exists is left alone and the call fails, so a second server
+ * cannot take over the feed of one that is running; the segment of a
+ * server that did not shut down cleanly has to be removed by hand (it is
+ * /dev/shm/<name> on Linux).
+ *
+ * @param name  Name of the segment, as for shm_open().
+ * @return EXIT_SUCCESS if the segment was created, EXIT_FAILURE otherwise.
+ */
+int shm_feed_init(char *name);
+
+/*
+ * Stop publishing and remove the segment.
+ */
+void shm_feed_fini(void);
+
+/*
+ * Publish the top of book.  Must only be called by one thread at a time.
+ */
+void shm_feed_quote(funds_t bid, funds_t ask, funds_t last);
+
+/*
+ * Publish a trade.  Must only be called by one thread at a time.
+ */
+void shm_feed_trade(orderid_t buyer, orderid_t seller, quantity_t quantity, funds_t price);
+
+/*
+ * Map an existing segment read-only.
+ *
+ * @param name  Name of the segment, as for shm_open().
+ * @return The mapped segment, or NULL if it does not exist or is not ready.
+ */
+SHM_FEED *shm_feed_open(char *name);
+
+/*
+ * Unmap a segment returned by shm_feed_open().
+ */
+void shm_feed_close(SHM_FEED *feed);
+
+/*
+ * Copy a consistent snapshot of the top of book.
+ *
+ * @return The sequence number of the snapshot, which changes whenever
+ * the top of book is updated.
+ */
+uint64_t shm_feed_read_quote(SHM_FEED *feed, SHM_QUOTE *quotep);
+
+/*
+ * Copy trade n (counting from 1).
+ *
+ * @return 0 if the trade was copied, 1 if it has not been published yet,
+ * -1 if it has already been overwritten.
+ */
+int shm_feed_read_trade(SHM_FEED *feed, uint64_t n, SHM_TRADE *tradep);
+
+#endif
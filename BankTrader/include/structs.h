@@ -1,31 +1,118 @@
 #include <semaphore.h>
+#include <stdatomic.h>
 
 #include "trader.h"
 #include "exchange.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "client_registry.h"
+#include "rate_limit.h"
+#include "timer_wheel.h"
+#include "book_depth.h"
+#include "bar_stats.h"
+#include "out_queue.h"
 
-// Account struct and allAccounts array
+// A BOUGHT or SOLD kept for replay
+typedef struct replay_entry {
+    uint32_t seq;               // Sequence number of the notification
+    uint8_t type;               // BRS_BOUGHT_PKT or BRS_SOLD_PKT
+    BRS_NOTIFY_INFO notify;     // Its payload, without the sequence number
+} REPLAY_ENTRY;
+
+// The last BRS_REPLAY_SLOTS notifications of a username, notification n in slot n % BRS_REPLAY_SLOTS
+typedef struct replay_ring {
+    pthread_mutex_t lock;       // Held while a notification is numbered and sent, or the ring replayed
+    uint32_t lastSeq;           // Sequence number of the last notification, 0 before the first
+    REPLAY_ENTRY entries[BRS_REPLAY_SLOTS];
+} REPLAY_RING;
+
+// Account struct, one per username in a market
 typedef struct account {
     quantity_t quantity;         // Quantity bought/sold/traded/canceled
-    quantity_t inventory;       // Inventory
-    funds_t balance;            // Account balance
+    _Atomic uint64_t funds;     // Available (low 32 bits) and held (high 32 bits) balance
+    _Atomic uint64_t stock;     // Available (low 32 bits) and held (high 32 bits) inventory
+    _Atomic funds_t settledBalance;      // Funds received through trades
+    _Atomic quantity_t settledInventory; // Inventory received through trades
     char *username;             // Username used to login
-    pthread_mutex_t mLock;      // Thread lock
+    REPLAY_RING replay;         // BOUGHT and SOLD of the username, kept across sessions
+    struct market *market;      // Market the account belongs to
 } ACCOUNT;
 
-ACCOUNT allAccounts[MAX_ACCOUNTS];
+// Number of market-data classes, one per bit of BRS_FEED_CLASS
+#define NUM_FEEDS 5
+
+// What a CONFLATED subscriber has not been sent yet, protected by the market's traLock
+typedef struct conflation {
+    uint64_t quoteVersion;      // Version of the top of book last sent
+    uint32_t trades;            // Trades since the last CONFLATED
+    quantity_t volume;          // Quantity they traded
+    uint64_t notional;          // Sum of their quantities times prices
+    funds_t high;               // Highest and lowest price among them
+    funds_t low;
+    int deferred;               // Waiting for the connection to become writable
+    TIMER retry;                // Checks again on the next tick, set up on the first subscription
+} CONFLATION;
 
-// Trader struct and allTraders array
+struct trader;
+
+// Delivers what is sent to a trader instead of writing it to the trader's connection: the header
+// and payload as they would go on the wire (network byte order, without timestamps), with the
+// trader's lock held
+typedef int (*TRADER_SINK)(struct trader *trader, BRS_PACKET_HEADER *pkt, void *data, void *arg);
+
+// Trader struct, one per login in a market
 typedef struct trader {
     int fileDesc;               // File descriptor
+    TRADER_SINK sink;           // Called instead of writing to fileDesc, NULL to write to it directly
+    void *sinkArg;              // For the use of sink
+    struct market *market;      // Market the trader is logged in to
     int refCount;               // Number of references to the trader
     char *username;             // Username used to login
     ACCOUNT *currAccount;       // Account associated with trader
+    struct order *orders;       // Head of the trader's live orders (intrusive list)
+    int numOrders;              // Number of live orders in the list
+    RATE_BUCKET bucket;         // Admission limit of the trader's exchange requests
+    _Atomic uint64_t throttled; // Number of requests refused by admission control
+    struct input_req *inputHead;  // Requests queued for the sequencer, other than cancels
+    struct input_req *inputTail;  // Last queued request
+    int numInput;               // Requests queued in either lane of the input stage
+    int deficit;                // Deficit round robin credit
+    struct trader *activeNext;  // Ring of the traders with queued requests
+    struct trader *activePrev;
+    uint32_t feeds;             // Market-data classes subscribed to (BRS_FEED_CLASS bits)
+    int feedSlots[NUM_FEEDS];   // Index in the subscriber list of each class subscribed to
+    CONFLATION conflation;      // Summary kept for a CONFLATED subscriber
+    int sequenced;              // Resumed with LOGIN, so BOUGHT and SOLD carry sequence numbers
     pthread_mutexattr_t attr;   // Attribute to make mutex recursive
     pthread_mutex_t mLock;      // Thread lock
 } TRADER;
 
-TRADER allTraders[MAX_TRADERS];
+/*
+ * The accounts and traders of one exchange, and the market data they subscribe to.  The server's
+ * is defaultMarket, set up by accounts_init and traders_init and used by the functions of account.h
+ * and trader.h that take no market.  An embedded exchange has a market of its own, so any number
+ * of them can run in one process, each on the threads of its owner.
+ */
+typedef struct market {
+    ACCOUNT *accounts;          // Accounts by username, created on first login
+    int maxAccounts;            // Capacity of accounts, at most MAX_ACCOUNTS
+    pthread_mutex_t accLock;    // Protects the usernames of accounts
+    _Atomic uint64_t totalFunds;      // Funds of all the accounts, never more than UINT32_MAX
+    _Atomic uint64_t totalInventory;  // Inventory of all the accounts, never more than UINT32_MAX
+    TRADER *traders;            // Logged-in traders
+    int maxTraders;             // Capacity of traders
+    pthread_mutex_t traLock;    // Protects the traders and what follows, taken before a trader's lock
+    TRADER **feedSubscribers[NUM_FEEDS];  // Traders subscribed to each market-data class
+    int numFeedSubscribers[NUM_FEEDS];
+    funds_t topBid;             // Top of book for CONFLATED subscribers
+    funds_t topAsk;
+    funds_t topLast;
+    uint64_t topVersion;        // Changes made to it, a subscriber starts at 0
+    TIMER_WHEEL conflateWheel;  // Retries of CONFLATED sends to connections, started with the first
+    int conflateStarted;
+} MARKET;
+
+extern MARKET defaultMarket;
 
 
 // Order struct
@@ -34,25 +121,235 @@ typedef struct order {
     funds_t ask;                // Lowest ask price
     quantity_t quantity;        // Quantity bought in order
     orderid_t orderid;          // Id of the order
-    struct order *nextOrder;    // Order following this order
+    struct order *nextOrder;    // Order following this order on the same side of the book
+    struct order *prevOrder;    // Order preceding this order on the same side of the book
+    struct order *traderNext;   // Next order in the trader's order list
+    struct order *traderPrev;   // Previous order in the trader's order list
     TRADER *trader;             // Trader associated with exchange
+    uint64_t expireTime;        // Deadline of a good-till-time order (ms on the expiry wheel), 0 for none
+    TIMER expiry;               // Expires the order at expireTime
+    funds_t stopPrice;          // Trigger price while a stop order waits in a trigger book, 0 on the book
+    int immediate;              // Stop order whose remainder is canceled once activated, instead of resting
+    quantity_t hidden;          // Reserve of an iceberg order, not shown on the book
+    quantity_t displaySize;     // Quantity an iceberg order shows at a time, 0 for other orders
+    int isQuote;                // Posted by a QUOTE, replaced by the trader's next QUOTE
 } ORDER;
 
+// Notification held back until the accounts of a matching pass are settled
+typedef struct notice {
+    uint8_t type;               // CANCELED, or POSTED for the refreshed tip of an iceberg order
+    BRS_NOTIFY_INFO notify;     // Order details (network byte order)
+} NOTICE;
+
+// Fill carried out during a matching pass, notified after settlement
+typedef struct fill {
+    BRS_NOTIFY_INFO notify;     // Trade details (network byte order)
+    TRADER *buyer;              // Trader that posted the buy order
+    TRADER *seller;             // Trader that posted the sell order
+} FILL;
+
+// Ledger changes of one account, applied together by account_settle
+typedef struct ledger_delta {
+    uint64_t heldFunds;         // Held funds consumed by purchases
+    uint64_t paidFunds;         // Part of heldFunds actually paid to sellers
+    uint64_t proceeds;          // Funds received from sales
+    quantity_t heldInventory;   // Held inventory delivered to buyers
+    quantity_t bought;          // Inventory received from purchases
+    uint64_t releasedFunds;     // Held funds of canceled orders, available again
+    quantity_t releasedInventory;   // Held inventory of canceled orders, available again
+} LEDGER_DELTA;
+
+// Ledger changes accumulated per account during a matching pass
+typedef struct settlement {
+    MARKET *market;                     // Market of the accounts, indexed by their place in its table
+    LEDGER_DELTA delta[MAX_ACCOUNTS];   // Pending changes of each account
+    char marked[MAX_ACCOUNTS];          // Whether an account is in touched
+    int touched[MAX_ACCOUNTS];          // Indexes of accounts with pending changes
+    int numTouched;                     // Number of entries in touched
+    FILL *fills;                        // Fills of the current pass
+    int numFills;                       // Number of fills in the current pass
+    int maxFills;                       // Capacity of fills
+    NOTICE *notices;                    // Cancellations and iceberg refreshes of the current pass
+    int numNotices;                     // Number of entries in notices
+    int maxNotices;                     // Capacity of notices
+} SETTLEMENT;
+
+// Self-trade prevention: what gives way when a trader's own bid and ask cross
+typedef enum {
+    STP_CANCEL_RESTING,         // Cancel the order that was on the book first
+    STP_CANCEL_INCOMING,        // Cancel the order that arrived later
+    STP_CANCEL_BOTH,            // Cancel both orders
+    STP_DECREMENT               // Take the smaller quantity off both orders
+} STP_MODE;
+
 // Exchange struct
 typedef struct exchange {
     funds_t last;               // Last trade price
     funds_t highest_bid;        // Current highest bid price
     funds_t highest_ask;        // Current highest ask price
     int numExchgs;              // Number of exchanges
+    orderid_t lastId;           // Last order id handed out
     int finished;               // Called SIGHUP
-    ORDER *currOrder;           // Order associated with exchange
+    ORDER *bids;                // Buy orders, highest price first
+    ORDER *asks;                // Sell orders, lowest price first
+    ORDER *buyStops;            // Buy stops waiting for the last price to rise to them, lowest trigger first
+    ORDER *sellStops;           // Sell stops waiting for the last price to fall to them, highest trigger first
+    SETTLEMENT *settle;         // Per-pass settlement buffers of the matchmaker
+    TIMER_WHEEL expiry;         // Deadlines of good-till-time orders, advanced by the matchmaker
+    int numTimed;               // Orders on the book with a deadline
+    uint64_t auctionInterval;   // Time between uncrosses in call-auction mode (ms), 0 for continuous matching
+    uint64_t nextAuction;       // When the next uncross is due (ns since the epoch)
+    STP_MODE stpMode;           // Self-trade prevention mode
+    int inlineMatch;            // In continuous mode, posts are matched by the posting thread instead of the matchmaker
+    int embedded;               // Without a matchmaker, expiry and auctions are run by exchange_tick
+    MARKET *market;             // Accounts and traders of the exchange
+    pthread_t matchmaker;       // Matchmaker thread, unless embedded
+    BOOK_DEPTH depth;           // Price levels of the book, for DEPTH snapshots and updates
+    BAR_STATS stats;            // Bars of the trades, for STATS, read without the lock
     sem_t madeXchg  ;           // Semaphore for when exchange is made
     sem_t waitForChange;        // Semaphore waiting for exchange
     pthread_mutexattr_t attr;   // Attribute to make mutex recursive
     pthread_mutex_t mLock;      // Thread lock (mutex)
 } EXCHANGE;
 
-pthread_t mtid;
-pthread_mutex_t allTraLock;
-pthread_mutex_t allAccLock;
-void *matchmaking();
\ No newline at end of file
+void *matchmaking();
+
+// Order list helpers shared by exchange.c and matchmaking.c
+void exchange_insert_order(EXCHANGE *xchg, ORDER *order);
+void exchange_requeue_order(EXCHANGE *xchg, ORDER *order);
+void exchange_remove_order(EXCHANGE *xchg, ORDER *order);
+void exchange_post(ORDER *newOrder, quantity_t quantity, funds_t price, int isBuyer, int forCancel);
+void exchange_refresh_quotes(EXCHANGE *xchg);
+// Report a change to the quantity an order shows on the book, and to its number of orders there
+void exchange_depth_update(EXCHANGE *xchg, ORDER *order, int64_t quantity, int orders);
+int exchange_cancel_all(EXCHANGE *xchg, TRADER *trader, quantity_t *quantity);
+
+// Carry out one matching pass, the exchange lock must be held
+void exchange_match(EXCHANGE *xchg);
+// Remove the good-till-time orders whose deadline has passed, the exchange lock must be held
+void exchange_expire(EXCHANGE *xchg);
+// Timer function of a good-till-time order, run by exchange_expire
+void exchange_order_expired(TIMER *timer);
+// Execute the crossed part of the book at the single price that maximizes the executed volume,
+// the exchange lock must be held
+void exchange_uncross(EXCHANGE *xchg);
+// Switch to call-auction mode, uncrossing every intervalMs, or back to continuous matching if 0
+void exchange_set_auction(EXCHANGE *xchg, uint64_t intervalMs);
+// Self-trade prevention mode named "resting", "incoming", "both" or "decrement", -1 if unknown
+int exchange_stp_mode(char *name);
+// Change the self-trade prevention mode, applied from the next crossing on
+void exchange_set_stp(EXCHANGE *xchg, STP_MODE mode);
+// Have each post matched before it returns, by the thread that posts it, or by the matchmaker again if 0
+// (an embedded exchange always matches inline)
+void exchange_set_inline(EXCHANGE *xchg, int isInline);
+
+// Set up a market for up to maxTraders traders (and as many usernames), at most MAX_TRADERS
+int market_init(MARKET *market, int maxTraders);
+// Free what a market holds, once its exchanges are finalized
+void market_fini(MARKET *market);
+// Set up the accounts or the traders of a market, as accounts_init and traders_init do for defaultMarket
+int market_accounts_init(MARKET *market, int maxAccounts);
+void market_accounts_fini(MARKET *market);
+int market_traders_init(MARKET *market, int maxTraders);
+void market_traders_fini(MARKET *market);
+// Find or create the account of a username in a market, NULL if the market is full
+ACCOUNT *market_account(MARKET *market, char *name);
+// Log a trader in to a market without a connection, everything it is sent going to sink (dropped if NULL)
+TRADER *market_login(MARKET *market, char *name, TRADER_SINK sink, void *arg);
+// Log a trader in to the server's market with a connection, everything it is sent going to sink
+TRADER *trader_login_conn(int fd, char *name, TRADER_SINK sink, void *arg);
+// Send a notification to the traders of a market, as trader_broadcast_packet does for defaultMarket
+int market_broadcast(MARKET *market, BRS_PACKET_HEADER *pkt, void *data);
+// Record the top of book for a market's CONFLATED subscribers, sending it to those it is new to
+void market_conflate_quote(MARKET *market, funds_t bid, funds_t ask, funds_t last);
+
+// An exchange of a market, without a matchmaker thread: each post is matched by the thread that
+// makes it, and the owner calls exchange_tick to expire orders and run call auctions
+EXCHANGE *exchange_embed(MARKET *market);
+// Expire the orders whose deadline has passed and, in call-auction mode, uncross the book if due
+void exchange_tick(EXCHANGE *xchg);
+
+// Post a buy or sell order, good till a wall-clock time (ms since the epoch), or till canceled if 0
+orderid_t exchange_post_order(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price,
+                              int isBuyer, uint64_t expireMs);
+
+// Terms of an order beyond its quantity and price, all 0 for an ordinary order
+typedef struct order_terms {
+    uint64_t expireMs;          // Good till this wall-clock time (ms since the epoch), 0 for till canceled
+    funds_t stopPrice;          // Held back until the last trade price reaches it (rises to it for a buy,
+                                // falls to it for a sell), 0 for no stop
+    int immediate;              // Stop-market: once activated, what cannot trade at once is canceled
+    quantity_t displaySize;     // Iceberg: quantity shown at a time, the rest kept in reserve
+} ORDER_TERMS;
+
+// Post a buy or sell order with the given terms
+orderid_t exchange_post_terms(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price,
+                              int isBuyer, ORDER_TERMS *terms);
+
+// One level of a mass quote
+typedef struct quote_level {
+    quantity_t quantity;
+    funds_t price;
+} QUOTE_LEVEL;
+
+// Replace all of a trader's quotes with numBids bids and numAsks asks (levels has the bids first),
+// setting the order id of the first new quote; nothing changes if the account cannot cover them
+int exchange_quote(EXCHANGE *xchg, TRADER *trader, QUOTE_LEVEL *levels, int numBids, int numAsks,
+                   orderid_t *firstId);
+
+// Send a trader the best maxLevels levels of each side of the book, and subscribe it to their updates
+// or unsubscribe it
+int exchange_depth(EXCHANGE *xchg, TRADER *trader, int maxLevels, int subscribe);
+
+// Change the market-data classes of a trader in mask to those in feeds
+void trader_set_feeds(TRADER *trader, uint32_t mask, uint32_t feeds);
+// Number a BOUGHT or SOLD, keep it for replay and send it to the trader
+int trader_send_notice(TRADER *trader, BRS_PACKET_HEADER *pkt, BRS_NOTIFY_INFO *notify);
+// Acknowledge a LOGIN that resumes a session after notification lastSeq, and replay what followed it
+int trader_resume(TRADER *trader, uint32_t lastSeq);
+
+// Funds-reservation ledger: holds for pending orders and settlement of fills
+// Credit available funds or inventory, failing if the market's total would go beyond UINT32_MAX
+int account_credit_balance(ACCOUNT *account, funds_t amount);
+int account_credit_inventory(ACCOUNT *account, quantity_t quantity);
+int account_hold_balance(ACCOUNT *account, funds_t amount);
+int account_hold_inventory(ACCOUNT *account, quantity_t quantity);
+void account_release(ACCOUNT *account, funds_t amount, quantity_t quantity);
+int account_rehold(ACCOUNT *account, funds_t releaseFunds, funds_t holdFunds,
+                   quantity_t releaseInventory, quantity_t holdInventory);
+void account_settle(ACCOUNT *account, LEDGER_DELTA *delta);
+void account_get_ledger(ACCOUNT *account, BRS_STATUS_INFO *infop, BRS_LEDGER_INFO *ledgerp);
+
+// Service loop for one client connection, run on the calling thread
+void brs_client_session(int fileDesc);
+
+// State of one client connection, so that the threaded service loop and the
+// event loops carry out requests with the same code
+typedef struct brs_session {
+    int fileDesc;               // Client connection
+    TRADER *trader;             // Logged-in trader, NULL until LOGIN succeeds
+    ACCOUNT *account;           // Account of the logged-in trader
+    _Atomic uint64_t lastActive;  // When the client last sent a packet (timer_now)
+    TIMER idleTimer;            // Heartbeat and idle timeout checks
+    OUT_QUEUE out;              // Everything sent to the client, written without waiting
+} BRS_SESSION;
+
+// Time out sessions whose client sends nothing for idleMs, and send a HEARTBEAT
+// to clients that have sent nothing for heartbeatMs (0 disables either)
+void brs_session_timeouts(uint64_t idleMs, uint64_t heartbeatMs);
+
+// Register a connection and start its session, closing it on failure
+int brs_session_open(BRS_SESSION *session, int fileDesc);
+// Carry out one request, the payload is freed
+void brs_session_request(BRS_SESSION *session, BRS_PACKET_HEADER *hdr, void *payload);
+// Log the trader out and unregister (and close) the connection
+void brs_session_close(BRS_SESSION *session);
+// Carry out one request of a logged-in trader, the payload is freed
+void brs_trader_request(TRADER *trader, ACCOUNT *account, BRS_PACKET_HEADER *hdr, void *payload);
+
+// Client registry counters, read without taking the registry lock
+int creg_count(CLIENT_REGISTRY *cr);
+unsigned long creg_total(CLIENT_REGISTRY *cr);
+
+// Send an ACK carrying the status and ledger of the trader's account
+int trader_send_status(TRADER *trader, BRS_STATUS_EXT_INFO *info);
@@ -0,0 +1,117 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * Time advances in ticks of TIMER_TICK_MS.  The wheel has TIMER_LEVELS
+ * levels of TIMER_SLOTS slots each; a slot of level 0 holds the timers
+ * due in one tick, a slot of level 1 those due in a span of TIMER_SLOTS
+ * ticks, and so on.  Adding or canceling a timer only links or unlinks it
+ * from the list of its slot.  On each tick the timers of the current
+ * level-0 slot expire, and when level 0 wraps around, the timers of the
+ * next slot of level 1 are moved down to the levels matching their
+ * remaining time (and likewise up the levels), so a timer is moved at
+ * most TIMER_LEVELS - 1 times before it expires, however many timers
+ * there are.  Deadlines beyond the span of the wheel are placed at its
+ * far end, and placed again when they get there.
+ *
+ * A wheel is advanced either by a thread of its own (timer_wheel_start)
+ * or by its owner calling timer_wheel_advance.  Expired timers call their
+ * function on the advancing thread, without the wheel lock held, so the
+ * function may add timers (including its own).  It should not block,
+ * since other timers wait behind it.
+ */
+
+#define TIMER_TICK_MS 10            // Length of a tick
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)  // Slots per level
+#define TIMER_LEVELS 4              // Levels, spanning TIMER_SLOTS^TIMER_LEVELS ticks
+
+struct timer;
+struct timer_wheel;
+typedef void (*TIMER_FUNC)(struct timer *timer);
+
+typedef struct timer {
+    struct timer *next;         // Neighbors in the list of the timer's slot, NULL when not pending
+    struct timer *prev;
+    uint64_t expires;           // Tick at which the timer expires
+    struct timer_wheel *wheel;  // Wheel the timer is added to
+    TIMER_FUNC func;            // Called when the timer expires
+    void *arg;                  // For the use of func
+} TIMER;
+
+typedef struct timer_wheel {
+    pthread_mutex_t lock;       // Protects the lists and the fields below
+    pthread_cond_t doneCond;    // Broadcast when a timer function returns
+    TIMER slots[TIMER_LEVELS][TIMER_SLOTS];  // List heads of the slots
+    TIMER expiring;             // List head of the timers expiring on the current tick
+    uint64_t currTick;          // Next tick to be processed
+    uint64_t startTime;         // Clock at time 0 (ms, CLOCK_MONOTONIC)
+    int numPending;             // Timers added and not yet expired or canceled
+    TIMER *running;             // Timer whose function is running
+    pthread_t runner;           // Thread running it
+} TIMER_WHEEL;
+
+/*
+ * Set up a wheel at time 0, without starting a thread for it.
+ */
+void timer_wheel_init(TIMER_WHEEL *wheel);
+
+/*
+ * Set up a wheel and start a thread that advances it with the clock.
+ */
+void timer_wheel_start(TIMER_WHEEL *wheel);
+
+/*
+ * Milliseconds since a wheel was set up (CLOCK_MONOTONIC).
+ */
+uint64_t timer_now(TIMER_WHEEL *wheel);
+
+/*
+ * Expire the timers due up to a time.  The wheel thread calls this on
+ * each tick; a wheel without a thread is driven by calling it directly.
+ *
+ * @param wheel  The wheel.
+ * @param nowMs  The time reached, in milliseconds since the wheel was
+ * set up.
+ */
+void timer_wheel_advance(TIMER_WHEEL *wheel, uint64_t nowMs);
+
+/*
+ * Set up a timer of a wheel, not pending.
+ */
+void timer_init(TIMER *timer, TIMER_WHEEL *wheel, TIMER_FUNC func, void *arg);
+
+/*
+ * Make a timer expire after a delay, replacing any earlier deadline it
+ * had.
+ *
+ * @param timer  The timer.
+ * @param delayMs  The delay in milliseconds, rounded up to whole ticks.
+ * The timer never expires early, but may expire up to a tick late.
+ */
+void timer_add(TIMER *timer, uint64_t delayMs);
+
+/*
+ * Make a timer expire at a deadline, replacing any earlier deadline it
+ * had.  A deadline that has passed expires on the next advance.
+ *
+ * @param timer  The timer.
+ * @param whenMs  The deadline in milliseconds since the wheel was set up,
+ * rounded up to a whole tick.
+ */
+void timer_add_at(TIMER *timer, uint64_t whenMs);
+
+/*
+ * Cancel a timer.  If its function is running on another thread, wait
+ * until it returns, so the timer can be freed afterwards.
+ *
+ * @return 1 if the timer was pending, otherwise 0.
+ */
+int timer_cancel(TIMER *timer);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef TRADE_TAPE_H
+#define TRADE_TAPE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "protocol.h"
+
+/*
+ * Trade tape.
+ *
+ * The server can record every trade in a file of fixed-size records, for
+ * historical queries.  The file is mapped into memory and extended ahead
+ * of the records, TAPE_GROWTH records at a time, so recording a trade
+ * only copies it into the mapping; the only system calls are those that
+ * extend the file once the records written reach its end.  The kernel
+ * writes the pages back on its own schedule, and all of them when the
+ * tape is closed.
+ *
+ * A tape that already exists is appended to, so one file can hold the
+ * trades of several runs of the server.  Records are in the order of the
+ * trades, and so of their timestamps, which lets a reader find the trades
+ * of a period by bisection.
+ *
+ * There is a single writer (the exchange, under its lock).  It fills a
+ * record in before it counts it in the header, so other processes may
+ * map the file and read the counted records while it is being written.
+ */
+
+#define TAPE_MAGIC 0x50415442       // "BTAP"
+#define TAPE_NAME_LEN 24            // Room for a username, longer ones are cut short
+#define TAPE_GROWTH 65536           // Records the file is extended by when it is full
+
+/*
+ * One trade.  Fields are in host byte order.
+ */
+typedef struct tape_record {
+    uint64_t timestamp;         // Time of the trade (ns since the epoch)
+    orderid_t buyOrder;         // Buy order ID
+    orderid_t sellOrder;        // Sell order ID
+    quantity_t quantity;        // Quantity traded
+    funds_t price;              // Trade price
+    char buyer[TAPE_NAME_LEN];  // Username of the buyer, NUL-padded
+    char seller[TAPE_NAME_LEN]; // Username of the seller, NUL-padded
+} TAPE_RECORD;
+
+/*
+ * Header at the start of the file, followed by the records.
+ */
+typedef struct tape_header {
+    uint32_t magic;             // TAPE_MAGIC once the file is ready
+    uint32_t recordSize;        // Size of a record, sizeof(TAPE_RECORD)
+    _Atomic uint64_t numRecords;   // Records written so far
+    uint64_t capacity;          // Records the file has room for
+} __attribute__((aligned(64))) TAPE_HEADER;
+
+/*
+ * A tape mapped for reading.
+ */
+typedef struct tape {
+    TAPE_HEADER *header;        // Start of the mapping
+    TAPE_RECORD *records;       // First record
+    uint64_t numRecords;        // Records counted when the tape was opened
+    size_t size;                // Size of the mapping
+} TAPE;
+
+/*
+ * Open or create the tape and start recording into it.  Until this is
+ * called, or if it fails, tape_trade does nothing.
+ *
+ * @return EXIT_SUCCESS if the tape is ready, EXIT_FAILURE otherwise.
+ */
+int tape_init(char *path);
+
+/*
+ * Stop recording, write the mapping back and cut the file down to the
+ * records written.
+ */
+void tape_fini(void);
+
+/*
+ * Record a trade.  Must only be called by one thread at a time.
+ */
+void tape_trade(orderid_t buyOrder, orderid_t sellOrder, char *buyer, char *seller,
+                quantity_t quantity, funds_t price);
+
+/*
+ * Map a tape read-only, with the records written so far.
+ *
+ * @return EXIT_SUCCESS if the tape was mapped, EXIT_FAILURE if it does not
+ * exist or is not a tape.
+ */
+int tape_open(char *path, TAPE *tape);
+
+/*
+ * Unmap a tape mapped by tape_open.
+ */
+void tape_close(TAPE *tape);
+
+/*
+ * Find the first record of a tape at or after a time, by bisection.
+ *
+ * @param timestamp  Time, in ns since the epoch.
+ * @return The index of the record, tape->numRecords if there is none.
+ */
+uint64_t tape_seek(TAPE *tape, uint64_t timestamp);
+
+#endif
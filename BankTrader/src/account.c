@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "account.h"
@@ -5,152 +7,258 @@
 #include "csapp.h"
 #include "debug.h"
 
+/*
+ * Each ledger word packs the available amount in its low 32 bits and the
+ * held amount in its high 32 bits, so moving funds or inventory between
+ * the two is a single compare-and-swap.
+ */
+#define LEDGER_AVAIL(word) ((uint32_t)(word))
+#define LEDGER_HELD(word) ((uint32_t)((word) >> 32))
+#define LEDGER_WORD(avail, held) (((uint64_t)(held) << 32) | (uint32_t)(avail))
+
+static int ledger_update(_Atomic uint64_t *word, uint64_t addAvail, uint64_t subAvail,
+                         uint64_t addHeld, uint64_t subHeld) {
+    uint64_t oldWord = atomic_load(word);
+    uint64_t newWord;
+    do {
+        // Fail without changing anything if either amount would go negative or overflow
+        uint64_t avail = (uint64_t)LEDGER_AVAIL(oldWord) + addAvail;
+        uint64_t held = (uint64_t)LEDGER_HELD(oldWord) + addHeld;
+        if(avail < subAvail || held < subHeld) return EXIT_FAILURE;
+        if(avail - subAvail > UINT32_MAX || held - subHeld > UINT32_MAX) return EXIT_FAILURE;
+        newWord = LEDGER_WORD(avail - subAvail, held - subHeld);
+    } while(!atomic_compare_exchange_weak(word, &oldWord, newWord));
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Funds and inventory only enter and leave a market through its accounts'
+ * credits and debits; trades and holds move them between accounts.  Keeping
+ * the market's totals within UINT32_MAX therefore keeps every ledger word,
+ * and every settlement, within range.
+ */
+static int total_reserve(_Atomic uint64_t *total, uint32_t amount) {
+    uint64_t oldTotal = atomic_load(total);
+    do {
+        if(oldTotal + amount > UINT32_MAX) return EXIT_FAILURE;
+    } while(!atomic_compare_exchange_weak(total, &oldTotal, oldTotal + amount));
+    return EXIT_SUCCESS;
+}
+
 int accounts_init(void) {
+    // The server's accounts, as many as there can be
+    return market_accounts_init(&defaultMarket, MAX_ACCOUNTS);
+}
+
+void accounts_fini(void) {
+    market_accounts_fini(&defaultMarket);
+}
+
+ACCOUNT *account_lookup(char *name) {
+    return market_account(&defaultMarket, name);
+}
+
+int market_accounts_init(MARKET *market, int maxAccounts) {
+    // The settlement of a matching pass has room for MAX_ACCOUNTS accounts
+    if(maxAccounts > MAX_ACCOUNTS) maxAccounts = MAX_ACCOUNTS;
+    market->accounts = Malloc(maxAccounts * sizeof(ACCOUNT));
+    market->maxAccounts = maxAccounts;
+    atomic_init(&market->totalFunds, 0);
+    atomic_init(&market->totalInventory, 0);
+
     // Initializing each attribute in the account
-    for(int i = 0; i < MAX_ACCOUNTS; i++) {
-        allAccounts[i].quantity = 0;
-        allAccounts[i].inventory = 0;
-        allAccounts[i].balance = 0;
-        allAccounts[i].username = NULL;
-        pthread_mutex_init(&allAccounts[i].mLock, NULL);
+    for(int i = 0; i < maxAccounts; i++) {
+        market->accounts[i].quantity = 0;
+        atomic_init(&market->accounts[i].funds, 0);
+        atomic_init(&market->accounts[i].stock, 0);
+        atomic_init(&market->accounts[i].settledBalance, 0);
+        atomic_init(&market->accounts[i].settledInventory, 0);
+        market->accounts[i].username = NULL;
+        market->accounts[i].market = market;
+        pthread_mutex_init(&market->accounts[i].replay.lock, NULL);
+        market->accounts[i].replay.lastSeq = 0;
     }
 
     // Initialize lock for account list
-    pthread_mutex_init(&allAccLock, NULL);
+    pthread_mutex_init(&market->accLock, NULL);
 
     return EXIT_SUCCESS;
 }
 
-void accounts_fini(void) {
-    // Set all attributes back to when it was originally initialized
-    // Free the name since it was malloced if not NULL
-    for(int i = 0; i < MAX_ACCOUNTS; i++) {
-        allAccounts[i].quantity = 0;
-        allAccounts[i].inventory = 0;
-        allAccounts[i].balance = 0;
-        if(allAccounts[i].username != NULL) Free(allAccounts[i].username);
-        pthread_mutex_destroy(&allAccounts[i].mLock);
+void market_accounts_fini(MARKET *market) {
+    // Free the names since they were malloced if not NULL, then the accounts
+    for(int i = 0; i < market->maxAccounts; i++) {
+        if(market->accounts[i].username != NULL) Free(market->accounts[i].username);
+        pthread_mutex_destroy(&market->accounts[i].replay.lock);
     }
+    Free(market->accounts);
+    market->accounts = NULL;
+    market->maxAccounts = 0;
 
     // Destroy lock for account list
-    pthread_mutex_destroy(&allAccLock);
+    pthread_mutex_destroy(&market->accLock);
 }
 
-ACCOUNT *account_lookup(char *name) {
-    pthread_mutex_lock(&allAccLock);
+ACCOUNT *market_account(MARKET *market, char *name) {
+    pthread_mutex_lock(&market->accLock);
     // If username in account matches name, return account
-    for(int i = 0; i < MAX_ACCOUNTS; i++) {
-        
+    for(int i = 0; i < market->maxAccounts; i++) {
+        ACCOUNT *account = &market->accounts[i];
+
         // If username is NULL, then continue since strcmp would cause an error
-        if(allAccounts[i].username == NULL) continue;
+        if(account->username == NULL) continue;
 
         // If account username matches name, return pointer to account
-        if(!strcmp(allAccounts[i].username, name)) {
-            pthread_mutex_unlock(&allAccLock);
-            return &allAccounts[i];
+        if(!strcmp(account->username, name)) {
+            pthread_mutex_unlock(&market->accLock);
+            return account;
         }
     }
 
     // Create new account for name
-    for(int i = 0; i < MAX_ACCOUNTS; i++) {
-        if(allAccounts[i].username == NULL) {
+    for(int i = 0; i < market->maxAccounts; i++) {
+        ACCOUNT *account = &market->accounts[i];
+        if(account->username == NULL) {
             // Set all necessary components
-            allAccounts[i].quantity = 0;
-            allAccounts[i].inventory = 0;
-            allAccounts[i].balance = 0;
-            
+            account->quantity = 0;
+            atomic_store(&account->funds, 0);
+            atomic_store(&account->stock, 0);
+            atomic_store(&account->settledBalance, 0);
+            atomic_store(&account->settledInventory, 0);
+            account->replay.lastSeq = 0;
+
             // Malloc space for username
             int nameLength = strlen(name) + 1;
-            allAccounts[i].username = Malloc(nameLength);
-            memset(allAccounts[i].username, 0, nameLength);
-            strcpy(allAccounts[i].username, name);
+            account->username = Malloc(nameLength);
+            memset(account->username, 0, nameLength);
+            strcpy(account->username, name);
 
             // Return new account
-            pthread_mutex_unlock(&allAccLock);
-            return &allAccounts[i];
-        } 
+            pthread_mutex_unlock(&market->accLock);
+            return account;
+        }
     }
-    pthread_mutex_unlock(&allAccLock);
+    pthread_mutex_unlock(&market->accLock);
     return NULL;
 }
 
 void account_increase_balance(ACCOUNT *account, funds_t amount) {
-    // Lock mutex
-    pthread_mutex_lock(&allAccLock);
-    pthread_mutex_lock(&account->mLock);
-    // Increase by specified amount
-    account->balance = account->balance + amount;
+    // Increase available funds by specified amount, unless it would overflow
+    account_credit_balance(account, amount);
+}
 
-    // Unlock mutex
-    pthread_mutex_unlock(&account->mLock);
-    pthread_mutex_unlock(&allAccLock);
+int account_credit_balance(ACCOUNT *account, funds_t amount) {
+    // Room in the market's total first, then the account cannot overflow
+    if(total_reserve(&account->market->totalFunds, amount) == EXIT_FAILURE) return EXIT_FAILURE;
+    return ledger_update(&account->funds, amount, 0, 0, 0);
 }
 
 int account_decrease_balance(ACCOUNT *account, funds_t amount) {
-    // Lock mutex
-    pthread_mutex_lock(&allAccLock);
-    pthread_mutex_lock(&account->mLock);
-
-    // Check if amount
-    if(account->balance < amount) {
-        // Lock mutex
-        pthread_mutex_unlock(&allAccLock);
-        pthread_mutex_unlock(&account->mLock);
-        return EXIT_FAILURE;
-    }
-
-    // Decrease by specified amount
-    account->balance = account->balance - amount;
-
-    // Unlock mutex
-    pthread_mutex_unlock(&account->mLock);
-    pthread_mutex_unlock(&allAccLock);
+    // Decrease available funds, failing if there are not enough
+    if(ledger_update(&account->funds, 0, amount, 0, 0) == EXIT_FAILURE) return EXIT_FAILURE;
+    atomic_fetch_sub(&account->market->totalFunds, amount);
     return EXIT_SUCCESS;
 }
 
 void account_increase_inventory(ACCOUNT *account, quantity_t quantity) {
-    // Lock mutex
-    pthread_mutex_lock(&allAccLock);
-    pthread_mutex_lock(&account->mLock);
-    
-    // Increase by specified amount
-    account->inventory = account->inventory + quantity;
+    // Increase available inventory by specified amount, unless it would overflow
+    account_credit_inventory(account, quantity);
+}
 
-    // Unlock mutex
-    pthread_mutex_unlock(&account->mLock);
-    pthread_mutex_unlock(&allAccLock);
+int account_credit_inventory(ACCOUNT *account, quantity_t quantity) {
+    // Room in the market's total first, then the account cannot overflow
+    if(total_reserve(&account->market->totalInventory, quantity) == EXIT_FAILURE) return EXIT_FAILURE;
+    return ledger_update(&account->stock, quantity, 0, 0, 0);
 }
 
 int account_decrease_inventory(ACCOUNT *account, quantity_t quantity) {
-    // Lock mutex
-    pthread_mutex_lock(&allAccLock);
-    pthread_mutex_lock(&account->mLock);
-
-    // Check if amount
-    if(account->inventory < quantity) {
-        // Unlock mutex
-        pthread_mutex_unlock(&allAccLock);
-        pthread_mutex_unlock(&account->mLock);
+    // Decrease available inventory, failing if there is not enough
+    if(ledger_update(&account->stock, 0, quantity, 0, 0) == EXIT_FAILURE) return EXIT_FAILURE;
+    atomic_fetch_sub(&account->market->totalInventory, quantity);
+    return EXIT_SUCCESS;
+}
+
+int account_hold_balance(ACCOUNT *account, funds_t amount) {
+    // Move available funds to held in one step
+    return ledger_update(&account->funds, 0, amount, amount, 0);
+}
+
+int account_hold_inventory(ACCOUNT *account, quantity_t quantity) {
+    // Move available inventory to held in one step
+    return ledger_update(&account->stock, 0, quantity, quantity, 0);
+}
+
+void account_release(ACCOUNT *account, funds_t amount, quantity_t quantity) {
+    // Move held funds and inventory back to available
+    if(amount > 0) ledger_update(&account->funds, amount, 0, 0, amount);
+    if(quantity > 0) ledger_update(&account->stock, quantity, 0, 0, quantity);
+}
+
+// Replace one held amount with another, failing if the available amount cannot cover the change
+static int ledger_rehold(_Atomic uint64_t *word, uint32_t release, uint32_t hold) {
+    return ledger_update(word, release, hold, hold, release);
+}
+
+int account_rehold(ACCOUNT *account, funds_t releaseFunds, funds_t holdFunds,
+                   quantity_t releaseInventory, quantity_t holdInventory) {
+    // Only a hold that grows can fail, so funds that grow go first and are put back
+    // if the inventory then fails; putting them back, or shrinking a hold, cannot fail
+    int fundsGrow = (holdFunds > releaseFunds);
+    if(fundsGrow && ledger_rehold(&account->funds, releaseFunds, holdFunds) != EXIT_SUCCESS) return EXIT_FAILURE;
+    if(ledger_rehold(&account->stock, releaseInventory, holdInventory) != EXIT_SUCCESS) {
+        if(fundsGrow) ledger_rehold(&account->funds, holdFunds, releaseFunds);
         return EXIT_FAILURE;
     }
+    if(!fundsGrow) ledger_rehold(&account->funds, releaseFunds, holdFunds);
+    return EXIT_SUCCESS;
+}
 
-    // Decrease by specified amount
-    account->inventory = account->inventory - quantity;
+// A settlement only moves what the book holds between accounts, so with the market's totals
+// in range every step fits; one that does not is a bug in the book, reported rather than applied
+static void settle_step(ACCOUNT *account, _Atomic uint64_t *word, uint64_t addAvail, uint64_t subHeld) {
+    if(ledger_update(word, addAvail, 0, 0, subHeld) == EXIT_SUCCESS) return;
+    uint64_t value = atomic_load(word);
+    fprintf(stderr, "Settlement of %s failed: %u available + %lu, %u held - %lu\n", account->username,
+            LEDGER_AVAIL(value), (unsigned long)addAvail, LEDGER_HELD(value), (unsigned long)subHeld);
+}
 
-    // Unlock mutex
-    pthread_mutex_unlock(&account->mLock);
-    pthread_mutex_unlock(&allAccLock);
-    return EXIT_SUCCESS;
+void account_settle(ACCOUNT *account, LEDGER_DELTA *delta) {
+    // Held funds are consumed by purchases, with any price improvement and the funds
+    // of canceled orders becoming available, then sale proceeds are credited
+    if(delta->heldFunds > 0 || delta->releasedFunds > 0) {
+        settle_step(account, &account->funds, delta->heldFunds - delta->paidFunds + delta->releasedFunds,
+                    delta->heldFunds + delta->releasedFunds);
+    }
+    if(delta->proceeds > 0) settle_step(account, &account->funds, delta->proceeds, 0);
+
+    // Held inventory is delivered to buyers and the inventory of canceled orders
+    // becomes available, then bought inventory is credited
+    if(delta->heldInventory > 0 || delta->releasedInventory > 0) {
+        settle_step(account, &account->stock, delta->releasedInventory,
+                    delta->heldInventory + delta->releasedInventory);
+    }
+    if(delta->bought > 0) settle_step(account, &account->stock, delta->bought, 0);
+
+    // Keep running totals of what has settled through trades
+    if(delta->proceeds > 0) atomic_fetch_add(&account->settledBalance, delta->proceeds);
+    if(delta->bought > 0) atomic_fetch_add(&account->settledInventory, delta->bought);
 }
 
 void account_get_status(ACCOUNT *account, BRS_STATUS_INFO *infop) {
-    // Lock account and list
-    pthread_mutex_lock(&account->mLock);
+    // Get the available balance and inventory for infop
+    infop->inventory = htonl(LEDGER_AVAIL(atomic_load(&account->stock)));
+    infop->balance = htonl(LEDGER_AVAIL(atomic_load(&account->funds)));
+}
 
-    // Get the balance, inventory, and quantity for infop
-    infop->inventory = htonl(account->inventory);
-    infop->balance = htonl(account->balance);
+void account_get_ledger(ACCOUNT *account, BRS_STATUS_INFO *infop, BRS_LEDGER_INFO *ledgerp) {
+    // Each ledger word is read once so available and held are consistent
+    uint64_t funds = atomic_load(&account->funds);
+    uint64_t stock = atomic_load(&account->stock);
 
-    // Unlock account and list
-    pthread_mutex_unlock(&account->mLock);
-}
\ No newline at end of file
+    infop->balance = htonl(LEDGER_AVAIL(funds));
+    infop->inventory = htonl(LEDGER_AVAIL(stock));
+    ledgerp->held_balance = htonl(LEDGER_HELD(funds));
+    ledgerp->held_inventory = htonl(LEDGER_HELD(stock));
+    ledgerp->settled_balance = htonl(atomic_load(&account->settledBalance));
+    ledgerp->settled_inventory = htonl(atomic_load(&account->settledInventory));
+}
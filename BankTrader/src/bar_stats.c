@@ -0,0 +1,103 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "bar_stats.h"
+
+static const uint32_t seriesSeconds[BAR_NUM_SERIES] = {1, 60, 3600, 0};
+
+// Add a trade to the newest bar, or to a new one if its interval has passed
+static void series_trade(BAR_SERIES *series, uint64_t when, quantity_t quantity, funds_t price) {
+    uint64_t numBars = atomic_load_explicit(&series->numBars, memory_order_relaxed);
+    uint64_t start = (series->seconds == 0) ? when : when - when % series->seconds;
+    BAR *bar = &series->bars[(numBars - 1) % BAR_HISTORY];
+    int isNew = (numBars == 0 || (series->seconds != 0 && bar->start != start));
+    if(isNew) bar = &series->bars[numBars % BAR_HISTORY];
+
+    // Make the sequence odd, write, and make it even again
+    uint64_t seq = atomic_load_explicit(&bar->seq, memory_order_relaxed);
+    atomic_store_explicit(&bar->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    if(isNew) {
+        bar->number = numBars;
+        bar->start = start;
+        bar->open = price;
+        bar->high = price;
+        bar->low = price;
+        bar->volume = 0;
+        bar->notional = 0;
+        bar->trades = 0;
+    }
+    if(price > bar->high) bar->high = price;
+    if(price < bar->low) bar->low = price;
+    bar->close = price;
+    bar->volume = bar->volume + quantity;
+    bar->notional = bar->notional + (uint64_t)quantity * price;
+    bar->trades = bar->trades + 1;
+    atomic_store_explicit(&bar->seq, seq + 2, memory_order_release);
+
+    // Readers see a new bar only once it is complete
+    if(isNew) atomic_store_explicit(&series->numBars, numBars + 1, memory_order_release);
+}
+
+// Copy bar n of a series, 0 if it was copied and -1 if it has been reused for a newer one
+static int series_read(BAR_SERIES *series, uint64_t n, BAR *copy) {
+    BAR *bar = &series->bars[n % BAR_HISTORY];
+    uint64_t before, after;
+
+    // Retry until the copy was not overlapped by a write
+    do {
+        before = atomic_load_explicit(&bar->seq, memory_order_acquire);
+        copy->number = bar->number;
+        copy->start = bar->start;
+        copy->open = bar->open;
+        copy->high = bar->high;
+        copy->low = bar->low;
+        copy->close = bar->close;
+        copy->volume = bar->volume;
+        copy->notional = bar->notional;
+        copy->trades = bar->trades;
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&bar->seq, memory_order_relaxed);
+    } while((before & 1) || before != after);
+
+    return (copy->number == n) ? 0 : -1;
+}
+
+void stats_init(BAR_STATS *stats) {
+    memset(stats, 0, sizeof(BAR_STATS));
+    for(int i = 0; i < BAR_NUM_SERIES; i++) stats->series[i].seconds = seriesSeconds[i];
+}
+
+void stats_trade(BAR_STATS *stats, uint64_t when, quantity_t quantity, funds_t price) {
+    for(int i = 0; i < BAR_NUM_SERIES; i++) series_trade(&stats->series[i], when, quantity, price);
+}
+
+size_t stats_bars(BAR_STATS *stats, uint32_t seconds, int count, BRS_STATS_INFO *info) {
+    BAR_SERIES *series = NULL;
+    for(int i = 0; i < BAR_NUM_SERIES; i++) {
+        if(stats->series[i].seconds == seconds) series = &stats->series[i];
+    }
+    if(series == NULL) return 0;
+
+    // The last count bars, less those reused while they were being copied
+    uint64_t numBars = atomic_load_explicit(&series->numBars, memory_order_acquire);
+    uint64_t first = (numBars > (uint64_t)count) ? numBars - count : 0;
+    uint32_t numCopied = 0;
+    for(uint64_t n = first; n < numBars; n++) {
+        BAR bar;
+        if(series_read(series, n, &bar) < 0) continue;
+        BRS_BAR_INFO *barInfo = &info->bars[numCopied];
+        barInfo->start = htonl(bar.start);
+        barInfo->open = htonl(bar.open);
+        barInfo->high = htonl(bar.high);
+        barInfo->low = htonl(bar.low);
+        barInfo->close = htonl(bar.close);
+        barInfo->volume = htonl(bar.volume);
+        barInfo->trades = htonl(bar.trades);
+        barInfo->vwap = htonl(bar.notional / bar.volume);
+        numCopied++;
+    }
+    info->interval = htonl(seconds);
+    info->num_bars = htonl(numCopied);
+    return sizeof(BRS_STATS_INFO) + numCopied * sizeof(BRS_BAR_INFO);
+}
@@ -0,0 +1,155 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "book_depth.h"
+#include "csapp.h"
+
+static void side_init(DEPTH_SIDE *side, int descending) {
+    side->levels = NULL;
+    side->numLevels = 0;
+    side->maxLevels = 0;
+    side->descending = descending;
+}
+
+// Index of the level at a price, or of the first level behind it if there is none
+static int side_find(DEPTH_SIDE *side, funds_t price) {
+    int low = 0, high = side->numLevels;
+    while(low < high) {
+        int mid = low + (high - low) / 2;
+        funds_t midPrice = side->levels[mid].price;
+        int ahead = side->descending ? (midPrice > price) : (midPrice < price);
+        if(ahead) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Drop the levels left without orders, keeping the others in order
+static void side_compact(DEPTH_SIDE *side) {
+    int kept = 0;
+    for(int i = 0; i < side->numLevels; i++) {
+        if(side->levels[i].numOrders == 0) continue;
+        side->levels[kept] = side->levels[i];
+        kept++;
+    }
+    side->numLevels = kept;
+}
+
+void depth_init(BOOK_DEPTH *depth) {
+    side_init(&depth->bids, 1);
+    side_init(&depth->asks, 0);
+    depth->changes = NULL;
+    depth->numChanges = 0;
+    depth->maxChanges = 0;
+    depth->seq = 0;
+}
+
+void depth_fini(BOOK_DEPTH *depth) {
+    if(depth->bids.levels != NULL) Free(depth->bids.levels);
+    if(depth->asks.levels != NULL) Free(depth->asks.levels);
+    if(depth->changes != NULL) Free(depth->changes);
+    depth_init(depth);
+}
+
+void depth_update(BOOK_DEPTH *depth, int isBid, funds_t price, int64_t quantity, int orders) {
+    if(quantity == 0 && orders == 0) return;
+    DEPTH_SIDE *side = isBid ? &depth->bids : &depth->asks;
+    int idx = side_find(side, price);
+
+    // A price without a level gets one, in its place among the others
+    if(idx == side->numLevels || side->levels[idx].price != price) {
+        if(side->numLevels == side->maxLevels) {
+            side->maxLevels = (side->maxLevels == 0) ? 64 : side->maxLevels * 2;
+            side->levels = Realloc(side->levels, side->maxLevels * sizeof(DEPTH_LEVEL));
+        }
+        memmove(&side->levels[idx + 1], &side->levels[idx], (side->numLevels - idx) * sizeof(DEPTH_LEVEL));
+        memset(&side->levels[idx], 0, sizeof(DEPTH_LEVEL));
+        side->levels[idx].price = price;
+        side->numLevels = side->numLevels + 1;
+    }
+    DEPTH_LEVEL *level = &side->levels[idx];
+    level->quantity = level->quantity + quantity;
+    level->numOrders = level->numOrders + orders;
+
+    // Remember the level for the next flush, once however often it changes
+    if(level->changed) return;
+    level->changed = 1;
+    if(depth->numChanges == depth->maxChanges) {
+        depth->maxChanges = (depth->maxChanges == 0) ? 64 : depth->maxChanges * 2;
+        depth->changes = Realloc(depth->changes, depth->maxChanges * sizeof(DEPTH_CHANGE));
+    }
+    depth->changes[depth->numChanges].isBid = isBid;
+    depth->changes[depth->numChanges].price = price;
+    depth->numChanges = depth->numChanges + 1;
+}
+
+size_t depth_snapshot(BOOK_DEPTH *depth, int maxLevels, BRS_DEPTH_INFO *info) {
+    // Levels waiting to be dropped by the next flush are not part of the book
+    DEPTH_SIDE *sides[] = {&depth->bids, &depth->asks};
+    uint32_t counts[2] = {0, 0};
+    int count = 0;
+    for(int s = 0; s < 2; s++) {
+        for(int i = 0; i < sides[s]->numLevels && counts[s] < maxLevels; i++) {
+            DEPTH_LEVEL *level = &sides[s]->levels[i];
+            if(level->numOrders == 0) continue;
+            info->levels[count].price = htonl(level->price);
+            info->levels[count].quantity = htonl(level->quantity);
+            info->levels[count].orders = htonl(level->numOrders);
+            counts[s]++;
+            count++;
+        }
+    }
+    info->seq = htonl(depth->seq);
+    info->num_bids = htonl(counts[0]);
+    info->num_asks = htonl(counts[1]);
+    return sizeof(BRS_DEPTH_INFO) + count * sizeof(BRS_LEVEL_INFO);
+}
+
+void depth_flush(BOOK_DEPTH *depth, DEPTH_SINK sink, void *arg) {
+    if(depth->numChanges == 0) return;
+
+    // The changed levels as they are now, bids first, clearing their marks
+    BRS_LEVEL_INFO *levels = Malloc(depth->numChanges * sizeof(BRS_LEVEL_INFO));
+    int numBids = 0, count = 0, numEmpty = 0;
+    for(int pass = 1; pass >= 0; pass--) {
+        DEPTH_SIDE *side = pass ? &depth->bids : &depth->asks;
+        for(int i = 0; i < depth->numChanges; i++) {
+            if(depth->changes[i].isBid != pass) continue;
+            DEPTH_LEVEL *level = &side->levels[side_find(side, depth->changes[i].price)];
+            level->changed = 0;
+            if(level->numOrders == 0) numEmpty++;
+            levels[count].price = htonl(level->price);
+            levels[count].quantity = htonl(level->numOrders > 0 ? level->quantity : 0);
+            levels[count].orders = htonl(level->numOrders);
+            count++;
+        }
+        if(pass) numBids = count;
+    }
+    depth->numChanges = 0;
+    if(numEmpty > 0) {
+        side_compact(&depth->bids);
+        side_compact(&depth->asks);
+    }
+
+    // As many updates as the payload size needs, each with its own sequence number
+    size_t maxSize = sizeof(BRS_DEPTH_INFO) + BRS_MAX_DEPTH_LEVELS * sizeof(BRS_LEVEL_INFO);
+    BRS_DEPTH_INFO *info = Malloc(maxSize);
+    BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+    for(int i = 0; i < count; i = i + BRS_MAX_DEPTH_LEVELS) {
+        int batch = (count - i < BRS_MAX_DEPTH_LEVELS) ? count - i : BRS_MAX_DEPTH_LEVELS;
+        int batchBids = (numBids > i) ? ((numBids - i < batch) ? numBids - i : batch) : 0;
+        depth->seq = depth->seq + 1;
+        info->seq = htonl(depth->seq);
+        info->num_bids = htonl(batchBids);
+        info->num_asks = htonl(batch - batchBids);
+        memcpy(info->levels, &levels[i], batch * sizeof(BRS_LEVEL_INFO));
+
+        memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+        newPkt->type = BRS_DEPTH_UPDATE_PKT;
+        newPkt->size = htons(sizeof(BRS_DEPTH_INFO) + batch * sizeof(BRS_LEVEL_INFO));
+        sink(newPkt, info, arg);
+    }
+    Free(newPkt);
+    Free(info);
+    Free(levels);
+}
@@ -1,5 +1,5 @@
-#include <semaphore.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "server.h"
 #include "csapp.h"
@@ -7,17 +7,26 @@
 #include "debug.h"
 #include "structs.h"
 
-/*** HELPFUL TIPS ***/
-// Use a mutex to protect access to the thread counter data.  
-// Use a semaphore to perform the required blocking in the creg_wait_for_empty()
-// Use P(sem_t *s) for sem_wait, used in creg_wait_for_empty()
-// Use V(sem_t *s) for sem_post, used in creg_wait_for_empty() and creg_unregister()
-// Destroy semaphores and mutexes before deallocated
+/*
+ * The registry is indexed by file descriptor, so registering and
+ * unregistering are O(1).  The table grows by doubling when a descriptor
+ * beyond its end is registered, so it is not bounded by FD_SETSIZE.
+ * Registered entries are also linked into a list, through their indices
+ * in the table, so that creg_shutdown_all visits only live sessions.
+ */
+typedef struct creg_entry {
+    int registered; // Nonzero while the descriptor is registered
+    int prev; // Previous live descriptor, -1 at the head of the list
+    int next; // Next live descriptor, -1 at the tail of the list
+} CREG_ENTRY;
 
 typedef struct client_registry {
-    int numClients; // Number of clients registered (used to track if more than 0 clients are registered)
-    int fdBuf[FD_SETSIZE]; // File descriptors for clients
-    sem_t semGuard; // Semaphore for clients (acts as guard)
+    _Atomic int numClients; // Number of clients registered, readable without the lock
+    _Atomic unsigned long totalClients; // Number of registrations since creg_init
+    CREG_ENTRY *entries; // Entries for clients, indexed by file descriptor
+    int numEntries; // Capacity of entries
+    int liveHead; // First live descriptor, -1 if there is none
+    pthread_cond_t emptyCond; // Signaled when numClients drops to 0
     pthread_mutex_t mLock; // Mutex for clients (acts as a lock)
 } CLIENT_REGISTRY;
 
@@ -25,23 +34,20 @@ CLIENT_REGISTRY *creg_init() {
     // Create the newClient variable
     CLIENT_REGISTRY *newClient = Malloc(sizeof(CLIENT_REGISTRY));
     memset(newClient, 0, sizeof(CLIENT_REGISTRY));
-    if(newClient == NULL) return NULL;
 
-    // Set the count (numClients) to 0
-    newClient->numClients = 0;
+    // Start with room for FD_SETSIZE descriptors, none of them registered
+    newClient->numEntries = FD_SETSIZE;
+    newClient->entries = Calloc(newClient->numEntries, sizeof(CREG_ENTRY));
+    newClient->liveHead = -1;
 
-    // Set each file descriptor to -1 since none have been assigned yet
-    for(int i = 0; i < FD_SETSIZE; i++) {
-        newClient->fdBuf[i] = -1;
-    }
-
-    // Initialize semaphore and mutex
-    int s = sem_init(&newClient->semGuard, 0, 0);
+    // Initialize condition variable and mutex
+    int c = pthread_cond_init(&newClient->emptyCond, NULL);
     int m = pthread_mutex_init(&newClient->mLock, NULL);
 
     // Return null if either of the initializations fail
-    if(s < 0 || m < 0) {
-        free(newClient);
+    if(c != 0 || m != 0) {
+        Free(newClient->entries);
+        Free(newClient);
         return NULL;
     }
 
@@ -50,26 +56,47 @@ CLIENT_REGISTRY *creg_init() {
 }
 
 void creg_fini(CLIENT_REGISTRY *cr) {
-    // Destroy semaphore and mutex before it is deallocated
-    sem_destroy(&cr->semGuard);
+    // Destroy condition variable and mutex before it is deallocated
+    pthread_cond_destroy(&cr->emptyCond);
     pthread_mutex_destroy(&cr->mLock);
 
     // Deallocate client pointer
+    Free(cr->entries);
     Free(cr);
 }
 
 int creg_register(CLIENT_REGISTRY *cr, int fd) {
-    // If file descriptor is not -1, it is already registered, hence return EXIT_FAILURE
-    if(cr->fdBuf[fd] != -1) return EXIT_FAILURE;
+    if(fd < 0) return EXIT_FAILURE;
 
     // Lock the mutex since it is being used to set data for the client
     pthread_mutex_lock(&cr->mLock);
 
+    // Grow the table until the descriptor fits, new entries are unregistered
+    if(fd >= cr->numEntries) {
+        int newNum = cr->numEntries;
+        while(fd >= newNum) newNum = newNum * 2;
+        cr->entries = Realloc(cr->entries, newNum * sizeof(CREG_ENTRY));
+        memset(&cr->entries[cr->numEntries], 0, (newNum - cr->numEntries) * sizeof(CREG_ENTRY));
+        cr->numEntries = newNum;
+    }
+
+    // If the file descriptor is registered already, return EXIT_FAILURE
+    CREG_ENTRY *entry = &cr->entries[fd];
+    if(entry->registered) {
+        pthread_mutex_unlock(&cr->mLock);
+        return EXIT_FAILURE;
+    }
+
+    // Push the descriptor on the live list
+    entry->registered = 1;
+    entry->prev = -1;
+    entry->next = cr->liveHead;
+    if(cr->liveHead >= 0) cr->entries[cr->liveHead].prev = fd;
+    cr->liveHead = fd;
+
     // Increase the number of clients
     cr->numClients = cr->numClients + 1;
-
-    // Set the file descriptor to the parameter given
-    cr->fdBuf[fd] = fd;
+    cr->totalClients = cr->totalClients + 1;
 
     // Unlock the mutex as the client is no longer being used
     pthread_mutex_unlock(&cr->mLock);
@@ -78,23 +105,29 @@ int creg_register(CLIENT_REGISTRY *cr, int fd) {
 }
 
 int creg_unregister(CLIENT_REGISTRY *cr, int fd) {
-    // If file descriptor is not fd, it is already unregistered, hence return EXIT_FAILURE
-    if(cr->fdBuf[fd] != fd) return EXIT_FAILURE;
-
     // Lock the mutex since it is being used to remove data from the client
     pthread_mutex_lock(&cr->mLock);
 
-    // Decrease the number of clients
-    cr->numClients = cr->numClients - 1;
+    // If the file descriptor is not registered, return EXIT_FAILURE
+    if(fd < 0 || fd >= cr->numEntries || !cr->entries[fd].registered) {
+        pthread_mutex_unlock(&cr->mLock);
+        return EXIT_FAILURE;
+    }
 
-    // Set the file descriptor to the parameter given
-    close(cr->fdBuf[fd]);
-    cr->fdBuf[fd] = -1;
+    // Unlink the descriptor from the live list
+    CREG_ENTRY *entry = &cr->entries[fd];
+    if(entry->prev >= 0) cr->entries[entry->prev].next = entry->next;
+    else cr->liveHead = entry->next;
+    if(entry->next >= 0) cr->entries[entry->next].prev = entry->prev;
+    entry->registered = 0;
 
-    // Check if numClients == 0
-    if(cr->numClients == 0) {
-        if(sem_post(&cr->semGuard) < 0) return EXIT_FAILURE;
-    }
+    // Close while the lock is held, since the descriptor number can be
+    // reused by an accept as soon as it is closed
+    close(fd);
+
+    // Decrease the number of clients, waking the waiters when it reaches 0
+    cr->numClients = cr->numClients - 1;
+    if(cr->numClients == 0) pthread_cond_broadcast(&cr->emptyCond);
 
     // Unlock the mutex as the client is no longer being used
     pthread_mutex_unlock(&cr->mLock);
@@ -104,18 +137,25 @@ int creg_unregister(CLIENT_REGISTRY *cr, int fd) {
 
 void creg_wait_for_empty(CLIENT_REGISTRY *cr) {
     // Wait until the number of registered clients reaches 0
-    // Will throw an error if semGuard < 0
-    P(&cr->semGuard);
+    pthread_mutex_lock(&cr->mLock);
+    while(cr->numClients > 0) pthread_cond_wait(&cr->emptyCond, &cr->mLock);
+    pthread_mutex_unlock(&cr->mLock);
 }
 
 void creg_shutdown_all(CLIENT_REGISTRY *cr) {
-    // Loop through each file descriptor to unregister and shutdown each one
-    for(int i = 0; i < FD_SETSIZE; i++) {
-        if(cr->fdBuf[i] != -1) {
-            close(cr->fdBuf[i]);
-            shutdown(cr->fdBuf[i], SHUT_RD);
-            creg_unregister(cr, cr->fdBuf[i]);
-            cr->fdBuf[i] = -1;
-        }
+    // Shut down the reading side of each live connection.  The thread serving
+    // it then sees end of file and unregisters (and closes) the descriptor.
+    pthread_mutex_lock(&cr->mLock);
+    for(int fd = cr->liveHead; fd >= 0; fd = cr->entries[fd].next) {
+        shutdown(fd, SHUT_RD);
     }
-}
\ No newline at end of file
+    pthread_mutex_unlock(&cr->mLock);
+}
+
+int creg_count(CLIENT_REGISTRY *cr) {
+    return cr->numClients;
+}
+
+unsigned long creg_total(CLIENT_REGISTRY *cr) {
+    return cr->totalClients;
+}
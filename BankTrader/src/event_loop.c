@@ -0,0 +1,456 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#ifdef BRS_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "event_loop.h"
+#include "server.h"
+#include "structs.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define EVLOOP_MAX_EVENTS 256       // Readiness events taken per epoll_wait
+#define EVLOOP_RECV_SIZE 16384      // Bytes taken per recv by the epoll loop
+
+// A connection served by the event loop
+typedef struct evloop_conn {
+    BRS_SESSION session;        // Session state, as for a session worker
+    char *buf;                  // Start of a packet that has not fully arrived
+    size_t len;                 // Number of bytes in buf
+    size_t cap;                 // Capacity of buf
+} EVLOOP_CONN;
+
+static EVLOOP_BACKEND loopBackend = EVLOOP_THREADS;
+static int wakeFd = -1;             // eventfd signaled when connections are added
+static EVLOOP_CONN **conns = NULL;  // Connections, indexed by file descriptor
+static int numConns = 0;            // Capacity of conns
+
+// Connections accepted but not yet picked up by the event loop
+static int *newFds = NULL;
+static int numNew = 0;
+static int maxNew = 0;
+static pthread_mutex_t newLock = PTHREAD_MUTEX_INITIALIZER;
+
+int evloop_backend(char *name) {
+    if(strcmp(name, "threads") == 0) return EVLOOP_THREADS;
+    if(strcmp(name, "epoll") == 0) return EVLOOP_EPOLL;
+    if(strcmp(name, "io_uring") == 0 || strcmp(name, "uring") == 0) return EVLOOP_URING;
+    return -1;
+}
+
+int evloop_active(void) {
+    return loopBackend != EVLOOP_THREADS;
+}
+
+void evloop_add(int fileDesc) {
+    pthread_mutex_lock(&newLock);
+    if(numNew == maxNew) {
+        maxNew = (maxNew == 0) ? 64 : maxNew * 2;
+        newFds = Realloc(newFds, maxNew * sizeof(int));
+    }
+    newFds[numNew++] = fileDesc;
+    pthread_mutex_unlock(&newLock);
+
+    // Wake the event loop
+    uint64_t one = 1;
+    if(write(wakeFd, &one, sizeof(one)) < 0) debug("eventfd write: %s", strerror(errno));
+}
+
+/*
+ * Carry out every complete request in a run of received bytes.
+ *
+ * @return The number of bytes used, the rest being the start of a packet
+ * that has not fully arrived.
+ */
+static size_t conn_dispatch(EVLOOP_CONN *conn, char *data, size_t n) {
+    size_t used = 0;
+    while(n - used >= sizeof(BRS_PACKET_HEADER)) {
+        BRS_PACKET_HEADER hdr;
+        memcpy(&hdr, data + used, sizeof(BRS_PACKET_HEADER));
+        size_t pktSize = ntohs(hdr.size);
+        if(n - used < sizeof(BRS_PACKET_HEADER) + pktSize) break;
+
+        // Stamp the arrival time and copy the payload, as proto_recv_packet does
+        struct timespec currTime;
+        timespec_get(&currTime, TIME_UTC);
+        hdr.timestamp_sec = ntohl(currTime.tv_sec);
+        hdr.timestamp_nsec = ntohl(currTime.tv_nsec);
+        void *payload = NULL;
+        if(pktSize) {
+            payload = Malloc(pktSize);
+            memcpy(payload, data + used + sizeof(BRS_PACKET_HEADER), pktSize);
+        }
+
+        brs_session_request(&conn->session, &hdr, payload);
+        used = used + sizeof(BRS_PACKET_HEADER) + pktSize;
+    }
+    return used;
+}
+
+/*
+ * Take bytes received on a connection.  They are handled in place when no
+ * partial packet is pending, and only an incomplete tail is copied.
+ */
+static void conn_input(EVLOOP_CONN *conn, char *data, size_t n) {
+    // Complete the pending packet first
+    if(conn->len > 0) {
+        if(conn->len + n > conn->cap) {
+            while(conn->len + n > conn->cap) conn->cap = conn->cap * 2;
+            conn->buf = Realloc(conn->buf, conn->cap);
+        }
+        memcpy(conn->buf + conn->len, data, n);
+        data = conn->buf;
+        n = conn->len + n;
+    }
+
+    // Keep whatever is left for the next time
+    size_t used = conn_dispatch(conn, data, n);
+    size_t left = n - used;
+    if(left > 0 && data != conn->buf) {
+        if(left > conn->cap) {
+            while(left > conn->cap) conn->cap = conn->cap * 2;
+            conn->buf = Realloc(conn->buf, conn->cap);
+        }
+        memcpy(conn->buf, data + used, left);
+    } else if(left > 0) memmove(conn->buf, conn->buf + used, left);
+    conn->len = left;
+}
+
+static EVLOOP_CONN *conn_open(int fileDesc) {
+    // Register the connection, which is closed if that fails
+    EVLOOP_CONN *conn = Malloc(sizeof(EVLOOP_CONN));
+    memset(conn, 0, sizeof(EVLOOP_CONN));
+    if(brs_session_open(&conn->session, fileDesc) == EXIT_FAILURE) {
+        Free(conn);
+        return NULL;
+    }
+    conn->cap = 256;
+    conn->buf = Malloc(conn->cap);
+
+    // Nothing done on the loop's thread may wait for a client
+    fcntl(fileDesc, F_SETFL, fcntl(fileDesc, F_GETFL) | O_NONBLOCK);
+
+    // Grow the table until the descriptor fits
+    if(fileDesc >= numConns) {
+        int newNum = (numConns == 0) ? FD_SETSIZE : numConns;
+        while(fileDesc >= newNum) newNum = newNum * 2;
+        conns = Realloc(conns, newNum * sizeof(EVLOOP_CONN *));
+        memset(&conns[numConns], 0, (newNum - numConns) * sizeof(EVLOOP_CONN *));
+        numConns = newNum;
+    }
+    conns[fileDesc] = conn;
+    return conn;
+}
+
+static void conn_close(EVLOOP_CONN *conn) {
+    conns[conn->session.fileDesc] = NULL;
+    brs_session_close(&conn->session);
+    Free(conn->buf);
+    Free(conn);
+}
+
+/*
+ * Take the connections added since the last call.
+ *
+ * @return The number of connections, stored in a buffer the caller frees.
+ */
+static int take_new(int **fdsp) {
+    pthread_mutex_lock(&newLock);
+    int num = numNew;
+    *fdsp = NULL;
+    if(num > 0) {
+        *fdsp = Malloc(num * sizeof(int));
+        memcpy(*fdsp, newFds, num * sizeof(int));
+    }
+    numNew = 0;
+    pthread_mutex_unlock(&newLock);
+    return num;
+}
+
+static void epoll_loop(void) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0) unix_error("epoll_create1 error");
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = wakeFd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &event);
+
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+    char *recvBuf = Malloc(EVLOOP_RECV_SIZE);
+    while(1) {
+        int numEvents = epoll_wait(epfd, events, EVLOOP_MAX_EVENTS, -1);
+        if(numEvents < 0 && errno == EINTR) continue;
+        if(numEvents < 0) unix_error("epoll_wait error");
+
+        for(int i = 0; i < numEvents; i++) {
+            int fileDesc = events[i].data.fd;
+
+            // New connections, watched for input from now on
+            if(fileDesc == wakeFd) {
+                uint64_t count;
+                if(read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) unix_error("eventfd read error");
+                int *fds;
+                int num = take_new(&fds);
+                for(int j = 0; j < num; j++) {
+                    if(conn_open(fds[j]) == NULL) continue;
+                    event.events = EPOLLIN;
+                    event.data.fd = fds[j];
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fds[j], &event);
+                }
+                if(fds != NULL) Free(fds);
+                continue;
+            }
+
+            // Drain the connection, closing it at end of file or on error
+            // (closing also removes it from the epoll set)
+            EVLOOP_CONN *conn = (fileDesc < numConns) ? conns[fileDesc] : NULL;
+            while(conn != NULL) {
+                ssize_t n = recv(fileDesc, recvBuf, EVLOOP_RECV_SIZE, MSG_DONTWAIT);
+                if(n > 0) {
+                    conn_input(conn, recvBuf, n);
+                    if(n < EVLOOP_RECV_SIZE) break;
+                } else if(n < 0 && errno == EINTR) continue;
+                else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                else {
+                    conn_close(conn);
+                    conn = NULL;
+                }
+            }
+        }
+    }
+}
+
+#ifdef BRS_IO_URING
+
+#define URING_ENTRIES 4096          // Submission queue entries
+#define URING_CQ_ENTRIES 16384      // Completion queue entries
+#define URING_BUF_COUNT 1024        // Provided receive buffers, a power of two
+#define URING_BUF_SIZE 4096         // Size of each provided buffer
+#define URING_BUF_GROUP 0           // Buffer group of the provided buffers
+#define URING_WAKE_TAG (~0ULL)      // user_data of the eventfd read
+
+// An io_uring instance, driven through the raw system calls
+typedef struct uring {
+    int ringFd;                     // io_uring file descriptor
+    unsigned *sqHead;               // Submission queue ring, shared with the kernel
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned toSubmit;              // Entries queued since the last io_uring_enter
+    unsigned *cqHead;               // Completion queue ring, shared with the kernel
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufRing;  // Ring of provided buffers
+    char *bufs;                     // Memory of the provided buffers
+    unsigned short bufTail;         // Tail of bufRing, published in batches
+} URING;
+
+static URING ring;
+static uint64_t wakeCount;          // Target of the eventfd read
+
+static int uring_setup(URING *uring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    uring->ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if(uring->ringFd < 0) return EXIT_FAILURE;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(uring->ringFd);
+        return EXIT_FAILURE;
+    }
+
+    // Map the rings, which share one mapping, and the submission entries
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringSize = (sqSize > cqSize) ? sqSize : cqSize;
+    char *rings = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring->ringFd, IORING_OFF_SQ_RING);
+    uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->ringFd, IORING_OFF_SQES);
+    if(rings == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        close(uring->ringFd);
+        return EXIT_FAILURE;
+    }
+    uring->sqHead = (unsigned *)(rings + params.sq_off.head);
+    uring->sqTail = (unsigned *)(rings + params.sq_off.tail);
+    uring->sqMask = *(unsigned *)(rings + params.sq_off.ring_mask);
+    uring->sqEntries = params.sq_entries;
+    uring->sqArray = (unsigned *)(rings + params.sq_off.array);
+    uring->cqHead = (unsigned *)(rings + params.cq_off.head);
+    uring->cqTail = (unsigned *)(rings + params.cq_off.tail);
+    uring->cqMask = *(unsigned *)(rings + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    uring->toSubmit = 0;
+
+    // Register the ring of provided buffers that multishot receives take from
+    uring->bufRing = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(uring->bufRing == MAP_FAILED) {
+        close(uring->ringFd);
+        return EXIT_FAILURE;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)uring->bufRing;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if(syscall(__NR_io_uring_register, uring->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        close(uring->ringFd);
+        return EXIT_FAILURE;
+    }
+    uring->bufs = Malloc(URING_BUF_COUNT * URING_BUF_SIZE);
+    uring->bufTail = 0;
+    for(int bid = 0; bid < URING_BUF_COUNT; bid++) {
+        struct io_uring_buf *buf = &uring->bufRing->bufs[uring->bufTail++ & (URING_BUF_COUNT - 1)];
+        buf->addr = (unsigned long)(uring->bufs + bid * URING_BUF_SIZE);
+        buf->len = URING_BUF_SIZE;
+        buf->bid = bid;
+    }
+    __atomic_store_n(&uring->bufRing->tail, uring->bufTail, __ATOMIC_RELEASE);
+    return EXIT_SUCCESS;
+}
+
+// Queue a buffer to go back to the kernel, published by uring_publish_bufs
+static void uring_recycle_buf(URING *uring, int bid) {
+    struct io_uring_buf *buf = &uring->bufRing->bufs[uring->bufTail++ & (URING_BUF_COUNT - 1)];
+    buf->addr = (unsigned long)(uring->bufs + bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+}
+
+static void uring_publish_bufs(URING *uring) {
+    __atomic_store_n(&uring->bufRing->tail, uring->bufTail, __ATOMIC_RELEASE);
+}
+
+// Submit the queued entries, waiting for at least waitFor completions
+static void uring_enter(URING *uring, unsigned waitFor) {
+    while(1) {
+        int ret = syscall(__NR_io_uring_enter, uring->ringFd, uring->toSubmit, waitFor,
+                          waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(ret >= 0) {
+            uring->toSubmit = uring->toSubmit - ret;
+            return;
+        }
+        if(errno != EINTR && errno != EAGAIN && errno != EBUSY) unix_error("io_uring_enter error");
+    }
+}
+
+// Get a cleared submission entry, submitting the queue first if it is full
+static struct io_uring_sqe *uring_get_sqe(URING *uring) {
+    unsigned tail = *uring->sqTail;
+    if(tail - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE) == uring->sqEntries) {
+        uring_enter(uring, 0);
+    }
+    unsigned index = tail & uring->sqMask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    uring->sqArray[index] = index;
+    __atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    uring->toSubmit = uring->toSubmit + 1;
+    return sqe;
+}
+
+// Arm a multishot receive on a connection, into the provided buffers
+static void uring_arm_recv(URING *uring, int fileDesc) {
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fileDesc;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = fileDesc;
+}
+
+// Arm a read of the eventfd, which completes when connections are added
+static void uring_arm_wake(URING *uring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeFd;
+    sqe->addr = (unsigned long)&wakeCount;
+    sqe->len = sizeof(wakeCount);
+    sqe->user_data = URING_WAKE_TAG;
+}
+
+static void uring_loop(void) {
+    uring_arm_wake(&ring);
+    while(1) {
+        // One system call submits everything queued and waits for input
+        uring_enter(&ring, 1);
+
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cqMask];
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            // New connections, each with a receive armed from now on
+            if(cqe->user_data == URING_WAKE_TAG) {
+                int *fds;
+                int num = take_new(&fds);
+                for(int j = 0; j < num; j++) {
+                    if(conn_open(fds[j]) != NULL) uring_arm_recv(&ring, fds[j]);
+                }
+                if(fds != NULL) Free(fds);
+                uring_arm_wake(&ring);
+                continue;
+            }
+
+            // Handle the received bytes, then give the buffer back
+            int fileDesc = cqe->user_data;
+            EVLOOP_CONN *conn = (fileDesc < numConns) ? conns[fileDesc] : NULL;
+            if(flags & IORING_CQE_F_BUFFER) {
+                int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                if(res > 0 && conn != NULL) conn_input(conn, ring.bufs + bid * URING_BUF_SIZE, res);
+                uring_recycle_buf(&ring, bid);
+            }
+            if(conn == NULL || (flags & IORING_CQE_F_MORE)) continue;
+
+            // The receive is no longer armed: rearm it if it only ran out of
+            // buffers, otherwise the connection is at end of file or failed
+            if(res > 0 || res == -ENOBUFS) uring_arm_recv(&ring, fileDesc);
+            else conn_close(conn);
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        uring_publish_bufs(&ring);
+    }
+}
+
+#endif
+
+static void *evloop_thread(void *arg) {
+    Pthread_detach(pthread_self());
+#ifdef BRS_IO_URING
+    if(loopBackend == EVLOOP_URING) uring_loop();
+#endif
+    if(loopBackend == EVLOOP_EPOLL) epoll_loop();
+    return NULL;
+}
+
+int evloop_start(EVLOOP_BACKEND backend) {
+    if(backend == EVLOOP_THREADS) return EXIT_SUCCESS;
+#ifdef BRS_IO_URING
+    if(backend == EVLOOP_URING && uring_setup(&ring) == EXIT_FAILURE) return EXIT_FAILURE;
+#else
+    if(backend == EVLOOP_URING) return EXIT_FAILURE;
+#endif
+
+    // The epoll loop reads the eventfd itself, the io_uring loop has the kernel read it
+    int wakeFlags = EFD_CLOEXEC | ((backend == EVLOOP_EPOLL) ? EFD_NONBLOCK : 0);
+    if((wakeFd = eventfd(0, wakeFlags)) < 0) return EXIT_FAILURE;
+    loopBackend = backend;
+
+    pthread_t tid;
+    Pthread_create(&tid, NULL, evloop_thread, NULL);
+    return EXIT_SUCCESS;
+}
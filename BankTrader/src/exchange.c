@@ -11,8 +11,11 @@
 #include "account.h"
 #include "structs.h"
 #include "csapp.h"
+#include "protocol_ext.h"
+#include "shm_feed.h"
 
-EXCHANGE *exchange_init() {
+// An exchange of a market, without its matchmaker
+static EXCHANGE *exchange_create(MARKET *market) {
     // Create new exchange
     EXCHANGE *newExchange = Malloc(sizeof(EXCHANGE));
     memset(newExchange, 0, sizeof(EXCHANGE));
@@ -23,22 +26,55 @@ EXCHANGE *exchange_init() {
     newExchange->highest_bid = 0;
     newExchange->highest_ask = 0;
     newExchange->numExchgs = 0;
+    newExchange->lastId = 0;
     newExchange->finished = 0;
 
-    // Instantiate order
-    newExchange->currOrder = NULL;
+    // Instantiate both sides of the book, and the trigger books of stop orders
+    newExchange->bids = NULL;
+    newExchange->asks = NULL;
+    newExchange->buyStops = NULL;
+    newExchange->sellStops = NULL;
+    newExchange->settle = Malloc(sizeof(SETTLEMENT));
+    memset(newExchange->settle, 0, sizeof(SETTLEMENT));
+    newExchange->market = market;
+    newExchange->settle->market = market;
+
+    // Deadlines of good-till-time orders, kept on a wheel the matchmaker advances
+    timer_wheel_init(&newExchange->expiry);
+    newExchange->numTimed = 0;
+
+    // A trader's own crossing orders cancel the one that was resting, unless set otherwise
+    newExchange->stpMode = STP_CANCEL_RESTING;
 
-    // Initialize semaphores, mutex, and create thread
+    // Price levels of the book, empty as the book is
+    depth_init(&newExchange->depth);
+    stats_init(&newExchange->stats);
+
+    // Initialize semaphores and mutex
     sem_init(&newExchange->madeXchg, 0, 0);
     sem_init(&newExchange->waitForChange, 0, 0);
     pthread_mutexattr_init(&newExchange->attr);
     pthread_mutexattr_settype(&newExchange->attr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&newExchange->mLock, NULL);
-    Pthread_create(&mtid, NULL, matchmaking, newExchange);
 
     return newExchange;
 }
 
+EXCHANGE *exchange_init() {
+    // The server's exchange, matched by a thread of its own
+    EXCHANGE *newExchange = exchange_create(&defaultMarket);
+    Pthread_create(&newExchange->matchmaker, NULL, matchmaking, newExchange);
+    return newExchange;
+}
+
+EXCHANGE *exchange_embed(MARKET *market) {
+    // Matched inline by the threads that post, with nothing running behind the owner's back
+    EXCHANGE *newExchange = exchange_create(market);
+    newExchange->embedded = 1;
+    newExchange->inlineMatch = 1;
+    return newExchange;
+}
+
 void exchange_fini(EXCHANGE *xchg) {
     // Set all integer attributes to 0
     xchg->last = 0;
@@ -48,10 +84,23 @@ void exchange_fini(EXCHANGE *xchg) {
     xchg->finished = 1;
 
     // Free malloced variables and destroy pthreads/mutexes
-    if(xchg->currOrder != NULL) Free(xchg->currOrder);
-    V(&xchg->madeXchg);
-    P(&xchg->waitForChange);
-    Pthread_join(mtid, NULL);
+    ORDER **lists[] = {&xchg->bids, &xchg->asks, &xchg->buyStops, &xchg->sellStops};
+    for(int i = 0; i < 4; i++) {
+        while(*lists[i] != NULL) {
+            ORDER *tempOrder = *lists[i];
+            *lists[i] = tempOrder->nextOrder;
+            Free(tempOrder);
+        }
+    }
+    if(!xchg->embedded) {
+        V(&xchg->madeXchg);
+        P(&xchg->waitForChange);
+        Pthread_join(xchg->matchmaker, NULL);
+    }
+    if(xchg->settle->fills != NULL) Free(xchg->settle->fills);
+    if(xchg->settle->notices != NULL) Free(xchg->settle->notices);
+    Free(xchg->settle);
+    depth_fini(&xchg->depth);
     Free(xchg);
 }
 
@@ -72,17 +121,117 @@ void exchange_sell_buy(EXCHANGE *xchg, TRADER *trader, ORDER *newOrder, quantity
         newOrder->ask = price;
     }
     newOrder->quantity = quantity;
-    newOrder->orderid = xchg->numExchgs;
+    newOrder->orderid = ++xchg->lastId;
     newOrder->trader = trader;
-    newOrder->nextOrder = xchg->currOrder;
-    xchg->currOrder = newOrder;
 
-    ORDER *tempOrder = xchg->currOrder;
-    int count = 0;
+    // Insert the order into its side of the book in price-time priority,
+    // or into the trigger book of its side if it is a stop
+    exchange_insert_order(xchg, newOrder);
+
+    // Push the order onto the front of the trader's own list
+    newOrder->traderPrev = NULL;
+    newOrder->traderNext = trader->orders;
+    if(trader->orders != NULL) trader->orders->traderPrev = newOrder;
+    trader->orders = newOrder;
+    trader->numOrders = trader->numOrders + 1;
+}
+
+// List an order belongs on: its side of the book, or the trigger book of its side while it is a stop
+static ORDER **order_list(EXCHANGE *xchg, ORDER *order) {
+    if(order->stopPrice != 0) return (order->bid > 0) ? &xchg->buyStops : &xchg->sellStops;
+    return (order->bid > 0) ? &xchg->bids : &xchg->asks;
+}
+
+void exchange_insert_order(EXCHANGE *xchg, ORDER *order) {
+    // Bids go from highest to lowest price and asks from lowest to highest, while buy
+    // stops go from lowest to highest trigger price and sell stops from highest to lowest,
+    // so the next to trigger is in front; orders at the same price keep their arrival order
+    ORDER **head = order_list(xchg, order);
+    int isBuyer = (order->bid > 0);
+    funds_t price = (order->stopPrice != 0) ? order->stopPrice : isBuyer ? order->bid : order->ask;
+    int descending = (isBuyer == (order->stopPrice == 0));
+    ORDER *prevOrder = NULL;
+    ORDER *tempOrder = *head;
     while(tempOrder != NULL) {
-        count++;
+        funds_t tempPrice = (order->stopPrice != 0) ? tempOrder->stopPrice : isBuyer ? tempOrder->bid : tempOrder->ask;
+        if(descending && tempPrice < price) break;
+        if(!descending && tempPrice > price) break;
+        prevOrder = tempOrder;
         tempOrder = tempOrder->nextOrder;
-    }    
+    }
+    order->prevOrder = prevOrder;
+    order->nextOrder = tempOrder;
+    if(prevOrder != NULL) prevOrder->nextOrder = order;
+    else *head = order;
+    if(tempOrder != NULL) tempOrder->prevOrder = order;
+    exchange_depth_update(xchg, order, order->quantity, 1);
+}
+
+void exchange_requeue_order(EXCHANGE *xchg, ORDER *order) {
+    // The order goes behind the last order at its price, which is where it would be inserted
+    funds_t price = (order->bid > 0) ? order->bid : order->ask;
+    ORDER *lastOrder = order;
+    while(lastOrder->nextOrder != NULL && (order->bid > 0 ? lastOrder->nextOrder->bid : lastOrder->nextOrder->ask) == price) {
+        lastOrder = lastOrder->nextOrder;
+    }
+    if(lastOrder == order) return;
+
+    // Unlink it from its place, then link it back in after that order
+    if(order->prevOrder != NULL) order->prevOrder->nextOrder = order->nextOrder;
+    else *order_list(xchg, order) = order->nextOrder;
+    order->nextOrder->prevOrder = order->prevOrder;
+    order->prevOrder = lastOrder;
+    order->nextOrder = lastOrder->nextOrder;
+    if(lastOrder->nextOrder != NULL) lastOrder->nextOrder->prevOrder = order;
+    lastOrder->nextOrder = order;
+}
+
+void exchange_remove_order(EXCHANGE *xchg, ORDER *order) {
+    // Unlink the order from its side of the book, or from its trigger book
+    if(order->prevOrder != NULL) order->prevOrder->nextOrder = order->nextOrder;
+    else *order_list(xchg, order) = order->nextOrder;
+    if(order->nextOrder != NULL) order->nextOrder->prevOrder = order->prevOrder;
+    exchange_depth_update(xchg, order, -(int64_t)order->quantity, -1);
+
+    // Unlink the order from the trader's list
+    TRADER *trader = order->trader;
+    if(order->traderPrev != NULL) order->traderPrev->traderNext = order->traderNext;
+    else trader->orders = order->traderNext;
+    if(order->traderNext != NULL) order->traderNext->traderPrev = order->traderPrev;
+    trader->numOrders = trader->numOrders - 1;
+
+    // An order that leaves the book no longer expires
+    if(order->expireTime != 0) {
+        timer_cancel(&order->expiry);
+        order->expireTime = 0;
+        xchg->numTimed = xchg->numTimed - 1;
+    }
+
+    order->nextOrder = order->prevOrder = NULL;
+    order->traderNext = order->traderPrev = NULL;
+}
+
+// Depth updates go to the subscribers of the exchange's market
+static int depth_sink(BRS_PACKET_HEADER *pkt, void *data, void *arg) {
+    return market_broadcast((MARKET *)arg, pkt, data);
+}
+
+void exchange_refresh_quotes(EXCHANGE *xchg) {
+    // The best bid and ask are at the front of each side of the book
+    xchg->highest_bid = (xchg->bids != NULL) ? xchg->bids->bid : 0;
+    xchg->highest_ask = (xchg->asks != NULL) ? xchg->asks->ask : 0;
+
+    // Publish the top of book to co-located readers and conflated sessions, and the levels that changed to subscribers
+    shm_feed_quote(xchg->highest_bid, xchg->highest_ask, xchg->last);
+    market_conflate_quote(xchg->market, xchg->highest_bid, xchg->highest_ask, xchg->last);
+    depth_flush(&xchg->depth, depth_sink, xchg->market);
+}
+
+void exchange_depth_update(EXCHANGE *xchg, ORDER *order, int64_t quantity, int orders) {
+    // Stops waiting in a trigger book are not on the book
+    if(order->stopPrice != 0) return;
+    int isBuyer = (order->bid > 0);
+    depth_update(&xchg->depth, isBuyer, isBuyer ? order->bid : order->ask, quantity, orders);
 }
 
 void exchange_post(ORDER *newOrder, quantity_t quantity, funds_t price, int isBuyer, int forCancel) {
@@ -105,123 +254,136 @@ void exchange_post(ORDER *newOrder, quantity_t quantity, funds_t price, int isBu
     // Fill in newPkt info, time is done in proto_send_packet
     if(forCancel) newPkt->type = BRS_CANCEL_PKT;
     else newPkt->type = BRS_POSTED_PKT;
-    newPkt->size = sizeof(BRS_NOTIFY_INFO);
+    newPkt->size = htons(sizeof(BRS_NOTIFY_INFO));
 
     // Broadcast packet to all traders
-    trader_broadcast_packet(newPkt, notifyType);
+    market_broadcast(newOrder->trader->market, newPkt, notifyType);
 
     // Free variables, then, return orderid
     free(newPkt);
     free(notifyType);
 }
 
-orderid_t exchange_post_buy(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price) {
+// Have what was just posted matched: at once by the posting thread if the exchange matches inline,
+// by the matchmaker otherwise.  The exchange lock must be held.
+static void posted(EXCHANGE *xchg) {
+    if(xchg->inlineMatch && xchg->auctionInterval == 0) exchange_match(xchg);
+    else if(!xchg->embedded) V(&xchg->madeXchg);
+}
+
+orderid_t exchange_post_terms(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price,
+                              int isBuyer, ORDER_TERMS *terms) {
     // Lock the mutex for trader, then retrieve account
     pthread_mutex_lock(&xchg->mLock);
     ACCOUNT *currAccount = trader_get_account(trader);
 
-    // Check if the trader's balance is enough to purchase
-    if(account_decrease_balance(currAccount, quantity * price) == EXIT_SUCCESS) {
-        // Increase the numExchgs count and trader count, change highest bid if price is greater
+    // An expiry time that has already passed is refused
+    struct timespec currTime;
+    timespec_get(&currTime, TIME_UTC);
+    uint64_t nowMs = (uint64_t)currTime.tv_sec * 1000 + currTime.tv_nsec / 1000000;
+    uint64_t expireMs = terms->expireMs;
+    int isValid = (quantity > 0 && price > 0 && (expireMs == 0 || expireMs > nowMs));
+
+    // A buy whose cost does not fit in funds_t could never be held, and is refused
+    uint64_t notional = (uint64_t)quantity * price;
+    if(isBuyer && notional > UINT32_MAX) isValid = 0;
+
+    // Check if the trader's balance (buy) or inventory (sell) is enough, and hold it if so
+    if(isValid && ((isBuyer && account_hold_balance(currAccount, notional) == EXIT_SUCCESS) ||
+                   (!isBuyer && account_hold_inventory(currAccount, quantity) == EXIT_SUCCESS))) {
+        // Increase the numExchgs count and trader count
         xchg->numExchgs = xchg->numExchgs + 1;
-        trader_ref(trader, "Placing Order");
-        if(price > xchg->highest_bid) xchg->highest_bid = price;
+        trader_ref(trader, isBuyer ? "Placing Order" : "Making Sale");
 
         // Create new order struct
         ORDER *newOrder = Malloc(sizeof(ORDER));
         memset(newOrder, 0, sizeof(ORDER));
-        exchange_sell_buy(xchg, trader, newOrder, quantity, price, 1);
-        exchange_post(newOrder, quantity, price, 1, 0);
+        newOrder->stopPrice = terms->stopPrice;
+        newOrder->immediate = (terms->stopPrice != 0 && terms->immediate);
+
+        // An iceberg order shows its first tip and keeps the rest in reserve, all of it held
+        quantity_t shown = quantity;
+        if(terms->displaySize > 0 && terms->displaySize < quantity) {
+            newOrder->displaySize = terms->displaySize;
+            newOrder->hidden = quantity - terms->displaySize;
+            shown = terms->displaySize;
+        }
+        exchange_sell_buy(xchg, trader, newOrder, shown, price, isBuyer);
+        exchange_refresh_quotes(xchg);
+
+        // A good-till-time order gets a deadline on the expiry wheel, in its clock
+        if(expireMs != 0) {
+            newOrder->expireTime = timer_now(&xchg->expiry) + (expireMs - nowMs);
+            timer_init(&newOrder->expiry, &xchg->expiry, exchange_order_expired, newOrder);
+            timer_add_at(&newOrder->expiry, newOrder->expireTime);
+            xchg->numTimed = xchg->numTimed + 1;
+        }
 
-        // Post semaphore, unlock mutex and return
-        V(&xchg->madeXchg);
+        // A stop order is only posted once it is activated, which the matchmaker checks for
+        if(terms->stopPrice == 0) exchange_post(newOrder, shown, price, isBuyer, 0);
+
+        // Have the order matched, unlock mutex and return, the order may be filled and freed by then
+        orderid_t orderid = newOrder->orderid;
+        posted(xchg);
         pthread_mutex_unlock(&xchg->mLock);
-        return newOrder->orderid;
+        return orderid;
     }
 
-    // Send nack packet, then unlock the mutex for trader
+    // Send nack packet, post semaphore, then unlock the mutex for trader
     trader_send_nack(trader);
     V(&xchg->waitForChange);
     pthread_mutex_unlock(&xchg->mLock);
     return EXIT_SUCCESS;
 }
 
-orderid_t exchange_post_sell(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price) {
-    // Lock the mutex for trader, then retrieve account
-    pthread_mutex_lock(&xchg->mLock);
-    ACCOUNT *currAccount = trader_get_account(trader);
-
-    // Check if trader's inventory contains enough for the quantity
-    if(account_decrease_inventory(currAccount, quantity) == EXIT_SUCCESS) {
-        // Increase the numExchgs count and trader count, change highest ask if price is greater
-        xchg->numExchgs = xchg->numExchgs + 1;
-        trader_ref(trader, "Making Sale");
-        if(price > xchg->highest_ask) xchg->highest_ask = price;
-
-        // Create new order struct
-        ORDER *newOrder = Malloc(sizeof(ORDER));
-        memset(newOrder, 0, sizeof(ORDER));
-        exchange_sell_buy(xchg, trader, newOrder, quantity, price, 0);
-        exchange_post(newOrder, quantity, price, 0, 0);
+orderid_t exchange_post_order(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price,
+                              int isBuyer, uint64_t expireMs) {
+    ORDER_TERMS terms;
+    memset(&terms, 0, sizeof(terms));
+    terms.expireMs = expireMs;
+    return exchange_post_terms(xchg, trader, quantity, price, isBuyer, &terms);
+}
 
-        // Post semaphore, unlock mutex and return
-        V(&xchg->madeXchg);
-        pthread_mutex_unlock(&xchg->mLock);
-        return newOrder->orderid;
-    }
+orderid_t exchange_post_buy(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price) {
+    return exchange_post_order(xchg, trader, quantity, price, 1, 0);
+}
 
-    // Send nack packet, post semaphore, then unlock the mutex for trader
-    trader_send_nack(trader);
-    V(&xchg->waitForChange);
-    pthread_mutex_unlock(&xchg->mLock);
-    return EXIT_SUCCESS;
+orderid_t exchange_post_sell(EXCHANGE *xchg, TRADER *trader, quantity_t quantity, funds_t price) {
+    return exchange_post_order(xchg, trader, quantity, price, 0, 0);
 }
 
 int exchange_cancel(EXCHANGE *xchg, TRADER *trader, orderid_t order, quantity_t *quantity) {
     // Lock the mutex for trader, then retrieve account
     pthread_mutex_lock(&xchg->mLock);
     ACCOUNT *currAccount = trader_get_account(trader);
-    ORDER *currOrder = xchg->currOrder;
-    ORDER *prevOrder = currOrder;
+    ORDER *currOrder = trader->orders;
 
-    // Search through all of the orders until the same orderid is found
+    // Search through the trader's own orders until the same orderid is found
     while(currOrder != NULL) {
         // Find what order matches orderid
         if(currOrder->orderid == order) {
-            // Change the linked list so 
-            if(currOrder == prevOrder) xchg->currOrder = NULL;
-            else if(currOrder->nextOrder == NULL) prevOrder->nextOrder = NULL;
-            else prevOrder->nextOrder = currOrder->nextOrder;
+            // Remove the order from the exchange and trader lists
+            exchange_remove_order(xchg, currOrder);
 
-            // Set quantity pointer argument
-            *quantity = currOrder->quantity;
+            // Set quantity pointer argument, counting the reserve of an iceberg order
+            *quantity = currOrder->quantity + currOrder->hidden;
 
             // Check if bid > 0 (the trader is a buyer), otherwise check if ask > 0 (the trader is a seller)
             if(currOrder->bid > 0) {
-                // Increase account's balance
-                account_increase_balance(currAccount, (currOrder->bid * currOrder->quantity));
+                // Release the held funds
+                account_release(currAccount, (currOrder->bid * *quantity), 0);
 
                 // Find the next highest bid
-                ORDER *tempOrder = xchg->currOrder;
-                xchg->highest_bid = 0;
-                while(tempOrder != NULL) {
-                    if(tempOrder->bid > xchg->highest_bid) xchg->highest_bid = tempOrder->bid;
-                    tempOrder = tempOrder->nextOrder;
-                }
+                exchange_refresh_quotes(xchg);
 
                 // Send broadcast packet
-                exchange_post(currOrder, currOrder->quantity, currOrder->bid, 1, 1);
+                exchange_post(currOrder, *quantity, currOrder->bid, 1, 1);
             } else if(currOrder->ask > 0) {
-                // Increase account's inventory
-                account_increase_inventory(currAccount, *quantity);
+                // Release the held inventory
+                account_release(currAccount, 0, *quantity);
 
-                // Find the next highest ask
-                ORDER *tempOrder = xchg->currOrder;
-                xchg->highest_ask = 0;
-                while(tempOrder != NULL) {
-                    if(tempOrder->ask > xchg->highest_ask) xchg->highest_ask = tempOrder->ask;
-                    tempOrder = tempOrder->nextOrder;
-                }
+                // Find the next lowest ask
+                exchange_refresh_quotes(xchg);
 
                 // Send broadcast packet
                 exchange_post(currOrder, *quantity, currOrder->bid, 0, 1);
@@ -236,8 +398,7 @@ int exchange_cancel(EXCHANGE *xchg, TRADER *trader, orderid_t order, quantity_t
             pthread_mutex_unlock(&xchg->mLock);
             return EXIT_SUCCESS;
         }
-        prevOrder = currOrder;
-        currOrder = currOrder->nextOrder;
+        currOrder = currOrder->traderNext;
     }
 
     // Send nack packet, then unlock the mutex for trader
@@ -246,3 +407,192 @@ int exchange_cancel(EXCHANGE *xchg, TRADER *trader, orderid_t order, quantity_t
     return EXIT_FAILURE;
 }
 
+int exchange_cancel_all(EXCHANGE *xchg, TRADER *trader, quantity_t *quantity) {
+    // Lock the mutex for the exchange, then retrieve account
+    pthread_mutex_lock(&xchg->mLock);
+    ACCOUNT *currAccount = trader_get_account(trader);
+    int numOrders = trader->numOrders;
+    *quantity = 0;
+
+    // Nothing to cancel
+    if(numOrders == 0) {
+        pthread_mutex_unlock(&xchg->mLock);
+        return 0;
+    }
+
+    // One notify entry per canceled order, broadcast together at the end
+    BRS_NOTIFY_INFO *notifyBuf = Malloc(numOrders * sizeof(BRS_NOTIFY_INFO));
+    memset(notifyBuf, 0, numOrders * sizeof(BRS_NOTIFY_INFO));
+    funds_t refundFunds = 0;
+    quantity_t refundInventory = 0;
+    int count = 0;
+
+    // Walk only the trader's own orders, removing each one from the exchange
+    ORDER *currOrder = trader->orders;
+    while(currOrder != NULL) {
+        ORDER *nextOrder = currOrder->traderNext;
+        exchange_remove_order(xchg, currOrder);
+
+        // Add up the escrow to hand back and record the notification
+        quantity_t orderQuantity = currOrder->quantity + currOrder->hidden;
+        if(currOrder->bid > 0) {
+            refundFunds = refundFunds + currOrder->bid * orderQuantity;
+            notifyBuf[count].buyer = htonl(currOrder->orderid);
+            notifyBuf[count].price = htonl(currOrder->bid);
+        } else {
+            refundInventory = refundInventory + orderQuantity;
+            notifyBuf[count].seller = htonl(currOrder->orderid);
+            notifyBuf[count].price = htonl(currOrder->ask);
+        }
+        notifyBuf[count].quantity = htonl(orderQuantity);
+        *quantity = *quantity + orderQuantity;
+        count++;
+
+        Free(currOrder);
+        currOrder = nextOrder;
+    }
+    xchg->numExchgs = xchg->numExchgs - count;
+
+    // Release all held funds and inventory at once and drop the order references
+    account_release(currAccount, refundFunds, refundInventory);
+    for(int i = 0; i < count; i++) trader_unref(trader, "Canceled Order");
+    exchange_refresh_quotes(xchg);
+
+    // Broadcast the canceled orders in as few packets as the payload size allows
+    BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+    for(int i = 0; i < count; i = i + BRS_MAX_BATCH_NOTIFY) {
+        int batch = (count - i < BRS_MAX_BATCH_NOTIFY) ? count - i : BRS_MAX_BATCH_NOTIFY;
+        memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+        newPkt->type = BRS_MASS_CANCELED_PKT;
+        newPkt->size = htons(batch * sizeof(BRS_NOTIFY_INFO));
+        market_broadcast(xchg->market, newPkt, &notifyBuf[i]);
+    }
+    Free(newPkt);
+    Free(notifyBuf);
+
+    pthread_mutex_unlock(&xchg->mLock);
+    return count;
+}
+
+int exchange_quote(EXCHANGE *xchg, TRADER *trader, QUOTE_LEVEL *levels, int numBids, int numAsks,
+                   orderid_t *firstId) {
+    // Lock the mutex for the exchange, then retrieve account
+    pthread_mutex_lock(&xchg->mLock);
+    ACCOUNT *currAccount = trader_get_account(trader);
+    int numLevels = numBids + numAsks;
+
+    // Add up what the trader's current quotes hold, which the new ones replace
+    uint64_t releaseFunds = 0;
+    uint64_t releaseInventory = 0;
+    int numOld = 0;
+    for(ORDER *currOrder = trader->orders; currOrder != NULL; currOrder = currOrder->traderNext) {
+        if(!currOrder->isQuote) continue;
+        if(currOrder->bid > 0) releaseFunds = releaseFunds + (uint64_t)currOrder->bid * currOrder->quantity;
+        else releaseInventory = releaseInventory + currOrder->quantity;
+        numOld++;
+    }
+
+    // Add up what the new quotes hold in 64 bits, refusing them all if any level is empty,
+    // or if a level or the total does not fit in 32 bits (and so could never be held)
+    uint64_t holdFunds = 0;
+    uint64_t holdInventory = 0;
+    int isValid = 1;
+    for(int i = 0; i < numLevels; i++) {
+        uint64_t notional = (uint64_t)levels[i].quantity * levels[i].price;
+        if(levels[i].quantity == 0 || levels[i].price == 0) isValid = 0;
+        if(i < numBids && notional > UINT32_MAX) isValid = 0;
+        if(i < numBids) holdFunds = holdFunds + notional;
+        else holdInventory = holdInventory + levels[i].quantity;
+    }
+    if(holdFunds > UINT32_MAX || holdInventory > UINT32_MAX) isValid = 0;
+
+    // Swap the old holds for the new ones in one step, or leave everything as it was
+    if(!isValid || account_rehold(currAccount, releaseFunds, holdFunds, releaseInventory, holdInventory) != EXIT_SUCCESS) {
+        pthread_mutex_unlock(&xchg->mLock);
+        return EXIT_FAILURE;
+    }
+
+    // One notify entry per canceled quote, then one per posted quote, broadcast together at the end
+    size_t size = sizeof(BRS_QUOTED_INFO) + (numOld + numLevels) * sizeof(BRS_NOTIFY_INFO);
+    BRS_QUOTED_INFO *quoted = Malloc(size);
+    memset(quoted, 0, size);
+    quoted->num_canceled = htonl(numOld);
+    quoted->num_posted = htonl(numLevels);
+    int count = 0;
+
+    // Take the old quotes off the book, their holds were already released
+    ORDER *currOrder = trader->orders;
+    while(currOrder != NULL) {
+        ORDER *nextOrder = currOrder->traderNext;
+        if(currOrder->isQuote) {
+            exchange_remove_order(xchg, currOrder);
+            if(currOrder->bid > 0) {
+                quoted->orders[count].buyer = htonl(currOrder->orderid);
+                quoted->orders[count].price = htonl(currOrder->bid);
+            } else {
+                quoted->orders[count].seller = htonl(currOrder->orderid);
+                quoted->orders[count].price = htonl(currOrder->ask);
+            }
+            quoted->orders[count].quantity = htonl(currOrder->quantity);
+            count++;
+
+            xchg->numExchgs = xchg->numExchgs - 1;
+            trader_unref(trader, "Replaced Quote");
+            Free(currOrder);
+        }
+        currOrder = nextOrder;
+    }
+
+    // Put the new quotes on the book under consecutive order ids
+    *firstId = xchg->lastId + 1;
+    for(int i = 0; i < numLevels; i++) {
+        int isBuyer = (i < numBids);
+        xchg->numExchgs = xchg->numExchgs + 1;
+        trader_ref(trader, "Posting Quote");
+
+        ORDER *newOrder = Malloc(sizeof(ORDER));
+        memset(newOrder, 0, sizeof(ORDER));
+        newOrder->isQuote = 1;
+        exchange_sell_buy(xchg, trader, newOrder, levels[i].quantity, levels[i].price, isBuyer);
+        if(isBuyer) quoted->orders[count].buyer = htonl(newOrder->orderid);
+        else quoted->orders[count].seller = htonl(newOrder->orderid);
+        quoted->orders[count].quantity = htonl(levels[i].quantity);
+        quoted->orders[count].price = htonl(levels[i].price);
+        count++;
+    }
+    exchange_refresh_quotes(xchg);
+
+    // Broadcast the whole replacement as one book update
+    BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+    memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+    newPkt->type = BRS_QUOTED_PKT;
+    newPkt->size = htons(size);
+    market_broadcast(xchg->market, newPkt, quoted);
+    Free(newPkt);
+    Free(quoted);
+
+    // Have the new quotes matched, then unlock the mutex
+    posted(xchg);
+    pthread_mutex_unlock(&xchg->mLock);
+    return EXIT_SUCCESS;
+}
+
+int exchange_depth(EXCHANGE *xchg, TRADER *trader, int maxLevels, int subscribe) {
+    if(maxLevels < 1 || maxLevels > BRS_MAX_DEPTH_LEVELS) return EXIT_FAILURE;
+    size_t size = sizeof(BRS_DEPTH_INFO) + 2 * maxLevels * sizeof(BRS_LEVEL_INFO);
+    BRS_DEPTH_INFO *info = Malloc(size);
+    BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+    memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+
+    // The snapshot is sent before the lock is released, so no update it does not include can overtake it
+    pthread_mutex_lock(&xchg->mLock);
+    newPkt->type = BRS_ACK_PKT;
+    newPkt->size = htons(depth_snapshot(&xchg->depth, maxLevels, info));
+    trader_set_feeds(trader, BRS_FEED_DEPTH, subscribe ? BRS_FEED_DEPTH : 0);
+    trader_send_packet(trader, newPkt, info);
+    pthread_mutex_unlock(&xchg->mLock);
+
+    Free(newPkt);
+    Free(info);
+    return EXIT_SUCCESS;
+}
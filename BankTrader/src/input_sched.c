@@ -0,0 +1,231 @@
+#include <string.h>
+
+#include "input_sched.h"
+#include "protocol_ext.h"
+#include "structs.h"
+#include "csapp.h"
+#include "debug.h"
+
+// A queued request
+typedef struct input_req {
+    BRS_PACKET_HEADER hdr;      // Request header
+    void *payload;              // Request payload, or NULL
+    TRADER *trader;             // Trader that sent the request
+    struct input_req *next;     // Next request in the same queue
+} INPUT_REQ;
+
+static int schedActive = 0;
+static pthread_mutex_t schedLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;     // Signaled when a request is queued
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;     // Broadcast when a request is done
+static INPUT_REQ *cancelHead = NULL;    // Priority lane of cancels, oldest first
+static INPUT_REQ *cancelTail = NULL;
+static TRADER *active = NULL;           // Trader whose turn it is, NULL when no queue has requests
+static int onTurn = 0;                  // Whether active has been given its credit for this turn
+static TRADER *running = NULL;          // Trader whose request is being carried out
+
+static int is_cancel(INPUT_REQ *req) {
+    return req->hdr.type == BRS_CANCEL_PKT || req->hdr.type == BRS_MASS_CANCEL_PKT;
+}
+
+// Add a trader at the end of the ring, the last to get a turn
+static void ring_insert(TRADER *trader) {
+    if(active == NULL) {
+        trader->activeNext = trader;
+        trader->activePrev = trader;
+        active = trader;
+        onTurn = 0;
+        return;
+    }
+    trader->activeNext = active;
+    trader->activePrev = active->activePrev;
+    active->activePrev->activeNext = trader;
+    active->activePrev = trader;
+}
+
+static void ring_remove(TRADER *trader) {
+    if(trader->activeNext == trader) active = NULL;
+    else {
+        trader->activePrev->activeNext = trader->activeNext;
+        trader->activeNext->activePrev = trader->activePrev;
+        if(active == trader) {
+            active = trader->activeNext;
+            onTurn = 0;
+        }
+    }
+    trader->activeNext = NULL;
+    trader->activePrev = NULL;
+    trader->deficit = 0;
+}
+
+// Take the next request to carry out, the lock must be held
+static INPUT_REQ *next_request(void) {
+    // Cancels first
+    if(cancelHead != NULL) {
+        INPUT_REQ *req = cancelHead;
+        cancelHead = req->next;
+        if(cancelHead == NULL) cancelTail = NULL;
+        return req;
+    }
+
+    // Then deficit round robin over the traders' queues
+    while(active != NULL) {
+        TRADER *trader = active;
+        if(!onTurn) {
+            trader->deficit = trader->deficit + INPUT_QUANTUM;
+            onTurn = 1;
+        }
+
+        INPUT_REQ *req = trader->inputHead;
+        if(trader->deficit > 0) {
+            trader->inputHead = req->next;
+            if(trader->inputHead == NULL) trader->inputTail = NULL;
+            trader->deficit = trader->deficit - 1;
+
+            // A trader whose queue is empty leaves the ring and loses its credit
+            if(trader->inputHead == NULL) ring_remove(trader);
+            return req;
+        }
+
+        // Credit used up, it is the next trader's turn
+        active = trader->activeNext;
+        onTurn = 0;
+    }
+    return NULL;
+}
+
+static void *sequencer(void *arg) {
+    Pthread_detach(pthread_self());
+
+    pthread_mutex_lock(&schedLock);
+    while(1) {
+        INPUT_REQ *req = next_request();
+        if(req == NULL) {
+            pthread_cond_wait(&workCond, &schedLock);
+            continue;
+        }
+        TRADER *trader = req->trader;
+        trader->numInput = trader->numInput - 1;
+        running = trader;
+        pthread_mutex_unlock(&schedLock);
+
+        // Carry out the request without holding the lock, so sessions can keep queueing
+        brs_trader_request(trader, trader->currAccount, &req->hdr, req->payload);
+        Free(req);
+
+        pthread_mutex_lock(&schedLock);
+        running = NULL;
+        pthread_cond_broadcast(&doneCond);
+    }
+
+    return NULL;
+}
+
+void input_sched_start(void) {
+    schedActive = 1;
+    pthread_t tid;
+    Pthread_create(&tid, NULL, sequencer, NULL);
+}
+
+int input_sched_active(void) {
+    return schedActive;
+}
+
+int input_submit(TRADER *trader, BRS_PACKET_HEADER *hdr, void *payload) {
+    INPUT_REQ *req = Malloc(sizeof(INPUT_REQ));
+    memcpy(&req->hdr, hdr, sizeof(BRS_PACKET_HEADER));
+    req->payload = payload;
+    req->trader = trader;
+    req->next = NULL;
+
+    pthread_mutex_lock(&schedLock);
+    if(trader->numInput >= INPUT_MAX_QUEUED) {
+        pthread_mutex_unlock(&schedLock);
+        Free(req);
+        return EXIT_FAILURE;
+    }
+    trader->numInput = trader->numInput + 1;
+
+    INPUT_REQ *dropped = NULL;
+    if(is_cancel(req)) {
+        // Into the priority lane
+        if(cancelTail != NULL) cancelTail->next = req;
+        else cancelHead = req;
+        cancelTail = req;
+
+        // A mass cancel also takes back the orders and quotes of the trader still in its queue
+        if(req->hdr.type == BRS_MASS_CANCEL_PKT && trader->inputHead != NULL) {
+            INPUT_REQ **link = &trader->inputHead;
+            trader->inputTail = NULL;
+            while(*link != NULL) {
+                INPUT_REQ *queued = *link;
+                if(queued->hdr.type == BRS_BUY_PKT || queued->hdr.type == BRS_SELL_PKT ||
+                   queued->hdr.type == BRS_QUOTE_PKT) {
+                    *link = queued->next;
+                    queued->next = dropped;
+                    dropped = queued;
+                    trader->numInput = trader->numInput - 1;
+                } else {
+                    trader->inputTail = queued;
+                    link = &queued->next;
+                }
+            }
+            if(trader->inputHead == NULL) ring_remove(trader);
+        }
+    } else {
+        // Into the trader's queue, which joins the ring if it was empty
+        if(trader->inputTail != NULL) trader->inputTail->next = req;
+        else {
+            trader->inputHead = req;
+            ring_insert(trader);
+        }
+        trader->inputTail = req;
+    }
+    pthread_cond_signal(&workCond);
+    pthread_mutex_unlock(&schedLock);
+
+    // Refuse the orders and quotes taken back by a mass cancel
+    while(dropped != NULL) {
+        INPUT_REQ *next = dropped->next;
+        trader_send_nack(trader);
+        if(dropped->payload != NULL) Free(dropped->payload);
+        Free(dropped);
+        dropped = next;
+    }
+    return EXIT_SUCCESS;
+}
+
+void input_drop(TRADER *trader) {
+    pthread_mutex_lock(&schedLock);
+
+    // Take the trader's queue, and its cancels out of the priority lane
+    INPUT_REQ *dropped = trader->inputHead;
+    if(dropped != NULL) ring_remove(trader);
+    trader->inputHead = NULL;
+    trader->inputTail = NULL;
+    INPUT_REQ **link = &cancelHead;
+    cancelTail = NULL;
+    while(*link != NULL) {
+        INPUT_REQ *queued = *link;
+        if(queued->trader == trader) {
+            *link = queued->next;
+            queued->next = dropped;
+            dropped = queued;
+        } else {
+            cancelTail = queued;
+            link = &queued->next;
+        }
+    }
+    trader->numInput = 0;
+
+    // Let a request of the trader that is being carried out finish
+    while(running == trader) pthread_cond_wait(&doneCond, &schedLock);
+    pthread_mutex_unlock(&schedLock);
+
+    while(dropped != NULL) {
+        INPUT_REQ *next = dropped->next;
+        if(dropped->payload != NULL) Free(dropped->payload);
+        Free(dropped);
+        dropped = next;
+    }
+}
@@ -0,0 +1,251 @@
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+
+#include "listener.h"
+#include "event_loop.h"
+#include "server.h"
+#include "structs.h"
+#include "csapp.h"
+#include "debug.h"
+
+// Acceptor thread arguments
+typedef struct acceptor {
+    int listenfd;               // Listening file descriptor
+    int cpu;                    // CPU to pin to, -1 for none
+} ACCEPTOR;
+
+// Connections waiting for a session worker, and the idle workers.  A
+// counting semaphore hands out the pending connections, one post per
+// connection, so that no wakeup can be lost between acceptors and workers.
+static int *pendingFds = NULL;      // Circular buffer of accepted descriptors
+static int pendingHead = 0;         // Index of the oldest pending descriptor
+static int numPending = 0;          // Number of pending descriptors
+static int maxPending = 0;          // Capacity of pendingFds
+static int numIdle = 0;             // Workers waiting for a connection
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t pendingSem;            // Counts pending descriptors
+static pthread_attr_t workerAttr;   // Attributes of session workers
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+
+// A descriptor held in reserve, given up to turn away a connection when there are none left
+static int spareFd = -1;
+static pthread_mutex_t spareLock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ACCEPT_BACKOFF_US 10000     // Pause of an acceptor that cannot accept for lack of resources
+
+#define WORKER_STACK_SIZE (256 * 1024)  // Sessions only need room for a 64 KiB username
+
+static void pool_init(void) {
+    Sem_init(&pendingSem, 0, 0);
+    spareFd = open("/dev/null", O_RDONLY);
+
+    // Smaller stacks than the default, so tens of thousands of sessions fit
+    pthread_attr_init(&workerAttr);
+    pthread_attr_setstacksize(&workerAttr, WORKER_STACK_SIZE);
+}
+
+// Out of descriptors, the connection at the head of the backlog would stay there and have accept fail
+// at once, again and again: use the spare descriptor to accept it and close it, then pause, so the
+// acceptor does not spin while the server is overloaded
+static void shed_connection(int listenfd, int err) {
+    pthread_mutex_lock(&spareLock);
+    if(spareFd >= 0 && (err == EMFILE || err == ENFILE)) {
+        close(spareFd);
+        int connfd = accept(listenfd, NULL, NULL);
+        if(connfd >= 0) close(connfd);
+        spareFd = open("/dev/null", O_RDONLY);
+    }
+    pthread_mutex_unlock(&spareLock);
+    usleep(ACCEPT_BACKOFF_US);
+}
+
+static void *session_worker(void *arg) {
+    Pthread_detach(pthread_self());
+
+    while(1) {
+        // Wait for a connection to serve
+        pthread_mutex_lock(&poolLock);
+        numIdle = numIdle + 1;
+        pthread_mutex_unlock(&poolLock);
+        P(&pendingSem);
+        pthread_mutex_lock(&poolLock);
+        numIdle = numIdle - 1;
+        int fileDesc = pendingFds[pendingHead];
+        pendingHead = (pendingHead + 1) % maxPending;
+        numPending = numPending - 1;
+        pthread_mutex_unlock(&poolLock);
+
+        // Serve the client until it disconnects, then go back to waiting
+        brs_client_session(fileDesc);
+    }
+
+    return NULL;
+}
+
+static void hand_off(int fileDesc) {
+    pthread_mutex_lock(&poolLock);
+
+    // Grow the circular buffer when it is full, unwrapping it as it is copied
+    if(numPending == maxPending) {
+        int newMax = (maxPending == 0) ? 64 : maxPending * 2;
+        int *newFds = Malloc(newMax * sizeof(int));
+        for(int i = 0; i < numPending; i++) newFds[i] = pendingFds[(pendingHead + i) % maxPending];
+        if(pendingFds != NULL) Free(pendingFds);
+        pendingFds = newFds;
+        pendingHead = 0;
+        maxPending = newMax;
+    }
+    pendingFds[(pendingHead + numPending) % maxPending] = fileDesc;
+    numPending = numPending + 1;
+
+    // Start a new worker if the idle ones cannot take every pending connection
+    pthread_t tid;
+    if(numIdle < numPending) Pthread_create(&tid, &workerAttr, session_worker, NULL);
+
+    pthread_mutex_unlock(&poolLock);
+    V(&pendingSem);
+}
+
+int listener_open_tcp(char *port, int reusePort) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    // Get a list of potential server addresses, as open_listenfd does
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if(getaddrinfo(NULL, port, &hints, &listp) != 0) return -1;
+
+    // Walk the list for one that we can bind to
+    for(p = listp; p; p = p->ai_next) {
+        if((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        if(reusePort) setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+        if(bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if(!p) return -1;
+
+    // Make it a listening socket ready to accept connection requests
+    if(listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+int listener_open_unix(char *path) {
+    struct sockaddr_un addr;
+
+    // The path has to fit in the socket address
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Only a stale socket file may be removed, never a file of another kind
+    struct stat pathStat;
+    if(lstat(path, &pathStat) == 0) {
+        if(!S_ISSOCK(pathStat.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+
+        // The socket is stale only if nobody answers on it: a server that
+        // accepts, or has a full backlog, is still there
+        int probefd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(probefd < 0) return -1;
+        int probe = connect(probefd, (SA *)&addr, sizeof(addr));
+        int probeErrno = errno;
+        close(probefd);
+        if(probe == 0 || probeErrno == EAGAIN) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+        if(probeErrno != ECONNREFUSED) {
+            errno = probeErrno;
+            return -1;
+        }
+        unlink(path);
+    }
+
+    // Create the socket, bind and listen
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenfd < 0) return -1;
+    if(bind(listenfd, (SA *)&addr, sizeof(addr)) < 0 || listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+
+    debug("Listening on Unix socket %s", path);
+    return listenfd;
+}
+
+void listener_close_unix(int listenfd, char *path) {
+    close(listenfd);
+    unlink(path);
+}
+
+void listener_run(int listenfd, int cpu) {
+    pthread_once(&poolOnce, pool_init);
+
+    // Pin the acceptor if asked to (the raw system call, since the CPU set
+    // macros need _GNU_SOURCE, which clashes with csapp.h)
+    if(cpu >= 0 && cpu < 1024) {
+        unsigned long cpus[1024 / (8 * sizeof(unsigned long))];
+        memset(cpus, 0, sizeof(cpus));
+        cpus[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+        if(syscall(SYS_sched_setaffinity, 0, sizeof(cpus), cpus) < 0) {
+            debug("Unable to pin acceptor to CPU %d", cpu);
+        }
+    }
+
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    int optval = 1;
+    while(1) {
+        clientlen = sizeof(struct sockaddr_storage);
+        int connfd = accept(listenfd, (SA *) &clientaddr, &clientlen);
+        if(connfd < 0) {
+            // Running out of descriptors or memory must not take the server down, nor keep it busy
+            int err = errno;
+            if(err != EINTR && err != ECONNABORTED) debug("accept: %s", strerror(err));
+            if(err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) shed_connection(listenfd, err);
+            continue;
+        }
+
+        // Send small packets right away on TCP connections
+        if(clientaddr.ss_family == AF_INET || clientaddr.ss_family == AF_INET6) {
+            setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        }
+        if(evloop_active()) evloop_add(connfd);
+        else hand_off(connfd);
+    }
+}
+
+static void *acceptor_thread(void *arg) {
+    // Retrieve the acceptor arguments, then free their storage
+    ACCEPTOR acceptor = *((ACCEPTOR *)arg);
+    Free(arg);
+    Pthread_detach(pthread_self());
+
+    listener_run(acceptor.listenfd, acceptor.cpu);
+    return NULL;
+}
+
+void listener_start(int listenfd, int cpu) {
+    pthread_once(&poolOnce, pool_init);
+    ACCEPTOR *acceptor = Malloc(sizeof(ACCEPTOR));
+    acceptor->listenfd = listenfd;
+    acceptor->cpu = cpu;
+
+    pthread_t tid;
+    Pthread_create(&tid, NULL, acceptor_thread, acceptor);
+}
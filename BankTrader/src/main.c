@@ -2,6 +2,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/signal.h>
+#include <sys/resource.h>
 
 #include "client_registry.h"
 #include "exchange.h"
@@ -10,10 +11,20 @@
 #include "debug.h"
 #include "server.h"
 #include "csapp.h"
+#include "shm_feed.h"
+#include "trade_tape.h"
+#include "listener.h"
+#include "event_loop.h"
+#include "rate_limit.h"
+#include "input_sched.h"
+#include "structs.h"
 
 extern EXCHANGE *exchange;
 extern CLIENT_REGISTRY *client_registry;
 
+static char *unixPath = NULL;   // Path of the Unix-domain listener, if any
+static int unixfd = -1;         // Unix-domain listening socket, if any
+
 /*
  * Function called to cleanly shut down the server.
  */
@@ -31,6 +42,9 @@ static void terminate(int status) {
     exchange_fini(exchange);
     traders_fini();
     accounts_fini();
+    shm_feed_fini();
+    tape_fini();
+    if(unixfd >= 0) listener_close_unix(unixfd, unixPath);
 
     debug("Bourse server terminating");
     exit(status);
@@ -43,21 +57,101 @@ void sighup_handler(int sig) {
 /*
  * "Bourse" exchange server.
  *
- * Usage: bourse <port>
+ * Usage: bourse [-p <port>] [-a <acceptors>] [-c <first cpu>] [-e <backend>] [-u <socket path>] [-s <shm name>]
+ *               [-r <rate>[:<burst>]] [-g <rate>[:<burst>]] [-q] [-i <seconds>] [-b <seconds>]
+ *               [-m <seconds>] [-t <mode>] [-f <tape file>]
  */
 int main(int argc, char* argv[]){
     // Make sure argc > 1
     if(argc <= 1) exit(EXIT_SUCCESS);
 
     /* Option processing should be performed here. Option '-p <port>' is required 
-    in order to specify the port number on which the server should listen. */
+    in order to specify the port number on which the server should listen.
+    Option '-u <path>' also listens on a Unix-domain socket at <path>, and may
+    be used without '-p' when only local clients connect.
+    Option '-a <count>' accepts TCP connections on <count> threads, each with its
+    own SO_REUSEPORT socket, and option '-c <cpu>' pins them to consecutive CPUs
+    starting at <cpu>.
+    Option '-e <backend>' serves the sessions with an event loop instead of a thread
+    each, where <backend> is "epoll" or "io_uring" (see event_loop.h).
+    Option '-s <name>' publishes market data to the shared-memory segment <name>,
+    which must not exist yet (see shm_feed.h).
+    Option '-f <file>' records every trade in the tape <file>, appending to it if
+    it exists (see trade_tape.h).
+    Options '-r' and '-g' limit the order requests (BUY, SELL, QUOTE) of each trader
+    and of all traders together to <rate> per second, with bursts of up to <burst>;
+    CANCEL and MASS_CANCEL are never limited (see rate_limit.h).  SIGUSR1 prints the throttling counters.
+    Option '-q' queues the order requests of the sessions for the fair input stage
+    (see input_sched.h), instead of each session carrying them out directly.
+    Option '-i <seconds>' shuts down sessions whose client has sent nothing for
+    <seconds>, and option '-b <seconds>' sends a HEARTBEAT to clients that have
+    sent nothing for <seconds>, so live clients can answer before they time out.
+    Option '-m <seconds>' starts the exchange in call-auction mode, where orders
+    accumulate and the book is uncrossed once every <seconds> instead of on each
+    order.  SIGUSR2 switches between continuous matching and call-auction mode
+    (with the '-m' interval, or one second) while the server runs.
+    Option '-t <mode>' sets what happens when a trader's own bid and ask cross:
+    "resting" (the default) cancels the order that was on the book first,
+    "incoming" the one that arrived later, "both" cancels both, and "decrement"
+    takes the smaller quantity off both orders. */
     int option;
-    char *port;
-    while((option = getopt(argc, argv, "p:")) != EOF) {
+    char *port = NULL;
+    char *shmName = NULL;
+    char *tapePath = NULL;
+    int numAcceptors = 1;
+    int firstCpu = -1;
+    int backend = EVLOOP_THREADS;
+    double traderRate = 0, globalRate = 0;
+    unsigned int traderBurst = 0, globalBurst = 0;
+    int fairInput = 0;
+    double idleSecs = 0, heartbeatSecs = 0;
+    double auctionSecs = 0;
+    int stpMode = STP_CANCEL_RESTING;
+    while((option = getopt(argc, argv, "p:u:s:f:a:c:e:r:g:qi:b:m:t:")) != EOF) {
         switch(option) {
             case 'p':
                 port = optarg++;
                 break;
+            case 'u':
+                unixPath = optarg;
+                break;
+            case 'a':
+                numAcceptors = atoi(optarg);
+                if(numAcceptors < 1) exit(EXIT_FAILURE);
+                break;
+            case 'c':
+                firstCpu = atoi(optarg);
+                break;
+            case 'e':
+                if((backend = evloop_backend(optarg)) < 0) exit(EXIT_FAILURE);
+                break;
+            case 's':
+                shmName = optarg;
+                break;
+            case 'f':
+                tapePath = optarg;
+                break;
+            case 'q':
+                fairInput = 1;
+                break;
+            case 'r':
+                if(rate_limit_parse(optarg, &traderRate, &traderBurst) < 0) exit(EXIT_FAILURE);
+                break;
+            case 'g':
+                if(rate_limit_parse(optarg, &globalRate, &globalBurst) < 0) exit(EXIT_FAILURE);
+                break;
+            case 'i':
+                if((idleSecs = atof(optarg)) <= 0) exit(EXIT_FAILURE);
+                break;
+            case 'b':
+                if((heartbeatSecs = atof(optarg)) <= 0) exit(EXIT_FAILURE);
+                break;
+            case 'm':
+                if((auctionSecs = atof(optarg)) <= 0) exit(EXIT_FAILURE);
+                break;
+            case 't':
+                if((stpMode = exchange_stp_mode(optarg)) < 0) exit(EXIT_FAILURE);
+                break;
             default:
                 exit(EXIT_FAILURE);
         }
@@ -72,24 +166,74 @@ int main(int argc, char* argv[]){
     // Set up sighup handler (Signal() function uses sigaction)
     Signal(SIGHUP, sighup_handler);
 
+    // A client that goes away fails the write to it, rather than ending the server
+    Signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 and SIGUSR2 are taken by sigwait on the main thread, so block them in every thread
+    sigset_t usrSet;
+    Sigemptyset(&usrSet);
+    Sigaddset(&usrSet, SIGUSR1);
+    Sigaddset(&usrSet, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &usrSet, NULL);
+
+    // Allow as many open connections as the hard limit does
+    struct rlimit fdLimit;
+    if(getrlimit(RLIMIT_NOFILE, &fdLimit) == 0 && fdLimit.rlim_cur < fdLimit.rlim_max) {
+        fdLimit.rlim_cur = fdLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fdLimit);
+    }
+
     // Perform required initializations of the client_registry,
     // maze, and player modules.
     client_registry = creg_init();
     accounts_init();
     traders_init();
+    rate_limit_configure(traderRate, traderBurst, globalRate, globalBurst);
+    if(shmName != NULL && shm_feed_init(shmName) == EXIT_FAILURE) {
+        fprintf(stderr, "Unable to create shared-memory feed %s (does it exist already?)\n", shmName);
+        exit(EXIT_FAILURE);
+    }
+    if(tapePath != NULL && tape_init(tapePath) == EXIT_FAILURE) {
+        fprintf(stderr, "Unable to record trades to %s\n", tapePath);
+        exit(EXIT_FAILURE);
+    }
     exchange = exchange_init();
+    if(auctionSecs > 0) exchange_set_auction(exchange, auctionSecs * 1000);
+    exchange_set_stp(exchange, stpMode);
+    if(fairInput) input_sched_start();
+    if(idleSecs > 0 || heartbeatSecs > 0) brs_session_timeouts(idleSecs * 1000, heartbeatSecs * 1000);
+    if(evloop_start(backend) == EXIT_FAILURE) {
+        fprintf(stderr, "I/O backend not available\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Open the listeners, a port, a Unix-domain socket, or both
+    if(port == NULL && unixPath == NULL) exit(EXIT_FAILURE);
+    if(unixPath != NULL) {
+        if((unixfd = listener_open_unix(unixPath)) < 0) unix_error("Open Unix listener error");
+        listener_start(unixfd, -1);
+    }
 
-    int listenfd, *connfdp;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
-    listenfd = Open_listenfd(port);
-    while (1) {
-        clientlen=sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));
-        memset(connfdp, 0, sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, brs_client_service, connfdp);
+    // One TCP listening socket per acceptor, sharing the port through SO_REUSEPORT
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for(int i = 0; port != NULL && i < numAcceptors; i++) {
+        int listenfd = listener_open_tcp(port, numAcceptors > 1);
+        if(listenfd < 0) unix_error("Open_listenfd error");
+        listener_start(listenfd, (firstCpu < 0) ? -1 : (firstCpu + i) % numCpus);
+    }
+
+    // The acceptors and session workers do the rest, wait here for SIGHUP,
+    // report the throttling counters on SIGUSR1 and switch the matching mode on SIGUSR2
+    int inAuction = (auctionSecs > 0);
+    while(1) {
+        int sig;
+        if(sigwait(&usrSet, &sig) != 0) continue;
+        if(sig == SIGUSR1) rate_limit_report(stderr);
+        else if(sig == SIGUSR2) {
+            inAuction = !inAuction;
+            exchange_set_auction(exchange, inAuction ? ((auctionSecs > 0) ? auctionSecs : 1) * 1000 : 0);
+            debug("Switched to %s matching", inAuction ? "call-auction" : "continuous");
+        }
     }
 
     terminate(EXIT_FAILURE);
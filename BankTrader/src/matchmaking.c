@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <sys/signal.h>
 #include <time.h>
+#include <stddef.h>
+#include <errno.h>
 
 #include "exchange.h"
 #include "trader.h"
@@ -11,6 +13,8 @@
 #include "account.h"
 #include "structs.h"
 #include "csapp.h"
+#include "shm_feed.h"
+#include "trade_tape.h"
 
 void createNotifyPacket(BRS_NOTIFY_INFO *notify, quantity_t q, funds_t p, orderid_t b, orderid_t s) {
     notify->quantity = htonl(q);
@@ -19,47 +23,481 @@ void createNotifyPacket(BRS_NOTIFY_INFO *notify, quantity_t q, funds_t p, orderi
     notify->seller = htonl(s);
 }
 
-void broadcastAllPackets(BRS_NOTIFY_INFO *notify, TRADER *buyer, TRADER *seller) {
+void broadcastAllPackets(BRS_NOTIFY_INFO *notify, TRADER *buyer, TRADER *seller, int broadcastTrade) {
     // Send bought packet
     BRS_PACKET_HEADER *buy = Malloc(sizeof(BRS_PACKET_HEADER));
     memset(buy, 0, sizeof(BRS_PACKET_HEADER));
     buy->type = BRS_BOUGHT_PKT;
-    buy->size = sizeof(BRS_NOTIFY_INFO);
-    trader_send_packet(buyer, buy, notify);
+    buy->size = htons(sizeof(BRS_NOTIFY_INFO));
+    trader_send_notice(buyer, buy, notify);
     Free(buy);
     
     // Send sold packet
     BRS_PACKET_HEADER *sell = Malloc(sizeof(BRS_PACKET_HEADER));
     memset(sell, 0, sizeof(BRS_PACKET_HEADER));
     sell->type = BRS_SOLD_PKT;
-    sell->size = sizeof(BRS_NOTIFY_INFO);
-    trader_send_packet(seller, sell, notify);
+    sell->size = htons(sizeof(BRS_NOTIFY_INFO));
+    trader_send_notice(seller, sell, notify);
     Free(sell);
     
-    // Broadcast traded packet
+    // Broadcast traded packet, unless the trade is announced with the rest of an uncross
+    if(!broadcastTrade) return;
     BRS_PACKET_HEADER *trade = Malloc(sizeof(BRS_PACKET_HEADER));
     memset(trade, 0, sizeof(BRS_PACKET_HEADER));
     trade->type = BRS_TRADED_PKT;
-    trade->size = sizeof(BRS_NOTIFY_INFO);
-    trader_broadcast_packet(trade, notify);
+    trade->size = htons(sizeof(BRS_NOTIFY_INFO));
+    market_broadcast(buyer->market, trade, notify);
     Free(trade);
 }
 
 void removeOrder(EXCHANGE *exchange, ORDER *order) {
-    ORDER *tempOrder = exchange->currOrder;
-    while(tempOrder != NULL) {
-        if(tempOrder == exchange->currOrder && tempOrder == order) {
-            exchange->currOrder = order->nextOrder;
+    // Unlinks from both the book and the trader's list in O(1)
+    exchange_remove_order(exchange, order);
+}
+
+LEDGER_DELTA *getDelta(SETTLEMENT *settle, ACCOUNT *account) {
+    // Remember the account the first time it changes during this pass
+    int idx = account - settle->market->accounts;
+    if(!settle->marked[idx]) {
+        settle->marked[idx] = 1;
+        settle->touched[settle->numTouched] = idx;
+        settle->numTouched = settle->numTouched + 1;
+    }
+    return &settle->delta[idx];
+}
+
+void addFill(SETTLEMENT *settle, ORDER *buyer, ORDER *seller, quantity_t quantity, funds_t price) {
+    // Grow the fill buffer when it runs out of room
+    if(settle->numFills == settle->maxFills) {
+        settle->maxFills = (settle->maxFills == 0) ? 64 : settle->maxFills * 2;
+        settle->fills = Realloc(settle->fills, settle->maxFills * sizeof(FILL));
+    }
+
+    // Record the trade so it can be notified once the accounts are settled
+    FILL *fill = &settle->fills[settle->numFills];
+    createNotifyPacket(&fill->notify, quantity, price, buyer->orderid, seller->orderid);
+    fill->buyer = buyer->trader;
+    fill->seller = seller->trader;
+    settle->numFills = settle->numFills + 1;
+}
+
+void settleAccounts(SETTLEMENT *settle, int broadcastTrades) {
+    // Apply each account's accumulated ledger changes in a single update
+    for(int i = 0; i < settle->numTouched; i++) {
+        int idx = settle->touched[i];
+        account_settle(&settle->market->accounts[idx], &settle->delta[idx]);
+        memset(&settle->delta[idx], 0, sizeof(LEDGER_DELTA));
+        settle->marked[idx] = 0;
+    }
+    settle->numTouched = 0;
+
+    // Send the notifications in the order the trades were carried out
+    for(int i = 0; i < settle->numFills; i++) {
+        FILL *fill = &settle->fills[i];
+        broadcastAllPackets(&fill->notify, fill->buyer, fill->seller, broadcastTrades);
+    }
+    settle->numFills = 0;
+
+    // Then one CANCELED per cancellation, as for a cancel by the trader, and one POSTED per iceberg refresh
+    if(settle->numNotices == 0) return;
+    BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+    for(int i = 0; i < settle->numNotices; i++) {
+        memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+        newPkt->type = settle->notices[i].type;
+        newPkt->size = htons(sizeof(BRS_NOTIFY_INFO));
+        market_broadcast(settle->market, newPkt, &settle->notices[i].notify);
+    }
+    settle->numNotices = 0;
+    Free(newPkt);
+}
+
+void addNotice(SETTLEMENT *settle, uint8_t type, ORDER *order, quantity_t quantity) {
+    // Grow the notice buffer when it runs out of room
+    if(settle->numNotices == settle->maxNotices) {
+        settle->maxNotices = (settle->maxNotices == 0) ? 64 : settle->maxNotices * 2;
+        settle->notices = Realloc(settle->notices, settle->maxNotices * sizeof(NOTICE));
+    }
+
+    NOTICE *notice = &settle->notices[settle->numNotices];
+    notice->type = type;
+    if(order->bid > 0) createNotifyPacket(&notice->notify, quantity, order->bid, order->orderid, 0);
+    else createNotifyPacket(&notice->notify, quantity, order->ask, 0, order->orderid);
+    settle->numNotices = settle->numNotices + 1;
+}
+
+void refreshOrder(EXCHANGE *exchange, ORDER *order) {
+    // The next tip of an iceberg order comes out of its reserve, under the same order id,
+    // and waits behind the orders already at its price
+    quantity_t tip = (order->hidden < order->displaySize) ? order->hidden : order->displaySize;
+    exchange_depth_update(exchange, order, (int64_t)tip - order->quantity, 0);
+    order->quantity = tip;
+    order->hidden = order->hidden - tip;
+    exchange_requeue_order(exchange, order);
+    addNotice(exchange->settle, BRS_POSTED_PKT, order, tip);
+}
+
+void cancelOrder(EXCHANGE *exchange, ORDER *order, quantity_t quantity) {
+    SETTLEMENT *settle = exchange->settle;
+
+    // The escrow of the canceled quantity is handed back with the rest of the pass,
+    // and the cancellation notified once the accounts are settled
+    LEDGER_DELTA *delta = getDelta(settle, order->trader->currAccount);
+    if(order->bid > 0) delta->releasedFunds = delta->releasedFunds + (uint64_t)order->bid * quantity;
+    else delta->releasedInventory = delta->releasedInventory + quantity;
+    addNotice(settle, BRS_CANCELED_PKT, order, quantity);
+
+    // The quantity comes off the shown tip first, then the reserve of an iceberg order
+    quantity_t fromTip = (quantity < order->quantity) ? quantity : order->quantity;
+    exchange_depth_update(exchange, order, -(int64_t)fromTip, 0);
+    order->quantity = order->quantity - fromTip;
+    order->hidden = order->hidden - (quantity - fromTip);
+    if(order->quantity > 0) return;
+    if(order->hidden > 0) {
+        refreshOrder(exchange, order);
+        return;
+    }
+
+    // An order canceled in full leaves the book
+    removeOrder(exchange, order);
+    exchange->numExchgs = exchange->numExchgs - 1;
+    trader_unref(order->trader, "Order canceled");
+    Free(order);
+}
+
+void preventSelfTrade(EXCHANGE *exchange, ORDER *buyer, ORDER *seller) {
+    // Order ids grow with time, so the later of the two orders is the incoming one
+    ORDER *incoming = (buyer->orderid > seller->orderid) ? buyer : seller;
+    ORDER *resting = (incoming == buyer) ? seller : buyer;
+    quantity_t quantity = (buyer->quantity < seller->quantity) ? buyer->quantity : seller->quantity;
+
+    // Every mode takes at least one of the two orders off the book
+    switch(exchange->stpMode) {
+        case STP_CANCEL_RESTING:
+            cancelOrder(exchange, resting, resting->quantity + resting->hidden);
             break;
-        }
-        if(tempOrder->nextOrder == order) {
-            tempOrder->nextOrder = order->nextOrder;
+        case STP_CANCEL_INCOMING:
+            cancelOrder(exchange, incoming, incoming->quantity + incoming->hidden);
+            break;
+        case STP_CANCEL_BOTH:
+            cancelOrder(exchange, resting, resting->quantity + resting->hidden);
+            cancelOrder(exchange, incoming, incoming->quantity + incoming->hidden);
+            break;
+        case STP_DECREMENT:
+            cancelOrder(exchange, buyer, quantity);
+            cancelOrder(exchange, seller, quantity);
             break;
+    }
+}
+
+void fillOrders(EXCHANGE *exchange, ORDER *buyer, ORDER *seller, quantity_t quantity, funds_t price) {
+    SETTLEMENT *settle = exchange->settle;
+    exchange_depth_update(exchange, buyer, -(int64_t)quantity, 0);
+    exchange_depth_update(exchange, seller, -(int64_t)quantity, 0);
+    buyer->quantity = buyer->quantity - quantity;
+    seller->quantity = seller->quantity - quantity;
+    exchange->last = price;
+
+    // Held funds pay for the inventory, held inventory goes to the buyer,
+    // all settled once the pass is over
+    LEDGER_DELTA *buyerDelta = getDelta(settle, buyer->trader->currAccount);
+    buyerDelta->heldFunds = buyerDelta->heldFunds + (uint64_t)quantity * buyer->bid;
+    buyerDelta->paidFunds = buyerDelta->paidFunds + (uint64_t)quantity * price;
+    buyerDelta->bought = buyerDelta->bought + quantity;
+    LEDGER_DELTA *sellerDelta = getDelta(settle, seller->trader->currAccount);
+    sellerDelta->heldInventory = sellerDelta->heldInventory + quantity;
+    sellerDelta->proceeds = sellerDelta->proceeds + (uint64_t)quantity * price;
+    addFill(settle, buyer, seller, quantity, price);
+    shm_feed_trade(buyer->orderid, seller->orderid, quantity, price);
+    stats_trade(&exchange->stats, time(NULL), quantity, price);
+    tape_trade(buyer->orderid, seller->orderid, buyer->trader->username, seller->trader->username,
+               quantity, price);
+
+    // Refresh the tip of a filled iceberg order from its reserve, and remove other filled orders from the book
+    if(seller->quantity == 0 && seller->hidden > 0) refreshOrder(exchange, seller);
+    else if(seller->quantity == 0) {
+        trader_unref(seller->trader, "Buyer bought inventory");
+        removeOrder(exchange, seller);
+        Free(seller);
+    }
+    if(buyer->quantity == 0 && buyer->hidden > 0) refreshOrder(exchange, buyer);
+    else if(buyer->quantity == 0) {
+        trader_unref(buyer->trader, "Seller sold inventory");
+        removeOrder(exchange, buyer);
+        Free(buyer);
+    }
+}
+
+void matchBook(EXCHANGE *exchange) {
+    // Match the best bid with the best ask for as long as they cross
+    while(exchange->bids != NULL && exchange->asks != NULL && exchange->bids->bid >= exchange->asks->ask) {
+        ORDER *buyer = exchange->bids;
+        ORDER *seller = exchange->asks;
+
+        // A trader's own orders never trade, the self-trade prevention mode decides which give way
+        if(buyer->trader == seller->trader) {
+            preventSelfTrade(exchange, buyer, seller);
+            continue;
         }
-        tempOrder = tempOrder->nextOrder;
+
+        // Trade at the price in the overlap closest to the last trade price
+        funds_t price = (seller->ask > exchange->last) ? seller->ask : exchange->last;
+        price = (buyer->bid < price) ? buyer->bid : price;
+        quantity_t quantity = (buyer->quantity < seller->quantity) ? buyer->quantity : seller->quantity;
+        fillOrders(exchange, buyer, seller, quantity, price);
     }
 }
 
+ORDER *detachTriggered(EXCHANGE *exchange, ORDER **head, int isBuyer) {
+    // The stops to trigger are a run at the front of the trigger book, cut off as a whole
+    ORDER *first = *head;
+    ORDER *last = NULL;
+    ORDER *order = first;
+    while(order != NULL && (isBuyer ? order->stopPrice <= exchange->last : order->stopPrice >= exchange->last)) {
+        last = order;
+        order = order->nextOrder;
+    }
+    if(last == NULL) return NULL;
+    *head = order;
+    if(order != NULL) order->prevOrder = NULL;
+    last->nextOrder = NULL;
+    return first;
+}
+
+void activateOrder(EXCHANGE *exchange, ORDER *order) {
+    // The stop goes onto its side of the book, posted there unless it only takes what it can at once
+    int isBuyer = (order->bid > 0);
+    funds_t price = isBuyer ? order->bid : order->ask;
+    int crosses = isBuyer ? (exchange->asks != NULL && exchange->asks->ask <= price) :
+                            (exchange->bids != NULL && exchange->bids->bid >= price);
+    int immediate = (order->immediate && exchange->auctionInterval == 0);
+    order->stopPrice = 0;
+    exchange_insert_order(exchange, order);
+    if(!immediate) exchange_post(order, order->quantity, price, isBuyer, 0);
+    else if(!crosses) {
+        cancelOrder(exchange, order, order->quantity + order->hidden);
+        return;
+    }
+
+    // In call-auction mode it waits for the next uncross
+    if(exchange->auctionInterval != 0) return;
+    orderid_t orderid = order->orderid;
+    matchBook(exchange);
+
+    // The book was not crossed before, so a crossing stop that is not filled leads its side
+    ORDER *head = isBuyer ? exchange->bids : exchange->asks;
+    if(immediate && head != NULL && head->orderid == orderid) cancelOrder(exchange, head, head->quantity + head->hidden);
+}
+
+void activateStops(EXCHANGE *exchange) {
+    // Stops trigger off the last trade price, so not before the first trade
+    while(exchange->last != 0) {
+        ORDER *buys = detachTriggered(exchange, &exchange->buyStops, 1);
+        ORDER *sells = detachTriggered(exchange, &exchange->sellStops, 0);
+        if(buys == NULL && sells == NULL) return;
+
+        // Buy stops in trigger order, then sell stops, each matched before the next is activated;
+        // the trades may trigger more stops, activated in the next round
+        ORDER *lists[] = {buys, sells};
+        for(int i = 0; i < 2; i++) {
+            while(lists[i] != NULL) {
+                ORDER *order = lists[i];
+                lists[i] = order->nextOrder;
+                activateOrder(exchange, order);
+            }
+        }
+    }
+}
+
+void exchange_match(EXCHANGE *exchange) {
+    SETTLEMENT *settle = exchange->settle;
+    matchBook(exchange);
+
+    // The trades may have reached the trigger price of stop orders
+    activateStops(exchange);
+
+    // Settle accounts and send notifications for everything traded in this pass
+    exchange_refresh_quotes(exchange);
+    settleAccounts(settle, 1);
+}
+
+void exchange_uncross(EXCHANGE *exchange) {
+    // Nothing to do unless the book is crossed
+    if(exchange->bids == NULL || exchange->asks == NULL) return;
+    funds_t bestBid = exchange->bids->bid;
+    funds_t bestAsk = exchange->asks->ask;
+    if(bestBid < bestAsk) return;
+
+    // Demand at or above the best ask, and the lowest bid that adds to it
+    uint64_t totalDemand = 0;
+    ORDER *lowBid = NULL;
+    for(ORDER *bid = exchange->bids; bid != NULL && bid->bid >= bestAsk; bid = bid->nextOrder) {
+        totalDemand = totalDemand + bid->quantity + bid->hidden;
+        lowBid = bid;
+    }
+
+    // Prices are ranked by executed volume, then by the smallest imbalance,
+    // then by the distance to the last trade price (or the midpoint before any trade)
+    funds_t reference = (exchange->last != 0) ? exchange->last : bestAsk + (bestBid - bestAsk) / 2;
+    funds_t clearPrice = 0;
+    uint64_t clearVolume = 0, clearImbalance = 0;
+
+    // Sweep the order prices in the crossed range upwards, asks from the front of their side
+    // and bids from the back of theirs: supply at or below the price accumulates, while demand
+    // at or above it falls away
+    ORDER *askPtr = exchange->asks;
+    ORDER *bidPtr = lowBid;
+    uint64_t supply = 0, demandBelow = 0;
+    while(1) {
+        funds_t price;
+        int askInRange = (askPtr != NULL && askPtr->ask <= bestBid);
+        if(askInRange && (bidPtr == NULL || askPtr->ask <= bidPtr->bid)) price = askPtr->ask;
+        else if(bidPtr != NULL) price = bidPtr->bid;
+        else break;
+
+        while(askPtr != NULL && askPtr->ask <= price) {
+            supply = supply + askPtr->quantity + askPtr->hidden;
+            askPtr = askPtr->nextOrder;
+        }
+        uint64_t demand = totalDemand - demandBelow;
+        uint64_t volume = (demand < supply) ? demand : supply;
+        uint64_t imbalance = (demand > supply) ? demand - supply : supply - demand;
+        funds_t distance = (price > reference) ? price - reference : reference - price;
+        funds_t clearDistance = (clearPrice > reference) ? clearPrice - reference : reference - clearPrice;
+        if(volume > clearVolume || (volume == clearVolume && volume > 0 &&
+           (imbalance < clearImbalance || (imbalance == clearImbalance && distance < clearDistance)))) {
+            clearPrice = price;
+            clearVolume = volume;
+            clearImbalance = imbalance;
+        }
+
+        while(bidPtr != NULL && bidPtr->bid <= price) {
+            demandBelow = demandBelow + bidPtr->quantity + bidPtr->hidden;
+            bidPtr = bidPtr->prevOrder;
+        }
+    }
+    if(clearVolume == 0) return;
+
+    // Execute at the clearing price in price-time priority; as in continuous matching,
+    // a trader's own orders go through self-trade prevention, which can leave some volume out
+    uint64_t executed = 0;
+    while(executed < clearVolume && exchange->bids != NULL && exchange->asks != NULL &&
+          exchange->bids->bid >= clearPrice && exchange->asks->ask <= clearPrice) {
+        ORDER *buyer = exchange->bids;
+        ORDER *seller = exchange->asks;
+        if(buyer->trader == seller->trader) {
+            preventSelfTrade(exchange, buyer, seller);
+            continue;
+        }
+        uint64_t quantity = (buyer->quantity < seller->quantity) ? buyer->quantity : seller->quantity;
+        if(clearVolume - executed < quantity) quantity = clearVolume - executed;
+        executed = executed + quantity;
+        fillOrders(exchange, buyer, seller, quantity, clearPrice);
+    }
+
+    // Stops triggered by the clearing price join the book for the next uncross
+    if(exchange->auctionInterval != 0) activateStops(exchange);
+
+    // The parties get their BOUGHT and SOLD, everyone else one UNCROSSED for the whole auction;
+    // when self-trade prevention took out every pair, only the cancellations are sent, and the
+    // last price (set by fills alone) stays as it was
+    exchange_refresh_quotes(exchange);
+    settleAccounts(exchange->settle, 0);
+    if(executed == 0) return;
+    BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+    memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+    newPkt->type = BRS_UNCROSSED_PKT;
+    newPkt->size = htons(sizeof(BRS_NOTIFY_INFO));
+    BRS_NOTIFY_INFO notify;
+    createNotifyPacket(&notify, executed, clearPrice, 0, 0);
+    market_broadcast(exchange->market, newPkt, &notify);
+    Free(newPkt);
+}
+
+void exchange_order_expired(TIMER *timer) {
+    // The wheel is the exchange's own, so the exchange is the struct around it
+    ORDER *order = (ORDER *)timer->arg;
+    EXCHANGE *exchange = (EXCHANGE *)((char *)timer->wheel - offsetof(EXCHANGE, expiry));
+    cancelOrder(exchange, order, order->quantity + order->hidden);
+}
+
+void exchange_expire(EXCHANGE *exchange) {
+    // Nothing can expire unless an order has a deadline
+    if(exchange->numTimed == 0) return;
+    SETTLEMENT *settle = exchange->settle;
+    timer_wheel_advance(&exchange->expiry, timer_now(&exchange->expiry));
+    if(settle->numNotices == 0) return;
+
+    // Release the escrow of every expired order, one ledger update per account,
+    // and notify their cancellation
+    exchange_refresh_quotes(exchange);
+    settleAccounts(settle, 1);
+}
+
+uint64_t realtimeNs(void) {
+    struct timespec currTime;
+    clock_gettime(CLOCK_REALTIME, &currTime);
+    return (uint64_t)currTime.tv_sec * 1000000000ULL + currTime.tv_nsec;
+}
+
+void exchange_set_auction(EXCHANGE *exchange, uint64_t intervalMs) {
+    pthread_mutex_lock(&exchange->mLock);
+    uint64_t wasInterval = exchange->auctionInterval;
+    exchange->auctionInterval = intervalMs;
+    if(intervalMs != 0) exchange->nextAuction = realtimeNs() + intervalMs * 1000000ULL;
+
+    // Leaving call-auction mode, what has accumulated is uncrossed before continuous matching resumes
+    else if(wasInterval != 0) exchange_uncross(exchange);
+    pthread_mutex_unlock(&exchange->mLock);
+
+    // Wake the matchmaker so it follows the new schedule
+    if(!exchange->embedded) V(&exchange->madeXchg);
+}
+
+int exchange_stp_mode(char *name) {
+    if(strcmp(name, "resting") == 0) return STP_CANCEL_RESTING;
+    if(strcmp(name, "incoming") == 0) return STP_CANCEL_INCOMING;
+    if(strcmp(name, "both") == 0) return STP_CANCEL_BOTH;
+    if(strcmp(name, "decrement") == 0) return STP_DECREMENT;
+    return -1;
+}
+
+void exchange_set_stp(EXCHANGE *exchange, STP_MODE mode) {
+    pthread_mutex_lock(&exchange->mLock);
+    exchange->stpMode = mode;
+    pthread_mutex_unlock(&exchange->mLock);
+}
+
+void exchange_set_inline(EXCHANGE *exchange, int isInline) {
+    pthread_mutex_lock(&exchange->mLock);
+    exchange->inlineMatch = isInline || exchange->embedded;
+    pthread_mutex_unlock(&exchange->mLock);
+}
+
+// Expire orders, then match if there is a bidder/seller: on each post in continuous mode, or once
+// per interval in call-auction mode; the exchange lock must be held
+static void runExchange(EXCHANGE *exchange) {
+    exchange_expire(exchange);
+    if(exchange->auctionInterval != 0) {
+        uint64_t now = realtimeNs();
+        if(now >= exchange->nextAuction) {
+            exchange_uncross(exchange);
+            uint64_t interval = exchange->auctionInterval * 1000000ULL;
+            exchange->nextAuction = exchange->nextAuction + interval;
+            if(exchange->nextAuction <= now) exchange->nextAuction = now + interval;
+        }
+    }
+    else {
+        // Even with one side empty, a stop order may have been posted beyond the last price
+        if(exchange->highest_bid == 0 || exchange->highest_ask == 0) debug("No one looking to buy or sell");
+        exchange_match(exchange);
+    }
+}
+
+void exchange_tick(EXCHANGE *exchange) {
+    pthread_mutex_lock(&exchange->mLock);
+    runExchange(exchange);
+    pthread_mutex_unlock(&exchange->mLock);
+}
 
 // Main matchmaking method
 void *matchmaking(void *arg) {
@@ -67,91 +505,29 @@ void *matchmaking(void *arg) {
     EXCHANGE *exchange = (EXCHANGE *)arg;
 
     while(1) {
-        // Waiting until a buyer, sellers, or exchange finalize is posted
-        P(&exchange->madeXchg);
+        // Find out when to wake up without a post: for the next uncross in call-auction mode,
+        // and for the next tick of the expiry wheel while orders with a deadline are on the book
+        pthread_mutex_lock(&exchange->mLock);
+        uint64_t deadline = (exchange->auctionInterval != 0) ? exchange->nextAuction : UINT64_MAX;
+        if(exchange->numTimed > 0) {
+            uint64_t tick = realtimeNs() + TIMER_TICK_MS * 1000000ULL;
+            if(tick < deadline) deadline = tick;
+        }
+        pthread_mutex_unlock(&exchange->mLock);
+
+        // Waiting until a buyer, sellers, or exchange finalize is posted, or the deadline
+        if(deadline != UINT64_MAX) {
+            struct timespec wake = {deadline / 1000000000ULL, deadline % 1000000000ULL};
+            while(sem_timedwait(&exchange->madeXchg, &wake) < 0 && errno == EINTR);
+        } else P(&exchange->madeXchg);
         pthread_mutex_lock(&exchange->mLock);
-        
-        // Initialize buyer and seller
-        ORDER *seller = exchange->currOrder;
-        ORDER *buyer = exchange->currOrder;
 
-        // Check if exchange is finalized, or there is a bidder/seller
+        // Check if exchange is finalized, then carry out what is due
         if(exchange->finished) break;
-        else if(exchange->highest_bid == 0 || exchange->highest_ask == 0) debug("No one looking to buy or sell");
-        else {
-            // Run nested for loop to find a seller that may match a buyer's wants
-            while(seller != NULL) {
-                if(seller->ask <= 0) {
-                    seller = seller->nextOrder;
-                    continue;
-                }
-
-                // Go through each buyer until a bid is greater than or equal to the ask
-                while(buyer != NULL) {
-                    if(buyer->bid <= 0 || buyer->trader == seller->trader)  {
-                        buyer = buyer->nextOrder;
-                        continue;
-                    }
-                    if(buyer->bid >= seller->ask && buyer->bid > 0) {
-                        // Get accounts for both traders
-                        ACCOUNT *buyerAcc = trader_get_account(buyer->trader);
-                        ACCOUNT *sellerAcc = trader_get_account(seller->trader);
-
-                        int price = 0;
-                        int quantity = 0;
-                        price = (seller->ask > exchange->last) ? seller->ask : exchange->last;
-                        price = (buyer->bid < price) ? buyer->bid : price;
-                        // Decrease quantity and increase inventory for buyer, increase balance for seller 
-                        if(buyer->quantity > seller->quantity) {
-                            quantity = seller->quantity;
-                            seller->quantity = 0;
-                            buyer->quantity = buyer->quantity - seller->quantity;
-                        } else if(buyer->quantity == seller->quantity) {
-                            quantity = seller->quantity;
-                            seller->quantity = 0;
-                            buyer->quantity = 0;
-                        } else {
-                            quantity = buyer->quantity;
-                            seller->quantity = seller->quantity - buyer->quantity;
-                            buyer->quantity = 0;
-                        }
-                        account_increase_inventory(buyerAcc, quantity);
-                        account_increase_balance(sellerAcc, price * quantity);
-                        if(price < buyer->bid) account_increase_balance(buyerAcc, quantity * (buyer->bid - price));
-                        exchange->last = price;
-
-                        // Send packets by calling the functions
-                        BRS_NOTIFY_INFO *notify = Malloc(sizeof(BRS_NOTIFY_INFO));
-                        memset(notify, 0, sizeof(BRS_NOTIFY_INFO));
-                        createNotifyPacket(notify, quantity, price, buyer->orderid, seller->orderid);
-                        broadcastAllPackets(notify, buyer->trader, seller->trader);
-                        Free(notify);
-
-                        // Remove seller order from list
-                        ORDER *tempS = seller;
-                        ORDER *tempB = buyer;
-                        if(tempB->quantity == 0) {
-                            trader_unref(tempB->trader, "Seller sold inventory");
-                            removeOrder(exchange, tempB);
-                            buyer = exchange->currOrder;
-                            Free(tempB);
-                        }
-                        if(tempS->quantity == 0) {
-                            trader_unref(tempS->trader, "Buyer bought inventory");
-                            removeOrder(exchange, tempS);
-                            seller = exchange->currOrder;
-                            Free(tempS);
-                        }
-                        
-                    }
-                    if(buyer != NULL) buyer = buyer->nextOrder;
-                }
-                if(seller != NULL) seller = seller->nextOrder;
-            }
-        }
+        runExchange(exchange);
         pthread_mutex_unlock(&exchange->mLock);
     }
 
     V(&exchange->waitForChange);
     return NULL;
-}
\ No newline at end of file
+}
@@ -0,0 +1,183 @@
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#include "out_queue.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define OUTQ_MAX_EVENTS 64          // Writable connections taken per epoll_wait
+
+// Queues waiting for their connection to become writable, indexed by file descriptor
+static int flushFd = -1;            // epoll set of the flusher
+static OUT_QUEUE **queues = NULL;
+static int numQueues = 0;           // Capacity of queues
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;  // Taken before a queue's lock
+static pthread_once_t flushOnce = PTHREAD_ONCE_INIT;
+
+// Write out what is waiting, as far as the connection takes it, the queue lock must be held
+static void queue_drain(OUT_QUEUE *queue) {
+    while(queue->len > 0) {
+        ssize_t n = send(queue->fileDesc, queue->buf + queue->head, queue->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if(n < 0) {
+            queue->failed = 1;
+            queue->len = 0;
+            break;
+        }
+        queue->head = queue->head + n;
+        queue->len = queue->len - n;
+    }
+    if(queue->len == 0) queue->head = 0;
+}
+
+// Have the flusher told once the connection is writable, the queue lock must be held
+static void queue_watch(OUT_QUEUE *queue) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.fd = queue->fileDesc;
+    if(epoll_ctl(flushFd, EPOLL_CTL_MOD, queue->fileDesc, &event) < 0 && errno == ENOENT) {
+        epoll_ctl(flushFd, EPOLL_CTL_ADD, queue->fileDesc, &event);
+    }
+    queue->watched = 1;
+}
+
+static void *flusher(void *arg) {
+    Pthread_detach(pthread_self());
+    struct epoll_event events[OUTQ_MAX_EVENTS];
+    while(1) {
+        int numEvents = epoll_wait(flushFd, events, OUTQ_MAX_EVENTS, -1);
+        if(numEvents < 0 && errno == EINTR) continue;
+        if(numEvents < 0) unix_error("epoll_wait error");
+
+        // The table lock keeps a queue from being freed while it is flushed
+        pthread_mutex_lock(&tableLock);
+        for(int i = 0; i < numEvents; i++) {
+            int fileDesc = events[i].data.fd;
+            OUT_QUEUE *queue = (fileDesc < numQueues) ? queues[fileDesc] : NULL;
+            if(queue == NULL) continue;
+            pthread_mutex_lock(&queue->lock);
+            queue_drain(queue);
+            if(queue->len > 0) queue_watch(queue);
+            else queue->watched = 0;
+            pthread_mutex_unlock(&queue->lock);
+        }
+        pthread_mutex_unlock(&tableLock);
+    }
+    return NULL;
+}
+
+static void flusher_start(void) {
+    if((flushFd = epoll_create1(EPOLL_CLOEXEC)) < 0) unix_error("epoll_create1 error");
+    pthread_t tid;
+    Pthread_create(&tid, NULL, flusher, NULL);
+}
+
+void outq_init(OUT_QUEUE *queue, int fileDesc) {
+    pthread_once(&flushOnce, flusher_start);
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->fileDesc = fileDesc;
+    queue->buf = NULL;
+    queue->head = 0;
+    queue->len = 0;
+    queue->cap = 0;
+    queue->watched = 0;
+    queue->failed = 0;
+
+    // Grow the table until the descriptor fits
+    pthread_mutex_lock(&tableLock);
+    if(fileDesc >= numQueues) {
+        int newNum = (numQueues == 0) ? FD_SETSIZE : numQueues;
+        while(fileDesc >= newNum) newNum = newNum * 2;
+        queues = Realloc(queues, newNum * sizeof(OUT_QUEUE *));
+        memset(&queues[numQueues], 0, (newNum - numQueues) * sizeof(OUT_QUEUE *));
+        numQueues = newNum;
+    }
+    queues[fileDesc] = queue;
+    pthread_mutex_unlock(&tableLock);
+}
+
+int outq_send(OUT_QUEUE *queue, BRS_PACKET_HEADER *hdr, void *payload) {
+    struct timespec currTime;
+    timespec_get(&currTime, TIME_UTC);
+    hdr->timestamp_sec = htonl(currTime.tv_sec);
+    hdr->timestamp_nsec = htonl(currTime.tv_nsec);
+    size_t pktSize = ntohs(hdr->size);
+    struct iovec iov[2] = {{hdr, sizeof(BRS_PACKET_HEADER)}, {payload, pktSize}};
+    size_t total = sizeof(BRS_PACKET_HEADER) + pktSize;
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->failed) {
+        pthread_mutex_unlock(&queue->lock);
+        return EXIT_FAILURE;
+    }
+
+    // Straight to the connection if nothing is waiting ahead of the packet
+    ssize_t sent = 0;
+    if(queue->len == 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (pktSize > 0) ? 2 : 1;
+        while((sent = sendmsg(queue->fileDesc, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR);
+        if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            queue->failed = 1;
+            pthread_mutex_unlock(&queue->lock);
+            return EXIT_FAILURE;
+        }
+        if(sent < 0) sent = 0;
+        if((size_t)sent == total) {
+            pthread_mutex_unlock(&queue->lock);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    // A client that does not read is not kept waiting for without end
+    size_t left = total - sent;
+    if(queue->len + left > OUTQ_MAX_BYTES) {
+        debug("Client %d is not reading, disconnecting it", queue->fileDesc);
+        queue->failed = 1;
+        queue->len = 0;
+        shutdown(queue->fileDesc, SHUT_RDWR);
+        pthread_mutex_unlock(&queue->lock);
+        return EXIT_FAILURE;
+    }
+
+    // Keep the rest, after what is already waiting
+    if(queue->head + queue->len + left > queue->cap) {
+        if(queue->head > 0) memmove(queue->buf, queue->buf + queue->head, queue->len);
+        queue->head = 0;
+        if(queue->len + left > queue->cap) {
+            size_t newCap = (queue->cap == 0) ? 4096 : queue->cap;
+            while(queue->len + left > newCap) newCap = newCap * 2;
+            queue->buf = Realloc(queue->buf, newCap);
+            queue->cap = newCap;
+        }
+    }
+    char *tail = queue->buf + queue->head + queue->len;
+    for(int i = 0; i < 2; i++) {
+        size_t skip = ((size_t)sent < iov[i].iov_len) ? (size_t)sent : iov[i].iov_len;
+        memcpy(tail, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+        tail = tail + iov[i].iov_len - skip;
+        sent = sent - skip;
+    }
+    queue->len = queue->len + left;
+    if(!queue->watched) queue_watch(queue);
+    pthread_mutex_unlock(&queue->lock);
+    return EXIT_SUCCESS;
+}
+
+void outq_fini(OUT_QUEUE *queue) {
+    // Out of the flusher's reach first
+    pthread_mutex_lock(&tableLock);
+    if(queue->fileDesc < numQueues && queues[queue->fileDesc] == queue) queues[queue->fileDesc] = NULL;
+    epoll_ctl(flushFd, EPOLL_CTL_DEL, queue->fileDesc, NULL);
+    pthread_mutex_unlock(&tableLock);
+
+    if(queue->buf != NULL) Free(queue->buf);
+    queue->buf = NULL;
+    pthread_mutex_destroy(&queue->lock);
+}
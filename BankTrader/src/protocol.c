@@ -30,15 +30,16 @@ int proto_send_packet(int fd, BRS_PACKET_HEADER *hdr, void *payload) {
     hdr->timestamp_sec = htonl(currTime.tv_sec);
     hdr->timestamp_nsec = htonl(currTime.tv_nsec);
 
-    // Write to the file descriptor
-    if(Write(fd, hdr, sizeof(BRS_PACKET_HEADER)) < sizeof(BRS_PACKET_HEADER)) return EXIT_FAILURE;
+    // Write to the file descriptor (an error, such as a peer that went away, fails the send
+    // instead of ending the server)
+    if(rio_writen(fd, hdr, sizeof(BRS_PACKET_HEADER)) != sizeof(BRS_PACKET_HEADER)) return EXIT_FAILURE;
 
     // Running over network connection with uint_16 (use ntohs for size attribute)
     uint16_t pktSize = ntohs(hdr->size);
 
     // If size > 0, write the additional payload
     if(pktSize) {
-        if(Write(fd, payload, (size_t) pktSize) < pktSize) return EXIT_FAILURE;
+        if(rio_writen(fd, payload, (size_t) pktSize) != pktSize) return EXIT_FAILURE;
     }
     
 
@@ -61,8 +62,8 @@ int proto_send_packet(int fd, BRS_PACKET_HEADER *hdr, void *payload) {
  * responsibility of freeing that storage.
  */
 int proto_recv_packet(int fd, BRS_PACKET_HEADER *hdr, void **payloadp) {
-    // Read the data from the file descriptor
-    if(Read(fd, hdr, sizeof(BRS_PACKET_HEADER)) < sizeof(BRS_PACKET_HEADER)) return EXIT_FAILURE;
+    // Read the data from the file descriptor (a pipelined packet can arrive in pieces, so keep reading)
+    if(rio_readn(fd, hdr, sizeof(BRS_PACKET_HEADER)) != sizeof(BRS_PACKET_HEADER)) return EXIT_FAILURE;
     
     // Get the current time in seconds and nanoseconds
     struct timespec currTime;
@@ -79,7 +80,11 @@ int proto_recv_packet(int fd, BRS_PACKET_HEADER *hdr, void **payloadp) {
     if(pktSize) { 
         *payloadp = Malloc(pktSize);
         memset(*payloadp, 0, sizeof(pktSize));
-        if(Read(fd, *payloadp, pktSize) < pktSize) return EXIT_FAILURE;
+        if(rio_readn(fd, *payloadp, pktSize) != pktSize) {
+            Free(*payloadp);
+            *payloadp = NULL;
+            return EXIT_FAILURE;
+        }
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rate_limit.h"
+#include "structs.h"
+#include "csapp.h"
+
+static uint64_t traderInterval = 0;     // Per-trader refill interval (ns)
+static uint64_t traderTolerance = 0;    // Per-trader burst tolerance (ns)
+static RATE_BUCKET globalBucket;        // Bucket shared by all traders
+
+// Admission counters
+static _Atomic uint64_t numAdmitted = 0;
+static _Atomic uint64_t numTraderThrottled = 0;
+static _Atomic uint64_t numGlobalThrottled = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec currTime;
+    clock_gettime(CLOCK_MONOTONIC, &currTime);
+    return (uint64_t)currTime.tv_sec * 1000000000ULL + currTime.tv_nsec;
+}
+
+// Refill interval and tolerance of a limit, both 0 when there is no limit
+static void limit_params(double rate, unsigned int burst, uint64_t *interval, uint64_t *tolerance) {
+    if(rate <= 0) {
+        *interval = 0;
+        *tolerance = 0;
+        return;
+    }
+    *interval = (uint64_t)(1e9 / rate);
+    if(*interval == 0) *interval = 1;
+    if(burst == 0) burst = 1;
+    *tolerance = (burst - 1) * *interval;
+}
+
+// Take a token if there is one, 1 if it was taken
+static int bucket_take(RATE_BUCKET *bucket, uint64_t now) {
+    if(bucket->interval == 0) return 1;
+
+    uint64_t fullTime = atomic_load_explicit(&bucket->fullTime, memory_order_relaxed);
+    while(1) {
+        // An idle bucket is full, it does not keep filling past its burst
+        uint64_t base = (fullTime > now) ? fullTime : now;
+        if(base - now > bucket->tolerance) return 0;
+        if(atomic_compare_exchange_weak_explicit(&bucket->fullTime, &fullTime, base + bucket->interval,
+                                                 memory_order_relaxed, memory_order_relaxed)) return 1;
+    }
+}
+
+// Give back a token taken by bucket_take
+static void bucket_refund(RATE_BUCKET *bucket) {
+    if(bucket->interval != 0) atomic_fetch_sub_explicit(&bucket->fullTime, bucket->interval, memory_order_relaxed);
+}
+
+int rate_limit_parse(char *spec, double *rate, unsigned int *burst) {
+    char *end;
+    *rate = strtod(spec, &end);
+    if(end == spec || *rate < 0) return -1;
+    if(*end == '\0') {
+        *burst = (*rate >= 1) ? (unsigned int)*rate : 1;
+        return 0;
+    }
+    if(*end != ':') return -1;
+    char *burstStr = end + 1;
+    long value = strtol(burstStr, &end, 10);
+    if(end == burstStr || *end != '\0' || value < 1) return -1;
+    *burst = value;
+    return 0;
+}
+
+void rate_limit_configure(double traderRate, unsigned int traderBurst,
+                          double globalRate, unsigned int globalBurst) {
+    limit_params(traderRate, traderBurst, &traderInterval, &traderTolerance);
+    limit_params(globalRate, globalBurst, &globalBucket.interval, &globalBucket.tolerance);
+    globalBucket.fullTime = 0;
+}
+
+void rate_limit_trader_init(RATE_BUCKET *bucket) {
+    bucket->interval = traderInterval;
+    bucket->tolerance = traderTolerance;
+    bucket->fullTime = 0;
+}
+
+int rate_limit_admit(RATE_BUCKET *bucket, _Atomic uint64_t *throttled) {
+    // Nothing to do unless a limit is set
+    if(bucket->interval == 0 && globalBucket.interval == 0) return 1;
+    uint64_t now = now_ns();
+
+    // The trader's own limit first, so a flooding trader does not use up the shared one
+    if(!bucket_take(bucket, now)) {
+        atomic_fetch_add_explicit(throttled, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&numTraderThrottled, 1, memory_order_relaxed);
+        return 0;
+    }
+    if(!bucket_take(&globalBucket, now)) {
+        bucket_refund(bucket);
+        atomic_fetch_add_explicit(throttled, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&numGlobalThrottled, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&numAdmitted, 1, memory_order_relaxed);
+    return 1;
+}
+
+void rate_limit_get_stats(RATE_LIMIT_STATS *stats) {
+    stats->admitted = atomic_load_explicit(&numAdmitted, memory_order_relaxed);
+    stats->traderThrottled = atomic_load_explicit(&numTraderThrottled, memory_order_relaxed);
+    stats->globalThrottled = atomic_load_explicit(&numGlobalThrottled, memory_order_relaxed);
+}
+
+void rate_limit_report(FILE *out) {
+    RATE_LIMIT_STATS stats;
+    rate_limit_get_stats(&stats);
+    fprintf(out, "rate limit: %lu admitted, %lu throttled by trader limit, %lu by global limit\n",
+            (unsigned long)stats.admitted, (unsigned long)stats.traderThrottled,
+            (unsigned long)stats.globalThrottled);
+
+    // Per-trader counts, for the traders logged in now
+    MARKET *market = &defaultMarket;
+    pthread_mutex_lock(&market->traLock);
+    for(int i = 0; i < market->maxTraders; i++) {
+        TRADER *trader = &market->traders[i];
+        if(trader->username == NULL) continue;
+        fprintf(out, "  %s: %lu throttled\n", trader->username,
+                (unsigned long)atomic_load_explicit(&trader->throttled, memory_order_relaxed));
+    }
+    pthread_mutex_unlock(&market->traLock);
+}
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <time.h>
 
 #include "server.h"
 #include "csapp.h"
@@ -7,10 +8,18 @@
 #include "trader.h"
 #include "protocol.h"
 #include "structs.h"
+#include "protocol_ext.h"
+#include "input_sched.h"
+#include "timer_wheel.h"
 
-void statusHelper(BRS_STATUS_INFO *statusP, TRADER *traderP, ACCOUNT *accountP, orderid_t id) {
-    // Set the balance, inventory, and quantity for status
-    account_get_status(accountP, statusP);
+static uint64_t idleTimeout = 0;        // Silence after which a session is shut down (ms), 0 for none
+static uint64_t heartbeatInterval = 0;  // Silence after which a HEARTBEAT is sent (ms), 0 for none
+static TIMER_WHEEL sessionWheel;        // Timers of the sessions, running only when either is set
+
+void statusHelper(BRS_STATUS_EXT_INFO *extP, TRADER *traderP, ACCOUNT *accountP, orderid_t id) {
+    // Set the balance, inventory, and the rest of the ledger for status
+    BRS_STATUS_INFO *statusP = &extP->status;
+    account_get_ledger(accountP, statusP, &extP->ledger);
 
     // Create new info pointer for calling exchange_get_status()
     BRS_STATUS_INFO *infoP = Malloc(sizeof(BRS_STATUS_INFO));
@@ -30,20 +39,25 @@ void statusHelper(BRS_STATUS_INFO *statusP, TRADER *traderP, ACCOUNT *accountP,
     Free(infoP);
 }
 
-void cli_send_nack(int fileDesc) {
+void cli_send_nack(BRS_SESSION *session) {
     // Create new packet, allocate space for it, set type to nack, and size to 0
     BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
     memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
     newPkt->type = BRS_NACK_PKT;
     newPkt->size = 0;
     
-    // Send packet using trader file descriptor, newPkt variable, NULL since NACK has no payload
-    proto_send_packet(fileDesc, newPkt, NULL);
+    // Send packet through the session's queue, NULL since NACK has no payload
+    outq_send(&session->out, newPkt, NULL);
 
-    // Free newPkt as it is no longer being used, then return EXIT_SUCCESS
+    // Free newPkt as it is no longer being used
     Free(newPkt);
 }
 
+// Sink of a session's trader, so that what the trader is sent never waits for the client
+static int session_sink(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data, void *arg) {
+    return outq_send(arg, pkt, data);
+}
+
 void *brs_client_service(void *arg) {
     // Parameter arg is a pointer to the integer file descriptor used to communicate with client
     // Once this file descriptor has been retrieved, the storage it occupied needs to be freed
@@ -52,193 +66,436 @@ void *brs_client_service(void *arg) {
 
     // The thread must then become detached, so that it does not have to be explicitly reaped
     Pthread_detach(pthread_self());
-    
+
+    // Serve the client on this thread until the connection shuts down
+    brs_client_session(fileDesc);
+    return NULL;
+}
+
+void brs_client_session(int fileDesc) {
     // It must register the client file descriptor with the client registry
-    if(creg_register(client_registry, fileDesc) == EXIT_FAILURE) return NULL;
+    BRS_SESSION session;
+    if(brs_session_open(&session, fileDesc) == EXIT_FAILURE) return;
 
-    // Set up packets, pointer to trader, and pointer to payload
+    /* The thread should enter a service loop in which it repeatedly receives a request packet 
+       sent by the client, carries out the request, and sends any response packets */
     BRS_PACKET_HEADER *brsHeader = Malloc(sizeof(BRS_PACKET_HEADER));
     memset(brsHeader, 0, sizeof(BRS_PACKET_HEADER));
-    TRADER *newTrader = NULL;
-    ACCOUNT *newAccount = NULL;
     void *payloadp = NULL;
-
-    /* The thread should enter a service loop in which it repeatedly receives a request packet 
-       sent by the client, carries out the request, and sends any response packets */
     while(proto_recv_packet(fileDesc, brsHeader, &payloadp) == 0) {
-        int pktSize = brsHeader->size;
+        brs_session_request(&session, brsHeader, payloadp);
+        payloadp = NULL;
+    }
+
+    // Free header as it is no longer being used, then end the session
+    Free(brsHeader);
+    brs_session_close(&session);
+}
+
+void brs_session_timeouts(uint64_t idleMs, uint64_t heartbeatMs) {
+    idleTimeout = idleMs;
+    heartbeatInterval = heartbeatMs;
+    timer_wheel_start(&sessionWheel);
+}
+
+// Send a HEARTBEAT, EXIT_FAILURE if the connection can no longer be used
+static int session_heartbeat(BRS_SESSION *session) {
+    // The queue orders it with whatever else the client is sent, and never waits
+    BRS_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(BRS_PACKET_HEADER));
+    hdr.type = BRS_HEARTBEAT_PKT;
+    return outq_send(&session->out, &hdr, NULL);
+}
+
+// Check a session for silence when its timer expires, and set the timer for the next check
+static void session_timer(TIMER *timer) {
+    BRS_SESSION *session = timer->arg;
+    uint64_t now = timer_now(&sessionWheel);
+    uint64_t lastActive = atomic_load_explicit(&session->lastActive, memory_order_relaxed);
+    uint64_t idle = (now > lastActive) ? now - lastActive : 0;
+
+    // Shutting the connection down ends the session through the usual close path, on its own thread
+    if(idleTimeout != 0 && idle >= idleTimeout) {
+        debug("Session %d idle for %lu ms, shutting it down", session->fileDesc, (unsigned long)idle);
+        shutdown(session->fileDesc, SHUT_RDWR);
+        return;
+    }
+
+    uint64_t next = (idleTimeout != 0) ? idleTimeout - idle : UINT64_MAX;
+    if(heartbeatInterval != 0) {
+        if(idle >= heartbeatInterval && session_heartbeat(session) == EXIT_FAILURE) {
+            shutdown(session->fileDesc, SHUT_RDWR);
+            return;
+        }
+        uint64_t untilHeartbeat = heartbeatInterval - idle % heartbeatInterval;
+        if(untilHeartbeat < next) next = untilHeartbeat;
+    }
+    timer_add(timer, next);
+}
+
+int brs_session_open(BRS_SESSION *session, int fileDesc) {
+    // It must register the client file descriptor with the client registry
+    if(creg_register(client_registry, fileDesc) == EXIT_FAILURE) {
+        close(fileDesc);
+        return EXIT_FAILURE;
+    }
+
+    // No trader until the client has logged in
+    session->fileDesc = fileDesc;
+    session->trader = NULL;
+    session->account = NULL;
+    outq_init(&session->out, fileDesc);
+
+    // The client's packets push the timer's checks back without touching the timer
+    timer_init(&session->idleTimer, &sessionWheel, session_timer, session);
+    if(idleTimeout != 0 || heartbeatInterval != 0) {
+        session->lastActive = timer_now(&sessionWheel);
+        uint64_t first = idleTimeout;
+        if(first == 0 || (heartbeatInterval != 0 && heartbeatInterval < first)) first = heartbeatInterval;
+        timer_add(&session->idleTimer, first);
+    }
+    return EXIT_SUCCESS;
+}
+
+void brs_session_request(BRS_SESSION *session, BRS_PACKET_HEADER *brsHeader, void *payloadp) {
+    int fileDesc = session->fileDesc;
+    TRADER *newTrader = session->trader;
+    ACCOUNT *newAccount = session->account;
+    int pktSize = ntohs(brsHeader->size);
+
+    // Any packet is a sign of life, and a HEARTBEAT is nothing more
+    if(idleTimeout != 0 || heartbeatInterval != 0) {
+        atomic_store_explicit(&session->lastActive, timer_now(&sessionWheel), memory_order_relaxed);
+    }
+    if(brsHeader->type == BRS_HEARTBEAT_PKT) {
+        if(payloadp != NULL) Free(payloadp);
+        return;
+    }
+
+    // Requests that reach the exchange have to get past admission control first, except
+    // cancels, which are never held back
+    int type = brsHeader->type;
+    int isCancel = (type == BRS_CANCEL_PKT || type == BRS_MASS_CANCEL_PKT);
+    int toExchange = (type == BRS_BUY_PKT || type == BRS_SELL_PKT || type == BRS_QUOTE_PKT || isCancel);
+    if(newTrader != NULL && toExchange && !isCancel && !rate_limit_admit(&newTrader->bucket, &newTrader->throttled)) {
+        trader_send_nack(newTrader);
+        if(payloadp != NULL) Free(payloadp);
+        return;
+    }
+    
+    if(brsHeader->type == BRS_LOGIN_PKT && newTrader != NULL) cli_send_nack(session);
+    else if(brsHeader->type == BRS_LOGIN_PKT) {
+        // Make the username the size of the packet + 1 for null terminator
+        char username[pktSize+1];
+        memcpy(&username[0], payloadp, pktSize);
+        *(username + pktSize) = '\0';
+
+        // A username followed by a NUL and the last sequence number seen resumes the session
+        size_t nameLen = strnlen(username, pktSize);
+        int resume = (nameLen + 1 + sizeof(BRS_LOGIN_RESUME_INFO) == pktSize);
+        uint32_t lastSeq = 0;
+        if(resume) {
+            BRS_LOGIN_RESUME_INFO resumeInfo;
+            memcpy(&resumeInfo, &username[nameLen + 1], sizeof(BRS_LOGIN_RESUME_INFO));
+            lastSeq = ntohl(resumeInfo.last_seq);
+        }
+
+        // Free payloadp since it was used in protocol and is no longer being used
+        Free(payloadp);
+        payloadp = NULL;
+
+        // Log the trader in, then create packet header to send trader info back
+        newTrader = trader_login_conn(fileDesc, username, session_sink, &session->out);
+        if(newTrader == NULL) {
+            cli_send_nack(session);
+            return;
+        }
+        newAccount = account_lookup(newTrader->username);
+        session->trader = newTrader;
+        session->account = newAccount;
+
+        // A resumed session is acknowledged with what is kept, then gets what it missed
+        if(resume) {
+            trader_resume(newTrader, lastSeq);
+            return;
+        }
+
+        BRS_PACKET_HEADER *pktForClient = Malloc(sizeof(BRS_PACKET_HEADER));
+        memset(pktForClient, 0, sizeof(BRS_PACKET_HEADER));
+        
+        // Set type depending on whether newTrader received a NULL pointer or not
+        // Set size of packe to 0 since there is no payload
+        if(newTrader != NULL) pktForClient->type = BRS_ACK_PKT;
+        else pktForClient->type = BRS_NACK_PKT;
+        pktForClient->size = 0;
+
+        // Send the packet, then free the header
+        outq_send(&session->out, pktForClient, NULL);
+        Free(pktForClient);
+    }
+
+    // Until the client has logged in, only LOGIN is honored
+    else if(newTrader == NULL) cli_send_nack(session);
+
+    // Requests of a logged-in trader for the exchange go through the input stage, if there is one
+    else if(toExchange && input_sched_active()) {
+        if(input_submit(newTrader, brsHeader, payloadp) == EXIT_SUCCESS) return;
+        trader_send_nack(newTrader);
+    } else {
+        brs_trader_request(newTrader, newAccount, brsHeader, payloadp);
+        return;
+    }
+
+    // Free the payload of a request that was not carried out
+    if(payloadp != NULL) Free(payloadp);
+}
+
+// Terms of a BUY or SELL, from as much of the extended order payload as was sent
+static void order_terms(BRS_PACKET_HEADER *brsHeader, void *payloadp, ORDER_TERMS *terms) {
+    size_t size = ntohs(brsHeader->size);
+    memset(terms, 0, sizeof(ORDER_TERMS));
+    if(size >= sizeof(BRS_ORDER_EXT_INFO)) {
+        BRS_ORDER_EXT_INFO *orderP = (BRS_ORDER_EXT_INFO *)payloadp;
+        terms->expireMs = (uint64_t)ntohl(orderP->expire_sec) * 1000 + ntohl(orderP->expire_nsec) / 1000000;
+    }
+    if(size >= sizeof(BRS_ORDER_STOP_INFO)) {
+        BRS_ORDER_STOP_INFO *orderP = (BRS_ORDER_STOP_INFO *)payloadp;
+        terms->stopPrice = ntohl(orderP->stop_price);
+        terms->immediate = (ntohl(orderP->stop_type) == BRS_STOP_MARKET);
+    }
+    if(size >= sizeof(BRS_ORDER_ICEBERG_INFO)) {
+        BRS_ORDER_ICEBERG_INFO *orderP = (BRS_ORDER_ICEBERG_INFO *)payloadp;
+        terms->displaySize = ntohl(orderP->display_quantity);
+    }
+}
+
+void brs_trader_request(TRADER *newTrader, ACCOUNT *newAccount, BRS_PACKET_HEADER *brsHeader, void *payloadp) {
+    if(brsHeader->type == BRS_STATUS_PKT) {
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        statusHelper(status, newTrader, newAccount, -1);
+        trader_send_status(newTrader, status);
+        Free(status);
+
+    } else if(brsHeader->type == BRS_DEPOSIT_PKT) {
+        // Set deposit pointer to data from packet
+        BRS_FUNDS_INFO *depositP = (BRS_FUNDS_INFO *)payloadp;
+        if(account_credit_balance(newAccount, ntohl(depositP->amount)) == EXIT_FAILURE) {
+            trader_send_nack(newTrader);
+        }
+
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        statusHelper(status, newTrader, newAccount, -1);
+        trader_send_status(newTrader, status);
+        Free(status);
+    
+    } else if(brsHeader->type == BRS_WITHDRAW_PKT) {
+        // Set withdraw pointer to data from packet
+        BRS_FUNDS_INFO *withdrawP = (BRS_FUNDS_INFO *)payloadp;
+        if(account_decrease_balance(newAccount, ntohl(withdrawP->amount)) == EXIT_FAILURE) {
+            trader_send_nack(newTrader);
+        }
+
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        statusHelper(status, newTrader, newAccount, -1);
+        trader_send_status(newTrader, status);
+        Free(status);
+
+    } else if(brsHeader->type == BRS_ESCROW_PKT) {
+        // Set escrow pointer to data from packet
+        BRS_ESCROW_INFO *escrowP = (BRS_ESCROW_INFO *)payloadp;
+        if(account_credit_inventory(newAccount, ntohl(escrowP->quantity)) == EXIT_FAILURE) {
+            trader_send_nack(newTrader);
+        }
+
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        statusHelper(status, newTrader, newAccount, -1);
+        trader_send_status(newTrader, status);
+        Free(status);
+
+    } else if(brsHeader->type == BRS_RELEASE_PKT) {
+        // Set release pointer to data from packet
+        BRS_ESCROW_INFO *releaseP = (BRS_ESCROW_INFO *)payloadp;
+        if(account_decrease_inventory(newAccount, ntohl(releaseP->quantity)) == EXIT_FAILURE) {
+            trader_send_nack(newTrader);
+        }
+
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        statusHelper(status, newTrader, newAccount, -1);
+        trader_send_status(newTrader, status);
+        Free(status);
+        
+    } else if(brsHeader->type == BRS_BUY_PKT) {
+        // Set buy pointer to data from packet
+        BRS_ORDER_INFO *buyP = (BRS_ORDER_INFO *)payloadp;
+        quantity_t quant = ntohl(buyP->quantity);
+        funds_t price = ntohl(buyP->price);
+        ORDER_TERMS terms;
+        order_terms(brsHeader, payloadp, &terms);
+        orderid_t buyId = exchange_post_terms(exchange, newTrader, quant, price, 1, &terms);
+
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        statusHelper(status, newTrader, newAccount, buyId);
+
+        // If buyId > 0 (successful), send ACK packet
+        if(buyId > 0) trader_send_status(newTrader, status);
+        else  trader_send_nack(newTrader);
+        Free(status);
+
+    } else if(brsHeader->type == BRS_SELL_PKT) {
+        // Set sell pointer to data from packet
+        BRS_ORDER_INFO *sellP = (BRS_ORDER_INFO *)payloadp;
+        quantity_t quant = ntohl(sellP->quantity);
+        funds_t price = ntohl(sellP->price);
+        ORDER_TERMS terms;
+        order_terms(brsHeader, payloadp, &terms);
+        orderid_t sellId = exchange_post_terms(exchange, newTrader, quant, price, 0, &terms);
+
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        statusHelper(status, newTrader, newAccount, sellId);
+
+        // If sellId > 0 (successful), send ACK packet
+        if(sellId > 0) trader_send_status(newTrader, status);
+        else  trader_send_nack(newTrader);
+        Free(status);
         
-        if(brsHeader->type == BRS_LOGIN_PKT && newTrader != NULL) cli_send_nack(fileDesc);
-        else if(brsHeader->type == BRS_LOGIN_PKT) {
-            // Make the username the size of the packet + 1 for null terminator
-            char username[pktSize+1];
-            memcpy(&username[0], payloadp, pktSize);
-            *(username + pktSize) = '\0';
-
-            // Free payloadp since it was used in protocol and is no longer being used
-            Free(payloadp);
-
-            // Log the trader in, then create packet header to send trader info back
-            newTrader = trader_login(fileDesc, username);
-            if(newTrader == NULL) {
-                cli_send_nack(fileDesc);
-                continue;
+    } else if(brsHeader->type == BRS_CANCEL_PKT) {
+        // Set cancel pointer to data from packet
+        BRS_CANCEL_INFO *cancelP = (BRS_CANCEL_INFO *)payloadp;
+        orderid_t cancelId = ntohl(cancelP->order);
+        quantity_t *quant = Malloc(sizeof(quantity_t));
+        memset(quant, 0, sizeof(quantity_t));
+        int isCanceled = exchange_cancel(exchange, newTrader, cancelId, quant);
+
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        
+        // Set the ledger, bid/ask/last, and quantity for status
+        statusHelper(status, newTrader, newAccount, cancelId);
+        status->status.quantity = htonl(*quant);
+
+        // If isCanceled > 0 (successful), send ACK packet
+        if(isCanceled == EXIT_SUCCESS) trader_send_status(newTrader, status);
+        else  trader_send_nack(newTrader);
+
+        Free(status);
+        Free(quant);
+
+    } else if(brsHeader->type == BRS_MASS_CANCEL_PKT) {
+        // Cancel every order the trader still has on the exchange
+        quantity_t quant = 0;
+        exchange_cancel_all(exchange, newTrader, &quant);
+
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        statusHelper(status, newTrader, newAccount, 0);
+        status->status.quantity = htonl(quant);
+        trader_send_status(newTrader, status);
+        Free(status);
+
+    } else if(brsHeader->type == BRS_QUOTE_PKT) {
+        // The payload has to hold exactly the levels it counts
+        BRS_QUOTE_INFO *quoteP = (BRS_QUOTE_INFO *)payloadp;
+        size_t size = ntohs(brsHeader->size);
+        uint32_t numBids = (size >= sizeof(BRS_QUOTE_INFO)) ? ntohl(quoteP->num_bids) : 0;
+        uint32_t numAsks = (size >= sizeof(BRS_QUOTE_INFO)) ? ntohl(quoteP->num_asks) : 0;
+        int isQuoted = EXIT_FAILURE;
+        orderid_t firstId = 0;
+        if(size >= sizeof(BRS_QUOTE_INFO) && numBids <= BRS_MAX_QUOTE_LEVELS && numAsks <= BRS_MAX_QUOTE_LEVELS &&
+           numBids + numAsks <= BRS_MAX_QUOTE_LEVELS &&
+           size == sizeof(BRS_QUOTE_INFO) + (numBids + numAsks) * sizeof(BRS_ORDER_INFO)) {
+            // Replace the trader's quotes with the levels, in host byte order
+            QUOTE_LEVEL *levels = Malloc((numBids + numAsks + 1) * sizeof(QUOTE_LEVEL));
+            for(uint32_t i = 0; i < numBids + numAsks; i++) {
+                levels[i].quantity = ntohl(quoteP->levels[i].quantity);
+                levels[i].price = ntohl(quoteP->levels[i].price);
             }
-            newAccount = account_lookup(newTrader->username);
-
-            BRS_PACKET_HEADER *pktForClient = Malloc(sizeof(BRS_PACKET_HEADER));
-            memset(pktForClient, 0, sizeof(BRS_PACKET_HEADER));
-            
-            // Set type depending on whether newTrader received a NULL pointer or not
-            // Set size of packe to 0 since there is no payload
-            if(newTrader != NULL) pktForClient->type = BRS_ACK_PKT;
-            else pktForClient->type = BRS_NACK_PKT;
-            pktForClient->size = 0;
-
-            // Send the packet, then free the header
-            proto_send_packet(fileDesc, pktForClient, NULL);
-            Free(pktForClient);
+            isQuoted = exchange_quote(exchange, newTrader, levels, numBids, numAsks, &firstId);
+            Free(levels);
         }
 
-        if(newTrader != NULL) {
-            if(brsHeader->type == BRS_STATUS_PKT) {
-                BRS_STATUS_INFO *status = Malloc(sizeof(BRS_STATUS_INFO));
-                memset(status, 0, sizeof(BRS_STATUS_INFO));
-                statusHelper(status, newTrader, newAccount, -1);
-                trader_send_ack(newTrader, status);
-                Free(status);
-
-            } else if(brsHeader->type == BRS_DEPOSIT_PKT) {
-                // Set deposit pointer to data from packet
-                BRS_FUNDS_INFO *depositP = (BRS_FUNDS_INFO *)payloadp;
-                account_increase_balance(newAccount, ntohl(depositP->amount));
-                Free(payloadp);
-
-                BRS_STATUS_INFO *status = Malloc(sizeof(BRS_STATUS_INFO));
-                memset(status, 0, sizeof(BRS_STATUS_INFO));
-                statusHelper(status, newTrader, newAccount, -1);
-                trader_send_ack(newTrader, status);
-                Free(status);
-            
-            } else if(brsHeader->type == BRS_WITHDRAW_PKT) {
-                // Set withdraw pointer to data from packet
-                BRS_FUNDS_INFO *withdrawP = (BRS_FUNDS_INFO *)payloadp;
-                if(account_decrease_balance(newAccount, ntohl(withdrawP->amount)) == EXIT_FAILURE) {
-                    trader_send_nack(newTrader);
-                }
-                Free(payloadp);
-
-                BRS_STATUS_INFO *status = Malloc(sizeof(BRS_STATUS_INFO));
-                memset(status, 0, sizeof(BRS_STATUS_INFO));
-                statusHelper(status, newTrader, newAccount, -1);
-                trader_send_ack(newTrader, status);
-                Free(status);
-
-            } else if(brsHeader->type == BRS_ESCROW_PKT) {
-                // Set escrow pointer to data from packet
-                BRS_ESCROW_INFO *escrowP = (BRS_ESCROW_INFO *)payloadp;
-                account_increase_inventory(newAccount, ntohl(escrowP->quantity));
-                Free(payloadp);
-
-                BRS_STATUS_INFO *status = Malloc(sizeof(BRS_STATUS_INFO));
-                memset(status, 0, sizeof(BRS_STATUS_INFO));
-                statusHelper(status, newTrader, newAccount, -1);
-                trader_send_ack(newTrader, status);
-                Free(status);
-
-            } else if(brsHeader->type == BRS_RELEASE_PKT) {
-                // Set release pointer to data from packet
-                BRS_ESCROW_INFO *releaseP = (BRS_ESCROW_INFO *)payloadp;
-                if(account_decrease_inventory(newAccount, ntohl(releaseP->quantity)) == EXIT_FAILURE) {
-                    trader_send_nack(newTrader);
-                }
-                Free(payloadp);
-
-                BRS_STATUS_INFO *status = Malloc(sizeof(BRS_STATUS_INFO));
-                memset(status, 0, sizeof(BRS_STATUS_INFO));
-                statusHelper(status, newTrader, newAccount, -1);
-                trader_send_ack(newTrader, status);
-                Free(status);
-                
-            } else if(brsHeader->type == BRS_BUY_PKT) {
-                // Set buy pointer to data from packet
-                BRS_ORDER_INFO *buyP = (BRS_ORDER_INFO *)payloadp;
-                quantity_t quant = ntohl(buyP->quantity);
-                funds_t price = ntohl(buyP->price);
-                orderid_t buyId = exchange_post_buy(exchange, newTrader, quant, price);
-                Free(payloadp);
-
-                BRS_STATUS_INFO *status = Malloc(sizeof(BRS_STATUS_INFO));
-                memset(status, 0, sizeof(BRS_STATUS_INFO));
-                statusHelper(status, newTrader, newAccount, buyId);
-
-                // If buyId > 0 (successful), send ACK packet
-                if(buyId > 0) trader_send_ack(newTrader, status);
-                else  trader_send_nack(newTrader);
-                Free(status);
-
-            } else if(brsHeader->type == BRS_SELL_PKT) {
-                // Set sell pointer to data from packet
-                BRS_ORDER_INFO *sellP = (BRS_ORDER_INFO *)payloadp;
-                quantity_t quant = ntohl(sellP->quantity);
-                funds_t price = ntohl(sellP->price);
-                orderid_t sellId = exchange_post_sell(exchange, newTrader, quant, price);
-                Free(payloadp);
-
-                BRS_STATUS_INFO *status = Malloc(sizeof(BRS_STATUS_INFO));
-                memset(status, 0, sizeof(BRS_STATUS_INFO));
-                statusHelper(status, newTrader, newAccount, sellId);
-
-                // If sellId > 0 (successful), send ACK packet
-                if(sellId > 0) trader_send_ack(newTrader, status);
-                else  trader_send_nack(newTrader);
-                Free(status);
-                
-            } else if(brsHeader->type == BRS_CANCEL_PKT) {
-                // Set cancel pointer to data from packet
-                BRS_CANCEL_INFO *cancelP = (BRS_CANCEL_INFO *)payloadp;
-                orderid_t cancelId = ntohl(cancelP->order);
-                quantity_t *quant = Malloc(sizeof(quantity_t));
-                memset(quant, 0, sizeof(quantity_t));
-                int isCanceled = exchange_cancel(exchange, newTrader, cancelId, quant);
-                Free(payloadp);
-
-                BRS_STATUS_INFO *status = Malloc(sizeof(BRS_STATUS_INFO));
-                memset(status, 0, sizeof(BRS_STATUS_INFO));
-                
-                // Set the balance, inventory, and quantity for status
-                status->quantity = htonl(*quant);
-                status->inventory = htonl(newAccount->inventory);
-                status->balance = htonl(newAccount->balance);
-                status->orderid = htonl(cancelId);
-
-                // Create new info pointer for calling exchange_get_status()
-                BRS_STATUS_INFO *infoP = Malloc(sizeof(BRS_STATUS_INFO));
-                memset(infoP, 0, sizeof(BRS_STATUS_INFO));
-                exchange_get_status(exchange, newAccount, infoP);
-                
-                // Set infoP data to statusP
-                if(infoP != NULL) {
-                    status->bid = infoP->bid;
-                    status->ask = infoP->ask;
-                    status->last = infoP->last;
-                }
-
-                // Free info pointer as it is no longer being used
-                Free(infoP);
-
-                // If isCanceled > 0 (successful), send ACK packet
-                if(isCanceled == EXIT_SUCCESS) trader_send_ack(newTrader, status);
-                else  trader_send_nack(newTrader);
-
-                Free(status);
+        BRS_STATUS_EXT_INFO *status = Malloc(sizeof(BRS_STATUS_EXT_INFO));
+        memset(status, 0, sizeof(BRS_STATUS_EXT_INFO));
+        statusHelper(status, newTrader, newAccount, firstId);
+
+        // If isQuoted is EXIT_SUCCESS, send ACK packet
+        if(isQuoted == EXIT_SUCCESS) trader_send_status(newTrader, status);
+        else  trader_send_nack(newTrader);
+        Free(status);
+
+    } else if(brsHeader->type == BRS_DEPTH_PKT) {
+        // The exchange sends the snapshot as the ACK, or nothing if the request is not valid
+        BRS_DEPTH_REQ_INFO *depthP = (BRS_DEPTH_REQ_INFO *)payloadp;
+        int isSent = EXIT_FAILURE;
+        if(ntohs(brsHeader->size) >= sizeof(BRS_DEPTH_REQ_INFO)) {
+            isSent = exchange_depth(exchange, newTrader, ntohl(depthP->levels), ntohl(depthP->subscribe));
+        }
+        if(isSent != EXIT_SUCCESS) trader_send_nack(newTrader);
+
+    } else if(brsHeader->type == BRS_SUBSCRIBE_PKT) {
+        // Replace the market-data classes the trader receives
+        BRS_SUBSCRIBE_INFO *subscribeP = (BRS_SUBSCRIBE_INFO *)payloadp;
+        if(ntohs(brsHeader->size) >= sizeof(BRS_SUBSCRIBE_INFO)) {
+            trader_set_feeds(newTrader, BRS_FEED_ALL, ntohl(subscribeP->feeds));
+            trader_send_ack(newTrader, NULL);
+        } else trader_send_nack(newTrader);
+
+    } else if(brsHeader->type == BRS_STATS_PKT) {
+        // The bars are copied without the exchange lock, so the request never waits for the matchmaker
+        BRS_STATS_REQ_INFO *statsP = (BRS_STATS_REQ_INFO *)payloadp;
+        size_t size = 0;
+        if(ntohs(brsHeader->size) >= sizeof(BRS_STATS_REQ_INFO) && ntohl(statsP->count) >= 1 &&
+           ntohl(statsP->count) <= BRS_MAX_BARS) {
+            int count = ntohl(statsP->count);
+            BRS_STATS_INFO *info = Malloc(sizeof(BRS_STATS_INFO) + count * sizeof(BRS_BAR_INFO));
+            size = stats_bars(&exchange->stats, ntohl(statsP->interval), count, info);
+            if(size > 0) {
+                BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+                memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+                newPkt->type = BRS_ACK_PKT;
+                newPkt->size = htons(size);
+                trader_send_packet(newTrader, newPkt, info);
+                Free(newPkt);
             }
-        } else cli_send_nack(fileDesc);        
+            Free(info);
+        }
+        if(size == 0) trader_send_nack(newTrader);
+    }
+
+    // Free the payload, whichever request it came with
+    if(payloadp != NULL) Free(payloadp);
+}
+
+void brs_session_close(BRS_SESSION *session) {
+    // No more checks, before the connection is closed and its descriptor can be reused
+    if(idleTimeout != 0 || heartbeatInterval != 0) timer_cancel(&session->idleTimer);
+
+    // Stop sending to the closed connection, then cancel the trader's resting
+    // orders before the trader slot is released
+    TRADER *newTrader = session->trader;
+    if(newTrader != NULL) {
+        pthread_mutex_lock(&newTrader->mLock);
+        newTrader->fileDesc = -1;
+        newTrader->sink = NULL;
+        pthread_mutex_unlock(&newTrader->mLock);
+
+        // Requests still queued for the sequencer are dropped
+        if(input_sched_active()) input_drop(newTrader);
+
+        quantity_t quant = 0;
+        exchange_cancel_all(exchange, newTrader, &quant);
     }
 
-    // Free header as it is no longer being used and unregister clients
+    // Log the trader out and unregister the client, which closes the connection
     if(newTrader != NULL) trader_logout(newTrader);
-    creg_unregister(client_registry, fileDesc);
-    free(brsHeader);
-    return NULL;
-}
\ No newline at end of file
+    outq_fini(&session->out);
+    creg_unregister(client_registry, session->fileDesc);
+    session->trader = NULL;
+    session->account = NULL;
+}
@@ -0,0 +1,158 @@
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "shm_feed.h"
+#include "csapp.h"
+#include "debug.h"
+
+static SHM_FEED *feed = NULL;     // Segment being published, NULL if disabled
+static char *feedName = NULL;     // Name of the segment, for shm_unlink()
+
+static uint64_t feed_now(void) {
+    struct timespec currTime;
+    timespec_get(&currTime, TIME_UTC);
+    return (uint64_t)currTime.tv_sec * 1000000000 + currTime.tv_nsec;
+}
+
+int shm_feed_init(char *name) {
+    // Create the segment, never one another server may be publishing, and size it for the feed
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0) return EXIT_FAILURE;
+    if(ftruncate(fd, sizeof(SHM_FEED)) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return EXIT_FAILURE;
+    }
+
+    // Map it, the descriptor is not needed once mapped
+    void *addr = mmap(NULL, sizeof(SHM_FEED), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        shm_unlink(name);
+        return EXIT_FAILURE;
+    }
+
+    // Readers check the magic number last, after everything else is in place
+    feed = addr;
+    feed->ringSize = SHM_FEED_RING;
+    feedName = Malloc(strlen(name) + 1);
+    strcpy(feedName, name);
+    atomic_thread_fence(memory_order_release);
+    feed->magic = SHM_FEED_MAGIC;
+    debug("Publishing market data to %s", name);
+    return EXIT_SUCCESS;
+}
+
+void shm_feed_fini(void) {
+    if(feed == NULL) return;
+
+    // Unmap and remove the segment, readers keep their mapping until they close it
+    munmap(feed, sizeof(SHM_FEED));
+    shm_unlink(feedName);
+    Free(feedName);
+    feed = NULL;
+    feedName = NULL;
+}
+
+void shm_feed_quote(funds_t bid, funds_t ask, funds_t last) {
+    if(feed == NULL) return;
+    SHM_QUOTE *quote = &feed->quote;
+
+    // Skip the update if nothing a reader can see has changed
+    if(quote->bid == bid && quote->ask == ask && quote->last == last) return;
+
+    // Make the sequence odd, write, and make it even again
+    uint64_t seq = atomic_load_explicit(&quote->seq, memory_order_relaxed);
+    atomic_store_explicit(&quote->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    quote->timestamp = feed_now();
+    quote->bid = bid;
+    quote->ask = ask;
+    quote->last = last;
+    atomic_store_explicit(&quote->seq, seq + 2, memory_order_release);
+}
+
+void shm_feed_trade(orderid_t buyer, orderid_t seller, quantity_t quantity, funds_t price) {
+    if(feed == NULL) return;
+
+    // Trade n goes into slot n % SHM_FEED_RING
+    uint64_t n = atomic_load_explicit(&feed->numTrades, memory_order_relaxed) + 1;
+    SHM_TRADE *trade = &feed->trades[n & (SHM_FEED_RING - 1)];
+
+    // Mark the slot as being written, fill it in, then mark it as trade n
+    atomic_store_explicit(&trade->seq, 2 * n - 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    trade->timestamp = feed_now();
+    trade->buyer = buyer;
+    trade->seller = seller;
+    trade->quantity = quantity;
+    trade->price = price;
+    atomic_store_explicit(&trade->seq, 2 * n, memory_order_release);
+    atomic_store_explicit(&feed->numTrades, n, memory_order_release);
+}
+
+SHM_FEED *shm_feed_open(char *name) {
+    // Map the segment read-only
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) return NULL;
+    void *addr = mmap(NULL, sizeof(SHM_FEED), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) return NULL;
+
+    // Refuse a segment that is not (yet) a feed of the expected shape
+    SHM_FEED *mapped = addr;
+    if(mapped->magic != SHM_FEED_MAGIC || mapped->ringSize != SHM_FEED_RING) {
+        munmap(addr, sizeof(SHM_FEED));
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    return mapped;
+}
+
+void shm_feed_close(SHM_FEED *mapped) {
+    munmap(mapped, sizeof(SHM_FEED));
+}
+
+uint64_t shm_feed_read_quote(SHM_FEED *mapped, SHM_QUOTE *quotep) {
+    SHM_QUOTE *quote = &mapped->quote;
+    uint64_t before, after;
+
+    // Retry until the copy was not overlapped by a write
+    do {
+        before = atomic_load_explicit(&quote->seq, memory_order_acquire);
+        quotep->timestamp = quote->timestamp;
+        quotep->bid = quote->bid;
+        quotep->ask = quote->ask;
+        quotep->last = quote->last;
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&quote->seq, memory_order_relaxed);
+    } while((before & 1) || before != after);
+
+    atomic_store_explicit(&quotep->seq, before, memory_order_relaxed);
+    return before;
+}
+
+int shm_feed_read_trade(SHM_FEED *mapped, uint64_t n, SHM_TRADE *tradep) {
+    SHM_TRADE *trade = &mapped->trades[n & (SHM_FEED_RING - 1)];
+
+    // The slot holds trade n once its sequence is exactly 2n, anything
+    // lower is an older trade or trade n still being written
+    uint64_t before = atomic_load_explicit(&trade->seq, memory_order_acquire);
+    if(before < 2 * n) return 1;
+    if(before > 2 * n) return -1;
+
+    tradep->timestamp = trade->timestamp;
+    tradep->buyer = trade->buyer;
+    tradep->seller = trade->seller;
+    tradep->quantity = trade->quantity;
+    tradep->price = trade->price;
+
+    // The writer may have lapped the reader while the slot was copied
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t after = atomic_load_explicit(&trade->seq, memory_order_relaxed);
+    if(after != before) return -1;
+    atomic_store_explicit(&tradep->seq, before, memory_order_relaxed);
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include <time.h>
+
+#include "timer_wheel.h"
+#include "csapp.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_DELTA ((1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+static uint64_t clock_ms(void) {
+    struct timespec currTime;
+    clock_gettime(CLOCK_MONOTONIC, &currTime);
+    return (uint64_t)currTime.tv_sec * 1000 + currTime.tv_nsec / 1000000;
+}
+
+static void list_init(TIMER *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(TIMER *head, TIMER *timer) {
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(TIMER *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// Move every timer of one list to the end of another
+static void list_splice(TIMER *from, TIMER *to) {
+    if(from->next == from) return;
+    from->next->prev = to->prev;
+    from->prev->next = to;
+    to->prev->next = from->next;
+    to->prev = from->prev;
+    list_init(from);
+}
+
+// Link a timer into the slot matching its remaining time, the lock must be held
+static void wheel_place(TIMER_WHEEL *wheel, TIMER *timer) {
+    uint64_t expires = timer->expires;
+    if(expires < wheel->currTick) expires = wheel->currTick;
+    uint64_t delta = expires - wheel->currTick;
+    if(delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expires = wheel->currTick + MAX_DELTA;
+    }
+
+    // The lowest level whose span covers the remaining time
+    int level = 0;
+    while(level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_SLOT_BITS * (level + 1)))) level++;
+    int slot = (expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+    list_append(&wheel->slots[level][slot], timer);
+}
+
+// Place the timers of a slot again, now that they are closer to expiring
+static void wheel_cascade(TIMER_WHEEL *wheel, int level, int slot) {
+    TIMER moving;
+    list_init(&moving);
+    list_splice(&wheel->slots[level][slot], &moving);
+    while(moving.next != &moving) {
+        TIMER *timer = moving.next;
+        list_unlink(timer);
+        wheel_place(wheel, timer);
+    }
+}
+
+// Expire the timers of the current tick, the lock must be held
+static void wheel_tick(TIMER_WHEEL *wheel) {
+    int slot = wheel->currTick & SLOT_MASK;
+
+    // When a level wraps around, the next slot of the level above comes due
+    if(slot == 0) {
+        for(int level = 1; level < TIMER_LEVELS; level++) {
+            int upper = (wheel->currTick >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+            wheel_cascade(wheel, level, upper);
+            if(upper != 0) break;
+        }
+    }
+
+    // Run the expired timers one at a time, so each can still be canceled until it runs
+    list_splice(&wheel->slots[0][slot], &wheel->expiring);
+    wheel->currTick++;
+    while(wheel->expiring.next != &wheel->expiring) {
+        TIMER *timer = wheel->expiring.next;
+        list_unlink(timer);
+        wheel->numPending--;
+        wheel->running = timer;
+        wheel->runner = pthread_self();
+        pthread_mutex_unlock(&wheel->lock);
+        timer->func(timer);
+        pthread_mutex_lock(&wheel->lock);
+        wheel->running = NULL;
+        pthread_cond_broadcast(&wheel->doneCond);
+    }
+}
+
+static void *wheel_thread(void *arg) {
+    TIMER_WHEEL *wheel = arg;
+    Pthread_detach(pthread_self());
+
+    // Tick on a fixed schedule, catching up if the thread fell behind
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while(1) {
+        next.tv_nsec = next.tv_nsec + TIMER_TICK_MS * 1000000L;
+        if(next.tv_nsec >= 1000000000L) {
+            next.tv_sec = next.tv_sec + 1;
+            next.tv_nsec = next.tv_nsec - 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        timer_wheel_advance(wheel, timer_now(wheel));
+    }
+
+    return NULL;
+}
+
+void timer_wheel_init(TIMER_WHEEL *wheel) {
+    pthread_mutex_init(&wheel->lock, NULL);
+    pthread_cond_init(&wheel->doneCond, NULL);
+    for(int level = 0; level < TIMER_LEVELS; level++) {
+        for(int slot = 0; slot < TIMER_SLOTS; slot++) list_init(&wheel->slots[level][slot]);
+    }
+    list_init(&wheel->expiring);
+    wheel->currTick = 0;
+    wheel->startTime = clock_ms();
+    wheel->numPending = 0;
+    wheel->running = NULL;
+}
+
+void timer_wheel_start(TIMER_WHEEL *wheel) {
+    timer_wheel_init(wheel);
+    pthread_t tid;
+    Pthread_create(&tid, NULL, wheel_thread, wheel);
+}
+
+uint64_t timer_now(TIMER_WHEEL *wheel) {
+    return clock_ms() - wheel->startTime;
+}
+
+void timer_wheel_advance(TIMER_WHEEL *wheel, uint64_t nowMs) {
+    pthread_mutex_lock(&wheel->lock);
+    uint64_t target = nowMs / TIMER_TICK_MS;
+
+    // An empty wheel skips straight to the time reached
+    if(wheel->numPending == 0 && wheel->currTick <= target) wheel->currTick = target + 1;
+    while(wheel->currTick <= target) wheel_tick(wheel);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_init(TIMER *timer, TIMER_WHEEL *wheel, TIMER_FUNC func, void *arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->wheel = wheel;
+    timer->func = func;
+    timer->arg = arg;
+}
+
+// Set a timer's tick and link it, replacing any earlier deadline, the lock must be held
+static void timer_place(TIMER_WHEEL *wheel, TIMER *timer, uint64_t expires) {
+    if(timer->next != NULL) list_unlink(timer);
+    else wheel->numPending++;
+    timer->expires = expires;
+    wheel_place(wheel, timer);
+}
+
+void timer_add(TIMER *timer, uint64_t delayMs) {
+    // Counted from the next tick to be processed, so the timer never expires early
+    TIMER_WHEEL *wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->lock);
+    timer_place(wheel, timer, wheel->currTick + (delayMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_add_at(TIMER *timer, uint64_t whenMs) {
+    TIMER_WHEEL *wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->lock);
+    timer_place(wheel, timer, (whenMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+int timer_cancel(TIMER *timer) {
+    TIMER_WHEEL *wheel = timer->wheel;
+    pthread_mutex_lock(&wheel->lock);
+    int pending = (timer->next != NULL);
+    if(pending) {
+        list_unlink(timer);
+        wheel->numPending--;
+    }
+
+    // A timer function canceling its own timer must not wait for itself
+    while(wheel->running == timer && !pthread_equal(pthread_self(), wheel->runner)) {
+        pthread_cond_wait(&wheel->doneCond, &wheel->lock);
+    }
+
+    // The function may have added the timer again before returning
+    if(timer->next != NULL) {
+        list_unlink(timer);
+        wheel->numPending--;
+        pending = 1;
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    return pending;
+}
@@ -0,0 +1,168 @@
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trade_tape.h"
+#include "csapp.h"
+#include "debug.h"
+
+static TAPE_HEADER *tape = NULL;  // Mapping being recorded into, NULL if disabled
+static int tapeFd = -1;           // The file, kept open to extend it
+static size_t tapeSize = 0;       // Size of the mapping and of the file
+
+static uint64_t tape_now(void) {
+    struct timespec currTime;
+    timespec_get(&currTime, TIME_UTC);
+    return (uint64_t)currTime.tv_sec * 1000000000 + currTime.tv_nsec;
+}
+
+static size_t tape_size(uint64_t numRecords) {
+    return sizeof(TAPE_HEADER) + numRecords * sizeof(TAPE_RECORD);
+}
+
+// Copy a username into a record field, cut short and NUL-padded
+static void tape_name(char *field, char *name) {
+    size_t len = strnlen(name, TAPE_NAME_LEN);
+    memcpy(field, name, len);
+    memset(field + len, 0, TAPE_NAME_LEN - len);
+}
+
+// Extend the file by TAPE_GROWTH records and map all of it, -1 if it cannot be
+static int tape_grow(void) {
+    uint64_t capacity = (tape == NULL) ? 0 : tape->capacity;
+    if(tape == NULL) {
+        struct stat st;
+        if(fstat(tapeFd, &st) < 0) return -1;
+        if((size_t)st.st_size >= sizeof(TAPE_HEADER)) capacity = (st.st_size - sizeof(TAPE_HEADER)) / sizeof(TAPE_RECORD);
+    }
+    capacity = capacity + TAPE_GROWTH;
+    size_t size = tape_size(capacity);
+    if(ftruncate(tapeFd, size) < 0) return -1;
+
+    // The pages already written stay in the page cache, so mapping the file again only costs the mapping
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, tapeFd, 0);
+    if(addr == MAP_FAILED) return -1;
+    if(tape != NULL) munmap(tape, tapeSize);
+    tape = addr;
+    tapeSize = size;
+    tape->capacity = capacity;
+    return 0;
+}
+
+int tape_init(char *path) {
+    tapeFd = open(path, O_CREAT | O_RDWR, 0644);
+    if(tapeFd < 0) return EXIT_FAILURE;
+
+    // A file that is not empty has to be a tape already, and is left alone otherwise
+    struct stat st;
+    TAPE_HEADER header;
+    int isTape = (fstat(tapeFd, &st) == 0);
+    if(isTape && st.st_size > 0) {
+        isTape = (pread(tapeFd, &header, sizeof(TAPE_HEADER), 0) == sizeof(TAPE_HEADER) &&
+                  header.magic == TAPE_MAGIC && header.recordSize == sizeof(TAPE_RECORD));
+    }
+
+    // Map the file with room ahead
+    if(!isTape || tape_grow() < 0) {
+        close(tapeFd);
+        tapeFd = -1;
+        return EXIT_FAILURE;
+    }
+
+    // Readers check the magic number last, after everything else is in place
+    if(st.st_size == 0) {
+        tape->recordSize = sizeof(TAPE_RECORD);
+        atomic_thread_fence(memory_order_release);
+        tape->magic = TAPE_MAGIC;
+    }
+    debug("Recording trades to %s after %lu", path, atomic_load(&tape->numRecords));
+    return EXIT_SUCCESS;
+}
+
+void tape_fini(void) {
+    if(tape == NULL) return;
+
+    // Write the records back, then give up the room that was never used
+    uint64_t numRecords = atomic_load(&tape->numRecords);
+    tape->capacity = numRecords;
+    msync(tape, tapeSize, MS_SYNC);
+    munmap(tape, tapeSize);
+    if(ftruncate(tapeFd, tape_size(numRecords)) < 0) debug("Tape left at full size");
+    close(tapeFd);
+    tape = NULL;
+    tapeFd = -1;
+    tapeSize = 0;
+}
+
+void tape_trade(orderid_t buyOrder, orderid_t sellOrder, char *buyer, char *seller,
+                quantity_t quantity, funds_t price) {
+    if(tape == NULL) return;
+
+    // A full tape is extended, and recording stops if that fails
+    uint64_t n = atomic_load_explicit(&tape->numRecords, memory_order_relaxed);
+    if(n == tape->capacity && tape_grow() < 0) {
+        debug("Unable to extend the tape, no longer recording");
+        tape_fini();
+        return;
+    }
+
+    // Fill the record in, then count it
+    TAPE_RECORD *record = (TAPE_RECORD *)(tape + 1) + n;
+    record->timestamp = tape_now();
+    record->buyOrder = buyOrder;
+    record->sellOrder = sellOrder;
+    record->quantity = quantity;
+    record->price = price;
+    tape_name(record->buyer, buyer);
+    tape_name(record->seller, seller);
+    atomic_store_explicit(&tape->numRecords, n + 1, memory_order_release);
+}
+
+int tape_open(char *path, TAPE *tapep) {
+    // Map the file read-only
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return EXIT_FAILURE;
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TAPE_HEADER)) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) return EXIT_FAILURE;
+
+    // Refuse a file that is not (yet) a tape of the expected shape
+    TAPE_HEADER *header = addr;
+    if(header->magic != TAPE_MAGIC || header->recordSize != sizeof(TAPE_RECORD)) {
+        munmap(addr, st.st_size);
+        return EXIT_FAILURE;
+    }
+
+    // Only the records that fit in the mapping, the writer may have added more since
+    uint64_t numRecords = atomic_load_explicit(&header->numRecords, memory_order_acquire);
+    uint64_t mapped = (st.st_size - sizeof(TAPE_HEADER)) / sizeof(TAPE_RECORD);
+    tapep->header = header;
+    tapep->records = (TAPE_RECORD *)(header + 1);
+    tapep->numRecords = (numRecords < mapped) ? numRecords : mapped;
+    tapep->size = st.st_size;
+    return EXIT_SUCCESS;
+}
+
+void tape_close(TAPE *tapep) {
+    munmap(tapep->header, tapep->size);
+    tapep->header = NULL;
+    tapep->records = NULL;
+    tapep->numRecords = 0;
+}
+
+uint64_t tape_seek(TAPE *tapep, uint64_t timestamp) {
+    uint64_t low = 0, high = tapep->numRecords;
+    while(low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if(tapep->records[mid].timestamp < timestamp) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
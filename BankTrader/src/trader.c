@@ -1,4 +1,5 @@
 #include <string.h>
+#include <poll.h>
 
 #include "trader.h"
 #include "protocol.h"
@@ -7,102 +8,315 @@
 #include "structs.h"
 #include "csapp.h"
 
+// The server's accounts and traders
+MARKET defaultMarket;
+
+// Index of the CONFLATED class among the feeds
+#define CONFLATED_FEED 4
+
+// Market-data class of a notification, -1 for those every trader gets
+static int feed_of(uint8_t type) {
+    switch(type) {
+        case BRS_POSTED_PKT: case BRS_QUOTED_PKT: return 0;
+        case BRS_CANCEL_PKT: case BRS_CANCELED_PKT: case BRS_MASS_CANCELED_PKT: return 1;
+        case BRS_TRADED_PKT: case BRS_UNCROSSED_PKT: return 2;
+        case BRS_DEPTH_UPDATE_PKT: return 3;
+        default: return -1;
+    }
+}
+
+// Send a packet to a trader's connection or hand it to its sink, the trader's lock must be held
+static int deliver(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
+    if(trader->sink != NULL) return trader->sink(trader, pkt, data, trader->sinkArg);
+    if(trader->fileDesc == -1) return EXIT_SUCCESS;
+    return proto_send_packet(trader->fileDesc, pkt, data);
+}
+
+// Send a CONFLATED subscriber what it has not been sent yet, if its connection can take it
+// without waiting (a trader without one always can), otherwise check again on the next tick; the market's
+// traLock must be held
+static void conflate_flush(TRADER *trader) {
+    MARKET *market = trader->market;
+    CONFLATION *conflation = &trader->conflation;
+    if((trader->fileDesc == -1 && trader->sink == NULL) || conflation->deferred) return;
+    if(conflation->trades == 0 && conflation->quoteVersion == market->topVersion) return;
+    struct pollfd pfd = {trader->fileDesc, POLLOUT, 0};
+    if(trader->fileDesc != -1 && (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT))) {
+        if(!market->conflateStarted) timer_wheel_start(&market->conflateWheel);
+        market->conflateStarted = 1;
+        conflation->deferred = 1;
+        timer_add(&conflation->retry, TIMER_TICK_MS);
+        return;
+    }
+
+    BRS_CONFLATED_INFO info;
+    memset(&info, 0, sizeof(BRS_CONFLATED_INFO));
+    info.bid = htonl(market->topBid);
+    info.ask = htonl(market->topAsk);
+    info.last = htonl(market->topLast);
+    info.trades = htonl(conflation->trades);
+    info.volume = htonl(conflation->volume);
+    info.high = htonl(conflation->high);
+    info.low = htonl(conflation->low);
+    info.vwap = htonl(conflation->volume > 0 ? conflation->notional / conflation->volume : 0);
+    BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+    memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+    newPkt->type = BRS_CONFLATED_PKT;
+    newPkt->size = htons(sizeof(BRS_CONFLATED_INFO));
+    trader_send_packet(trader, newPkt, &info);
+    Free(newPkt);
+
+    // Start over from what was just sent
+    conflation->quoteVersion = market->topVersion;
+    conflation->trades = 0;
+    conflation->volume = 0;
+    conflation->notional = 0;
+    conflation->high = 0;
+    conflation->low = 0;
+}
+
+// Timer function of a deferred CONFLATED send
+static void conflate_retry(TIMER *timer) {
+    TRADER *trader = timer->arg;
+    pthread_mutex_lock(&trader->market->traLock);
+    trader->conflation.deferred = 0;
+    if(trader->feeds & BRS_FEED_CONFLATED) conflate_flush(trader);
+    pthread_mutex_unlock(&trader->market->traLock);
+}
+
+// Add a trade (or an uncross) to the summary of each CONFLATED subscriber, the market's traLock
+// must be held
+static void conflate_trade(MARKET *market, BRS_NOTIFY_INFO *notify) {
+    quantity_t quantity = ntohl(notify->quantity);
+    funds_t price = ntohl(notify->price);
+    for(int i = 0; i < market->numFeedSubscribers[CONFLATED_FEED]; i++) {
+        TRADER *trader = market->feedSubscribers[CONFLATED_FEED][i];
+        CONFLATION *conflation = &trader->conflation;
+        conflation->trades = conflation->trades + 1;
+        conflation->volume = conflation->volume + quantity;
+        conflation->notional = conflation->notional + (uint64_t)quantity * price;
+        if(price > conflation->high) conflation->high = price;
+        if(conflation->low == 0 || price < conflation->low) conflation->low = price;
+        conflate_flush(trader);
+    }
+}
+
+// Add a trader to or remove it from the subscriber lists of the classes in mask, the market's
+// traLock must be held
+static void feeds_change(TRADER *trader, uint32_t mask, uint32_t feeds) {
+    MARKET *market = trader->market;
+    int *numFeedSubscribers = market->numFeedSubscribers;
+    TRADER ***feedSubscribers = market->feedSubscribers;
+    for(int f = 0; f < NUM_FEEDS; f++) {
+        uint32_t bit = 1u << f;
+        if(!(mask & bit) || (trader->feeds & bit) == (feeds & bit)) continue;
+        if(feeds & bit) {
+            trader->feedSlots[f] = numFeedSubscribers[f];
+            feedSubscribers[f][numFeedSubscribers[f]] = trader;
+            numFeedSubscribers[f] = numFeedSubscribers[f] + 1;
+        } else {
+            // The last subscriber takes the place of the one leaving
+            numFeedSubscribers[f] = numFeedSubscribers[f] - 1;
+            TRADER *last = feedSubscribers[f][numFeedSubscribers[f]];
+            feedSubscribers[f][trader->feedSlots[f]] = last;
+            last->feedSlots[f] = trader->feedSlots[f];
+        }
+        trader->feeds = trader->feeds ^ bit;
+
+        // A new CONFLATED subscriber starts with the top of book as it is
+        if(f == CONFLATED_FEED && (feeds & bit)) {
+            if(trader->conflation.retry.wheel == NULL) timer_init(&trader->conflation.retry, &market->conflateWheel,
+                                                                  conflate_retry, trader);
+            conflate_flush(trader);
+        }
+    }
+}
+
 int traders_init(void) {
+    // The server's traders, as many as there can be
+    return market_traders_init(&defaultMarket, MAX_TRADERS);
+}
+
+void traders_fini(void) {
+    market_traders_fini(&defaultMarket);
+}
+
+int market_traders_init(MARKET *market, int maxTraders) {
     // Initializing all traders
-    for(int i = 0; i < MAX_TRADERS; i++) {
-        allTraders[i].fileDesc = -1;
-        allTraders[i].refCount = 0;
-        allTraders[i].username = NULL;
-        allTraders[i].currAccount = NULL;
-        pthread_mutexattr_init(&allTraders[i].attr);
-        pthread_mutexattr_settype(&allTraders[i].attr, PTHREAD_MUTEX_RECURSIVE);
-        pthread_mutex_init(&allTraders[i].mLock, NULL);
+    market->traders = Malloc(maxTraders * sizeof(TRADER));
+    market->maxTraders = maxTraders;
+    for(int i = 0; i < maxTraders; i++) {
+        TRADER *trader = &market->traders[i];
+        trader->fileDesc = -1;
+        trader->sink = NULL;
+        trader->sinkArg = NULL;
+        trader->market = market;
+        trader->refCount = 0;
+        trader->username = NULL;
+        trader->currAccount = NULL;
+        trader->orders = NULL;
+        trader->numOrders = 0;
+        trader->feeds = 0;
+        trader->conflation.retry.wheel = NULL;
+        pthread_mutexattr_init(&trader->attr);
+        pthread_mutexattr_settype(&trader->attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&trader->mLock, NULL);
     }
 
+    // No one is subscribed to market data yet, and the top of book is empty
+    for(int f = 0; f < NUM_FEEDS; f++) {
+        market->feedSubscribers[f] = Malloc(maxTraders * sizeof(TRADER *));
+        market->numFeedSubscribers[f] = 0;
+    }
+    market->topBid = 0;
+    market->topAsk = 0;
+    market->topLast = 0;
+    market->topVersion = 1;
+    market->conflateStarted = 0;
+
     // Initialize trader list mutex
-    pthread_mutex_init(&allTraLock, NULL);
+    pthread_mutex_init(&market->traLock, NULL);
 
     return EXIT_SUCCESS;
 }
 
-void traders_fini(void) {
+void market_traders_fini(MARKET *market) {
     // Finalizing all traders
-    for(int i = 0; i < MAX_TRADERS; i++) {
-        allTraders[i].fileDesc = -1;
-        allTraders[i].refCount = 0;
-        if(allTraders[i].username != NULL) Free(allTraders[i].username);
-        allTraders[i].currAccount = NULL;
-        pthread_mutex_destroy(&allTraders[i].mLock);
+    for(int i = 0; i < market->maxTraders; i++) {
+        if(market->traders[i].username != NULL) Free(market->traders[i].username);
+        pthread_mutex_destroy(&market->traders[i].mLock);
     }
+    for(int f = 0; f < NUM_FEEDS; f++) Free(market->feedSubscribers[f]);
+    Free(market->traders);
+    market->traders = NULL;
+    market->maxTraders = 0;
 
     // Destroy list lock
-    pthread_mutex_destroy(&allTraLock);
+    pthread_mutex_destroy(&market->traLock);
 }
 
-TRADER *trader_login(int fd, char *name) {
+int market_init(MARKET *market, int maxTraders) {
+    if(maxTraders < 1 || maxTraders > MAX_TRADERS) return EXIT_FAILURE;
+    market_accounts_init(market, maxTraders);
+    return market_traders_init(market, maxTraders);
+}
+
+void market_fini(MARKET *market) {
+    market_traders_fini(market);
+    market_accounts_fini(market);
+}
+
+// Log a trader in to a market, with a connection or a sink
+static TRADER *login(MARKET *market, int fd, char *name, TRADER_SINK sink, void *arg) {
     // Lock trader list
-    pthread_mutex_lock(&allTraLock);
+    pthread_mutex_lock(&market->traLock);
+
+    // Find trader with same name and fd (a trader with a sink is never found)
+    for(int i = 0; sink == NULL && i < market->maxTraders; i++) {
+        TRADER *trader = &market->traders[i];
 
-    // Find trader with same name and fd
-    for(int i = 0; i < MAX_TRADERS; i++) {
         // If username is NULL, then continue since strcmp would cause an error
-        if(allTraders[i].username == NULL) continue;
+        if(trader->username == NULL || trader->sink != NULL) continue;
 
         // If username is not NULL and has the same file descriptor, return the trader
-        if(!strcmp(allTraders[i].username, name) && allTraders[i].fileDesc == fd) {
-            pthread_mutex_unlock(&allTraLock);
-            return &allTraders[i];
+        if(!strcmp(trader->username, name) && trader->fileDesc == fd) {
+            pthread_mutex_unlock(&market->traLock);
+            return trader;
         }
     }
 
     // No trader was found, so login and set first NULL spot to trader
-    for(int i = 0; i < MAX_TRADERS; i++) {
-        if(allTraders[i].username == NULL) {
-            // Call account lookup, if it does not have it in system, it will be created
-            account_lookup(name);
+    for(int i = 0; i < market->maxTraders; i++) {
+        TRADER *trader = &market->traders[i];
+        if(trader->username == NULL) {
+            // Find the account, if it does not have it in system, it will be created
+            if(market_account(market, name) == NULL) break;
 
             // Set all necessary components for trader
-            allTraders[i].fileDesc = fd;
-            allTraders[i].refCount = 0;
+            trader->fileDesc = fd;
+            trader->sink = sink;
+            trader->sinkArg = arg;
+            trader->refCount = 0;
+            trader->orders = NULL;
+            trader->numOrders = 0;
+            rate_limit_trader_init(&trader->bucket);
+            trader->throttled = 0;
+            trader->inputHead = NULL;
+            trader->inputTail = NULL;
+            trader->numInput = 0;
+            trader->deficit = 0;
+            trader->activeNext = NULL;
+            trader->activePrev = NULL;
+            trader->feeds = 0;
+            memset(&trader->conflation, 0, sizeof(CONFLATION));
+            trader->sequenced = 0;
 
             // Malloc space for username
             int nameLength = strlen(name) + 1;
-            allTraders[i].username = Malloc(nameLength);
-            memset(allTraders[i].username, 0, nameLength);
-            strcpy(allTraders[i].username, name);
+            trader->username = Malloc(nameLength);
+            memset(trader->username, 0, nameLength);
+            strcpy(trader->username, name);
+
+            // Set account attribute in trader to corresponding account, then subscribe it
+            trader->currAccount = trader_get_account(trader);
+            feeds_change(trader, BRS_FEED_ALL, BRS_FEED_DEFAULT);
 
-            // Set account attribute in trader to corresponding account
-            allTraders[i].currAccount = trader_get_account(&allTraders[i]);
-    
             // Mutex already initialized, so return trader
-            pthread_mutex_unlock(&allTraLock);
-            return &allTraders[i];
+            pthread_mutex_unlock(&market->traLock);
+            return trader;
         }
     }
-    pthread_mutex_unlock(&allTraLock);
+    pthread_mutex_unlock(&market->traLock);
     return NULL;
 }
 
+TRADER *trader_login(int fd, char *name) {
+    return login(&defaultMarket, fd, name, NULL, NULL);
+}
+
+TRADER *market_login(MARKET *market, char *name, TRADER_SINK sink, void *arg) {
+    return login(market, -1, name, sink, arg);
+}
+
+TRADER *trader_login_conn(int fd, char *name, TRADER_SINK sink, void *arg) {
+    return login(&defaultMarket, fd, name, sink, arg);
+}
+
 void trader_logout(TRADER *trader) {
+    MARKET *market = trader->market;
+
+    // Remove the reference to the trader (takes the locks itself)
+    trader_unref(trader, "logout");
+
+    // Stop the market data, then wait out a CONFLATED send in progress, which takes the list lock
+    pthread_mutex_lock(&market->traLock);
+    feeds_change(trader, BRS_FEED_ALL, 0);
+    pthread_mutex_unlock(&market->traLock);
+    if(trader->conflation.retry.wheel != NULL) timer_cancel(&trader->conflation.retry);
+
     // Lock the trader mutex to change the file descriptor and name
-    pthread_mutex_lock(&allTraLock);
+    pthread_mutex_lock(&market->traLock);
     pthread_mutex_lock(&trader->mLock);
 
-    // Remove the reference to the trader, change file descriptor to -1 and username to NULL
-    trader_unref(trader, "logout");
+    // Change file descriptor to -1 and username to NULL
+    // The trader's orders were canceled beforehand, so no order points at this slot anymore
     trader->fileDesc = -1;
+    trader->sink = NULL;
+    trader->sinkArg = NULL;
+    if(trader->username != NULL) Free(trader->username);
     trader->username = NULL;
     trader->refCount = 0;
+    trader->orders = NULL;
+    trader->numOrders = 0;
 
     // Unlock the trader mutex
     pthread_mutex_unlock(&trader->mLock);
-    pthread_mutex_unlock(&allTraLock);
-    Free(trader);
+    pthread_mutex_unlock(&market->traLock);
 }
 
 TRADER *trader_ref(TRADER *trader, char *why) {
     // Lock the trader mutex to change the count
-    pthread_mutex_lock(&allTraLock);
+    pthread_mutex_lock(&trader->market->traLock);
     pthread_mutex_lock(&trader->mLock);
 
     // Change the refCount
@@ -110,14 +324,14 @@ TRADER *trader_ref(TRADER *trader, char *why) {
 
     // Unlock the trader mutex
     pthread_mutex_unlock(&trader->mLock);
-    pthread_mutex_unlock(&allTraLock);
+    pthread_mutex_unlock(&trader->market->traLock);
 
     return trader;
 }
 
 void trader_unref(TRADER *trader, char *why) {
     // Lock mutex, to change components
-    pthread_mutex_lock(&allTraLock);
+    pthread_mutex_lock(&trader->market->traLock);
     pthread_mutex_lock(&trader->mLock);
 
     // Change count and file descriptor
@@ -125,12 +339,14 @@ void trader_unref(TRADER *trader, char *why) {
 
     // Unlock the trader mutex
     pthread_mutex_unlock(&trader->mLock);
-    pthread_mutex_unlock(&allTraLock);
+    pthread_mutex_unlock(&trader->market->traLock);
 }
 
 ACCOUNT *trader_get_account(TRADER *trader) {
-    for(int i = 0; i < MAX_ACCOUNTS; i++) {
-        if(!strcmp(trader->username, allAccounts[i].username)) return &allAccounts[i];
+    MARKET *market = trader->market;
+    for(int i = 0; i < market->maxAccounts; i++) {
+        ACCOUNT *account = &market->accounts[i];
+        if(account->username != NULL && !strcmp(trader->username, account->username)) return account;
     }
 
     return NULL;
@@ -141,7 +357,7 @@ int trader_send_packet(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
     pthread_mutex_lock(&trader->mLock);
 
     // Send the packet
-    proto_send_packet(trader->fileDesc, pkt, data);
+    deliver(trader, pkt, data);
 
     // Unlock the trader mutex
     pthread_mutex_unlock(&trader->mLock);
@@ -150,20 +366,117 @@ int trader_send_packet(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data) {
 }
 
 int trader_broadcast_packet(BRS_PACKET_HEADER *pkt, void *data) {
+    return market_broadcast(&defaultMarket, pkt, data);
+}
+
+int market_broadcast(MARKET *market, BRS_PACKET_HEADER *pkt, void *data) {
     // Lock the list
-    pthread_mutex_lock(&allTraLock);
+    pthread_mutex_lock(&market->traLock);
+
+    // Market data goes only to the subscribers of its class
+    int feed = feed_of(pkt->type);
+    if(feed >= 0) {
+        for(int i = 0; i < market->numFeedSubscribers[feed]; i++) {
+            TRADER *trader = market->feedSubscribers[feed][i];
+            if(trader->fileDesc != -1 || trader->sink != NULL) trader_send_packet(trader, pkt, data);
+        }
+        if(feed == 2) conflate_trade(market, (BRS_NOTIFY_INFO *)data);
+        pthread_mutex_unlock(&market->traLock);
+        return EXIT_SUCCESS;
+    }
 
-    // Send packet to all traders with a non-negative file descriptor
-    for(int i = 0; i < MAX_TRADERS; i++) {
-        if(allTraders[i].fileDesc != -1 && allTraders[i].username != NULL) trader_send_packet(&allTraders[i], pkt, data);
+    // Send packet to all logged-in traders with a connection or a sink
+    for(int i = 0; i < market->maxTraders; i++) {
+        TRADER *trader = &market->traders[i];
+        if((trader->fileDesc != -1 || trader->sink != NULL) && trader->username != NULL) {
+            trader_send_packet(trader, pkt, data);
+        }
     }
 
     // Unlock the list
-    pthread_mutex_unlock(&allTraLock);
+    pthread_mutex_unlock(&market->traLock);
 
     return EXIT_SUCCESS;
 }
 
+void market_conflate_quote(MARKET *market, funds_t bid, funds_t ask, funds_t last) {
+    pthread_mutex_lock(&market->traLock);
+    if(bid != market->topBid || ask != market->topAsk || last != market->topLast) {
+        market->topBid = bid;
+        market->topAsk = ask;
+        market->topLast = last;
+        market->topVersion = market->topVersion + 1;
+        for(int i = 0; i < market->numFeedSubscribers[CONFLATED_FEED]; i++) {
+            conflate_flush(market->feedSubscribers[CONFLATED_FEED][i]);
+        }
+    }
+    pthread_mutex_unlock(&market->traLock);
+}
+
+int trader_send_notice(TRADER *trader, BRS_PACKET_HEADER *pkt, BRS_NOTIFY_INFO *notify) {
+    // Numbered and sent under the ring lock, so a replay in progress is never overtaken
+    REPLAY_RING *ring = &trader->currAccount->replay;
+    pthread_mutex_lock(&ring->lock);
+    ring->lastSeq = ring->lastSeq + 1;
+    REPLAY_ENTRY *entry = &ring->entries[ring->lastSeq % BRS_REPLAY_SLOTS];
+    entry->seq = ring->lastSeq;
+    entry->type = pkt->type;
+    entry->notify = *notify;
+
+    // Only a resumed session knows the longer payload
+    int status;
+    if(trader->sequenced) {
+        BRS_PACKET_HEADER seqPkt = *pkt;
+        BRS_NOTIFY_SEQ_INFO info;
+        info.notify = *notify;
+        info.seq = htonl(entry->seq);
+        seqPkt.size = htons(sizeof(BRS_NOTIFY_SEQ_INFO));
+        status = trader_send_packet(trader, &seqPkt, &info);
+    } else status = trader_send_packet(trader, pkt, notify);
+    pthread_mutex_unlock(&ring->lock);
+    return status;
+}
+
+int trader_resume(TRADER *trader, uint32_t lastSeq) {
+    REPLAY_RING *ring = &trader->currAccount->replay;
+    pthread_mutex_lock(&ring->lock);
+    trader->sequenced = 1;
+
+    // The ACK tells the client what is kept, so it knows whether anything is lost
+    uint32_t firstSeq = (ring->lastSeq > BRS_REPLAY_SLOTS) ? ring->lastSeq - BRS_REPLAY_SLOTS + 1 :
+                        (ring->lastSeq > 0) ? 1 : 0;
+    BRS_RESUME_INFO resume;
+    resume.first_seq = htonl(firstSeq);
+    resume.last_seq = htonl(ring->lastSeq);
+    BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+    memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+    newPkt->type = BRS_ACK_PKT;
+    newPkt->size = htons(sizeof(BRS_RESUME_INFO));
+    int status = trader_send_packet(trader, newPkt, &resume);
+
+    // Then every kept notification after the last one the client saw, nothing if it saw them all
+    uint32_t seq = (lastSeq + 1 > firstSeq) ? lastSeq + 1 : firstSeq;
+    for(; lastSeq != 0 && firstSeq != 0 && seq <= ring->lastSeq && status == EXIT_SUCCESS; seq++) {
+        REPLAY_ENTRY *entry = &ring->entries[seq % BRS_REPLAY_SLOTS];
+        BRS_NOTIFY_SEQ_INFO info;
+        info.notify = entry->notify;
+        info.seq = htonl(entry->seq);
+        memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+        newPkt->type = entry->type;
+        newPkt->size = htons(sizeof(BRS_NOTIFY_SEQ_INFO));
+        status = trader_send_packet(trader, newPkt, &info);
+    }
+    Free(newPkt);
+    pthread_mutex_unlock(&ring->lock);
+    return status;
+}
+
+void trader_set_feeds(TRADER *trader, uint32_t mask, uint32_t feeds) {
+    pthread_mutex_lock(&trader->market->traLock);
+    feeds_change(trader, mask & BRS_FEED_ALL, feeds);
+    pthread_mutex_unlock(&trader->market->traLock);
+}
+
 int trader_send_ack(TRADER *trader, BRS_STATUS_INFO *info) {
     // Create new packet, allocate space for it, set type to ack, and size to info->size
     BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
@@ -171,21 +484,34 @@ int trader_send_ack(TRADER *trader, BRS_STATUS_INFO *info) {
     if(newPkt == NULL) return EXIT_FAILURE;
 
     // Lock the trader mutex to get contents
-    pthread_mutex_lock(&allTraLock);
+    pthread_mutex_lock(&trader->market->traLock);
     pthread_mutex_lock(&trader->mLock);
 
     newPkt->type = BRS_ACK_PKT;
-    newPkt->size = sizeof(BRS_ACK_PKT);
+    newPkt->size = (info != NULL) ? htons(sizeof(BRS_STATUS_INFO)) : 0;
     
-    // Send packet using trader file descriptor, newPkt variable, and info (could be NULL or not)
-    proto_send_packet(trader->fileDesc, newPkt, info);
+    // Send packet to the trader, with info (could be NULL or not)
+    deliver(trader, newPkt, info);
 
     // Free newPkt as it is no longer being used, then return EXIT_SUCCESS
     Free(newPkt);
 
     // Unlock the trader mutex to get contents
     pthread_mutex_unlock(&trader->mLock);
-    pthread_mutex_unlock(&allTraLock);
+    pthread_mutex_unlock(&trader->market->traLock);
+    return EXIT_SUCCESS;
+}
+
+int trader_send_status(TRADER *trader, BRS_STATUS_EXT_INFO *info) {
+    // Create new ACK packet carrying the status followed by the ledger
+    BRS_PACKET_HEADER *newPkt = Malloc(sizeof(BRS_PACKET_HEADER));
+    memset(newPkt, 0, sizeof(BRS_PACKET_HEADER));
+    newPkt->type = BRS_ACK_PKT;
+    newPkt->size = htons(sizeof(BRS_STATUS_EXT_INFO));
+
+    // Send the packet while holding the trader, then free it
+    trader_send_packet(trader, newPkt, info);
+    Free(newPkt);
     return EXIT_SUCCESS;
 }
 
@@ -196,20 +522,20 @@ int trader_send_nack(TRADER *trader) {
     if(newPkt == NULL) return EXIT_FAILURE;
 
     // Lock the trader mutex to get contents
-    pthread_mutex_lock(&allTraLock);
+    pthread_mutex_lock(&trader->market->traLock);
     pthread_mutex_lock(&trader->mLock);
     
     newPkt->type = BRS_NACK_PKT;
     newPkt->size = 0;
     
-    // Send packet using trader file descriptor, newPkt variable, NULL since NACK has no payload
-    proto_send_packet(trader->fileDesc, newPkt, NULL);
+    // Send packet to the trader, NULL since NACK has no payload
+    deliver(trader, newPkt, NULL);
 
     // Free newPkt as it is no longer being used, then return EXIT_SUCCESS
     Free(newPkt);
 
     // Unlock the trader mutex to get contents
     pthread_mutex_unlock(&trader->mLock);
-    pthread_mutex_unlock(&allTraLock);
+    pthread_mutex_unlock(&trader->market->traLock);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
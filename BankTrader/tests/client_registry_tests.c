@@ -0,0 +1,129 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "client_registry.h"
+#include "structs.h"
+
+#define CHURN_THREADS 32
+#define CHURN_ROUNDS 2000
+
+static CLIENT_REGISTRY *registry;
+
+/*
+ * Thread that repeatedly connects a socket pair, registers one end,
+ * and unregisters it again, as a session thread would.
+ */
+static void *churn_thread(void *arg) {
+    long failures = 0;
+    for(int i = 0; i < CHURN_ROUNDS; i++) {
+        int sv[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            failures++;
+            continue;
+        }
+        if(creg_register(registry, sv[0]) != 0) failures++;
+        if(creg_count(registry) <= 0) failures++;
+        if(creg_unregister(registry, sv[0]) != 0) failures++;
+        close(sv[1]);
+    }
+    return (void *)failures;
+}
+
+Test(client_registry_suite, churn, .timeout = 60) {
+    registry = creg_init();
+    cr_assert_not_null(registry);
+
+    pthread_t tids[CHURN_THREADS];
+    for(int i = 0; i < CHURN_THREADS; i++) pthread_create(&tids[i], NULL, churn_thread, NULL);
+    for(int i = 0; i < CHURN_THREADS; i++) {
+        void *failures;
+        pthread_join(tids[i], &failures);
+        cr_assert_eq((long)failures, 0, "Thread %d had %ld failed operations", i, (long)failures);
+    }
+
+    cr_assert_eq(creg_count(registry), 0);
+    cr_assert_eq(creg_total(registry), CHURN_THREADS * CHURN_ROUNDS);
+    creg_wait_for_empty(registry);
+    creg_fini(registry);
+}
+
+Test(client_registry_suite, double_register, .timeout = 5) {
+    registry = creg_init();
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    cr_assert_eq(creg_register(registry, sv[0]), 0);
+    cr_assert_neq(creg_register(registry, sv[0]), 0, "Descriptor registered twice");
+    cr_assert_eq(creg_unregister(registry, sv[0]), 0);
+    cr_assert_neq(creg_unregister(registry, sv[0]), 0, "Descriptor unregistered twice");
+    cr_assert_eq(creg_count(registry), 0);
+
+    close(sv[1]);
+    creg_fini(registry);
+}
+
+Test(client_registry_suite, beyond_fd_setsize, .timeout = 5) {
+    // Raise the descriptor limit enough for a descriptor well past FD_SETSIZE
+    struct rlimit fdLimit;
+    getrlimit(RLIMIT_NOFILE, &fdLimit);
+    int highFd = 4 * FD_SETSIZE;
+    if(fdLimit.rlim_max <= highFd) return;
+    if(fdLimit.rlim_cur <= highFd) {
+        fdLimit.rlim_cur = highFd + 1;
+        cr_assert_eq(setrlimit(RLIMIT_NOFILE, &fdLimit), 0);
+    }
+
+    registry = creg_init();
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    cr_assert_eq(dup2(sv[0], highFd), highFd);
+    close(sv[0]);
+
+    cr_assert_eq(creg_register(registry, highFd), 0);
+    cr_assert_eq(creg_count(registry), 1);
+    cr_assert_eq(creg_unregister(registry, highFd), 0);
+    cr_assert_eq(creg_count(registry), 0);
+
+    close(sv[1]);
+    creg_fini(registry);
+}
+
+/*
+ * Thread that waits for its connection to be shut down, then unregisters it.
+ */
+static void *session_thread(void *arg) {
+    int fd = (int)(long)arg;
+    char c;
+    while(read(fd, &c, 1) > 0) continue;
+    creg_unregister(registry, fd);
+    return NULL;
+}
+
+Test(client_registry_suite, shutdown_all, .timeout = 10) {
+    registry = creg_init();
+    int peers[CHURN_THREADS];
+    pthread_t tids[CHURN_THREADS];
+    for(int i = 0; i < CHURN_THREADS; i++) {
+        int sv[2];
+        cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        cr_assert_eq(creg_register(registry, sv[0]), 0);
+        peers[i] = sv[1];
+        pthread_create(&tids[i], NULL, session_thread, (void *)(long)sv[0]);
+    }
+    cr_assert_eq(creg_count(registry), CHURN_THREADS);
+
+    // Every session should see end of file and unregister itself
+    creg_shutdown_all(registry);
+    creg_wait_for_empty(registry);
+    cr_assert_eq(creg_count(registry), 0);
+
+    for(int i = 0; i < CHURN_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+        close(peers[i]);
+    }
+    creg_fini(registry);
+}
@@ -0,0 +1,59 @@
+#include <criterion/criterion.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "trader.h"
+#include "account.h"
+#include "structs.h"
+
+#define NUM_TRADES 20000
+
+/*
+ * A CONFLATED subscriber that reads nothing while many trades are made
+ * gets far fewer packets than trades once it reads, and together they
+ * still account for every trade.  The last of them is sent by the retry
+ * timer once the connection has room again.
+ */
+Test(conflation_suite, slow_reader, .timeout = 30) {
+    accounts_init();
+    traders_init();
+    int pair[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0, "No socket pair");
+    int size = 4096;
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    TRADER *trader = trader_login(pair[0], "slow");
+    trader_set_feeds(trader, BRS_FEED_ALL, BRS_FEED_CONFLATED);
+
+    BRS_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = BRS_TRADED_PKT;
+    hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
+    BRS_NOTIFY_INFO notify;
+    memset(&notify, 0, sizeof(notify));
+    notify.quantity = htonl(2);
+    for(int i = 0; i < NUM_TRADES; i++) {
+        notify.price = htonl(100 + i % 5);
+        trader_broadcast_packet(&hdr, &notify);
+    }
+
+    // Read until every trade is accounted for
+    int numPackets = 0;
+    uint64_t trades = 0, volume = 0;
+    BRS_CONFLATED_INFO last;
+    while(trades < NUM_TRADES) {
+        BRS_PACKET_HEADER recvHdr;
+        void *payload = NULL;
+        cr_assert_eq(proto_recv_packet(pair[1], &recvHdr, &payload), 0, "Connection failed");
+        cr_assert_eq(recvHdr.type, BRS_CONFLATED_PKT, "Packet of type %u", recvHdr.type);
+        last = *(BRS_CONFLATED_INFO *)payload;
+        trades = trades + ntohl(last.trades);
+        volume = volume + ntohl(last.volume);
+        numPackets++;
+        free(payload);
+    }
+    cr_assert_eq(trades, NUM_TRADES, "%lu trades were summarized", trades);
+    cr_assert_eq(volume, 2 * NUM_TRADES, "Volume of %lu was summarized", volume);
+    cr_assert_lt(numPackets, NUM_TRADES / 10, "%d packets for %d trades", numPackets, NUM_TRADES);
+    cr_assert_eq(ntohl(last.high), 104, "High of %u", ntohl(last.high));
+    cr_assert_eq(ntohl(last.low), 100, "Low of %u", ntohl(last.low));
+}
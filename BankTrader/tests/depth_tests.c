@@ -0,0 +1,107 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "test_helpers.h"
+
+static EXCHANGE *xchg;
+static TRADER *alice, *bob, *carol;
+
+static void setup(void) {
+    xchg = fixture_exchange();
+    alice = fixture_trader("alice", 0, 100);
+    bob = fixture_trader("bob", 0, 100);
+    carol = fixture_trader("carol", 10000, 0);
+}
+
+static void assert_level(BRS_LEVEL_INFO *level, funds_t price, quantity_t quantity, uint32_t orders) {
+    cr_assert_eq(ntohl(level->price), price, "Level at %u instead of %u", ntohl(level->price), price);
+    cr_assert_eq(ntohl(level->quantity), quantity, "Level at %u shows %u instead of %u", price,
+                 ntohl(level->quantity), quantity);
+    cr_assert_eq(ntohl(level->orders), orders, "Level at %u has %u orders instead of %u", price,
+                 ntohl(level->orders), orders);
+}
+
+/*
+ * Orders at the same price are added up, an iceberg order counts only its
+ * tip, and a fill leaves the level with what is shown after the tip is
+ * refreshed.
+ */
+Test(depth_suite, aggregates_levels, .timeout = 10, .init = setup) {
+    ORDER_TERMS terms;
+    memset(&terms, 0, sizeof(terms));
+    terms.displaySize = 3;
+    cr_assert_neq(exchange_post_terms(xchg, alice, 10, 100, 0, &terms), 0, "Iceberg ask was refused");
+    cr_assert_neq(exchange_post_order(xchg, bob, 2, 100, 0, 0), 0, "Ask was refused");
+    cr_assert_neq(exchange_post_order(xchg, bob, 4, 105, 0, 0), 0, "Ask was refused");
+    cr_assert_neq(exchange_post_order(xchg, carol, 5, 90, 1, 0), 0, "Bid was refused");
+
+    BRS_DEPTH_INFO *info = malloc(sizeof(BRS_DEPTH_INFO) + 4 * sizeof(BRS_LEVEL_INFO));
+    pthread_mutex_lock(&xchg->mLock);
+    size_t size = depth_snapshot(&xchg->depth, 2, info);
+    cr_assert_eq(size, sizeof(BRS_DEPTH_INFO) + 3 * sizeof(BRS_LEVEL_INFO), "Snapshot has size %zu", size);
+    cr_assert_eq(ntohl(info->num_bids), 1, "Snapshot has %u bid levels", ntohl(info->num_bids));
+    cr_assert_eq(ntohl(info->num_asks), 2, "Snapshot has %u ask levels", ntohl(info->num_asks));
+    assert_level(&info->levels[0], 90, 5, 1);
+    assert_level(&info->levels[1], 100, 5, 2);
+    assert_level(&info->levels[2], 105, 4, 1);
+    pthread_mutex_unlock(&xchg->mLock);
+
+    // Carol takes the tip and one of Bob's two, then a new tip of 3 is shown
+    cr_assert_neq(exchange_post_order(xchg, carol, 4, 100, 1, 0), 0, "Bid was refused");
+    pthread_mutex_lock(&xchg->mLock);
+    exchange_match(xchg);
+    depth_snapshot(&xchg->depth, 1, info);
+    cr_assert_eq(xchg->depth.numChanges, 0, "Changes were not flushed");
+    assert_level(&info->levels[0], 90, 5, 1);
+    assert_level(&info->levels[1], 100, 4, 2);
+    pthread_mutex_unlock(&xchg->mLock);
+    free(info);
+}
+
+static BRS_DEPTH_INFO updates[2];
+static BRS_LEVEL_INFO updateLevels[2][4];
+static int numUpdates;
+
+static int capture(BRS_PACKET_HEADER *pkt, void *data, void *arg) {
+    BRS_DEPTH_INFO *info = data;
+    int count = ntohl(info->num_bids) + ntohl(info->num_asks);
+    cr_assert_eq(pkt->type, BRS_DEPTH_UPDATE_PKT, "Update has type %u", pkt->type);
+    cr_assert(numUpdates < 2 && count <= 4, "Unexpected update");
+    updates[numUpdates] = *info;
+    memcpy(updateLevels[numUpdates], info->levels, count * sizeof(BRS_LEVEL_INFO));
+    numUpdates++;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A flush reports each changed level once with its final state, bids first,
+ * a level that lost its last order with quantity 0, and numbers each update.
+ */
+Test(depth_suite, flush_coalesces, .timeout = 10) {
+    BOOK_DEPTH depth;
+    depth_init(&depth);
+    numUpdates = 0;
+    depth_update(&depth, 0, 101, 5, 1);
+    depth_update(&depth, 1, 99, 2, 1);
+    depth_update(&depth, 0, 101, 3, 1);
+    depth_update(&depth, 0, 102, 7, 1);
+    depth_flush(&depth, capture, NULL);
+    depth_update(&depth, 0, 101, -5, -1);
+    depth_update(&depth, 0, 102, -7, -1);
+    depth_flush(&depth, capture, NULL);
+    depth_flush(&depth, capture, NULL);
+
+    cr_assert_eq(numUpdates, 2, "%d updates were flushed", numUpdates);
+    cr_assert_eq(ntohl(updates[0].seq), 1, "First update has sequence number %u", ntohl(updates[0].seq));
+    cr_assert_eq(ntohl(updates[0].num_bids), 1, "First update has %u bids", ntohl(updates[0].num_bids));
+    cr_assert_eq(ntohl(updates[0].num_asks), 2, "First update has %u asks", ntohl(updates[0].num_asks));
+    assert_level(&updateLevels[0][0], 99, 2, 1);
+    assert_level(&updateLevels[0][1], 101, 8, 2);
+    assert_level(&updateLevels[0][2], 102, 7, 1);
+    cr_assert_eq(ntohl(updates[1].seq), 2, "Second update has sequence number %u", ntohl(updates[1].seq));
+    cr_assert_eq(ntohl(updates[1].num_asks), 2, "Second update has %u asks", ntohl(updates[1].num_asks));
+    assert_level(&updateLevels[1][0], 101, 3, 1);
+    assert_level(&updateLevels[1][1], 102, 0, 0);
+    cr_assert_eq(depth.asks.numLevels, 1, "Empty ask level was not dropped");
+    depth_fini(&depth);
+}
@@ -0,0 +1,62 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "test_helpers.h"
+
+static EXCHANGE *xchg;
+static TRADER *alice, *bob, *carol;
+static orderid_t icebergId, plainId;
+
+/*
+ * Alice rests an iceberg ask of 10 showing 3 at a time, Bob a plain ask of
+ * 2 behind it at the same price, then Carol buys 4 at that price.
+ */
+static void setup(void) {
+    xchg = fixture_exchange();
+    alice = fixture_trader("alice", 0, 100);
+    bob = fixture_trader("bob", 0, 100);
+    carol = fixture_trader("carol", 10000, 0);
+
+    ORDER_TERMS terms;
+    memset(&terms, 0, sizeof(terms));
+    terms.displaySize = 3;
+    icebergId = exchange_post_terms(xchg, alice, 10, 100, 0, &terms);
+    plainId = exchange_post_order(xchg, bob, 2, 100, 0, 0);
+    cr_assert(icebergId != 0 && plainId != 0, "Asks were refused");
+    cr_assert_neq(exchange_post_order(xchg, carol, 4, 100, 1, 0), 0, "Bid was refused");
+
+    // Run a matching pass (the matchmaker may already have)
+    pthread_mutex_lock(&xchg->mLock);
+    exchange_match(xchg);
+    pthread_mutex_unlock(&xchg->mLock);
+}
+
+/*
+ * The filled tip is refreshed from the reserve under the same order id,
+ * behind Bob's ask, so Bob's ask fills next.
+ */
+Test(iceberg_suite, refresh_at_back, .timeout = 10, .init = setup) {
+    pthread_mutex_lock(&xchg->mLock);
+    ORDER *first = xchg->asks;
+    cr_assert_not_null(first, "No asks are left");
+    cr_assert_eq(first->orderid, plainId, "Order %u leads the asks instead of Bob's", first->orderid);
+    cr_assert_eq(first->quantity, 1, "Bob's ask has quantity %u", first->quantity);
+    ORDER *second = first->nextOrder;
+    cr_assert_not_null(second, "Iceberg order left the book");
+    cr_assert_eq(second->orderid, icebergId, "Iceberg order has id %u", second->orderid);
+    cr_assert_eq(second->quantity, 3, "Iceberg tip is %u", second->quantity);
+    cr_assert_eq(second->hidden, 4, "Iceberg reserve is %u", second->hidden);
+    cr_assert_null(xchg->bids, "Bid was not filled");
+    pthread_mutex_unlock(&xchg->mLock);
+}
+
+/*
+ * Canceling the iceberg order cancels the tip and the reserve, and
+ * releases the inventory held for both.
+ */
+Test(iceberg_suite, cancel_releases_reserve, .timeout = 10, .init = setup) {
+    quantity_t quantity = 0;
+    cr_assert_eq(exchange_cancel(xchg, alice, icebergId, &quantity), EXIT_SUCCESS, "Cancel failed");
+    cr_assert_eq(quantity, 7, "Canceled quantity is %u", quantity);
+    assert_ledger(alice, 3 * 100, 97, 0, 0);
+}
@@ -0,0 +1,25 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "test_helpers.h"
+
+/*
+ * An exchange that matches inline has filled and settled a crossing order
+ * by the time the post returns, without the matchmaker.
+ */
+Test(inline_suite, matched_by_post, .timeout = 10) {
+    EXCHANGE *xchg = fixture_exchange();
+    exchange_set_inline(xchg, 1);
+    TRADER *alice = fixture_trader("alice", 1000, 0);
+    TRADER *bob = fixture_trader("bob", 0, 10);
+
+    for(int i = 0; i < 5; i++) {
+        cr_assert_neq(exchange_post_order(xchg, bob, 2, 50, 0, 0), 0, "Sell order was refused");
+        cr_assert_neq(exchange_post_order(xchg, alice, 2, 50, 1, 0), 0, "Buy order was refused");
+        pthread_mutex_lock(&xchg->mLock);
+        cr_assert(xchg->bids == NULL && xchg->asks == NULL, "Orders were left on the book");
+        pthread_mutex_unlock(&xchg->mLock);
+    }
+
+    assert_ledger(alice, 500, 10, 0, 0);
+}
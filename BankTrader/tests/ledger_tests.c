@@ -0,0 +1,44 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+
+#include "test_helpers.h"
+
+/*
+ * Deposits that would take the funds of all the accounts beyond 32 bits are
+ * refused, a withdrawal makes room again, and a seller close to the limit
+ * is then credited its proceeds in full.
+ */
+Test(ledger_suite, total_funds_capped, .timeout = 10) {
+    EXCHANGE *xchg = fixture_exchange();
+    exchange_set_inline(xchg, 1);
+    TRADER *alice = fixture_trader("alice", 1000, 0);
+    TRADER *bob = fixture_trader("bob", 0, 10);
+    ACCOUNT *bobAccount = trader_get_account(bob);
+
+    cr_assert_eq(account_credit_balance(bobAccount, UINT32_MAX - 999), EXIT_FAILURE, "Deposit went over the limit");
+    cr_assert_eq(account_credit_balance(bobAccount, UINT32_MAX - 1000), EXIT_SUCCESS, "Deposit to the limit failed");
+    cr_assert_eq(account_credit_balance(bobAccount, 1), EXIT_FAILURE, "Deposit went over the limit");
+    cr_assert_eq(account_decrease_balance(bobAccount, 100), EXIT_SUCCESS, "Withdrawal failed");
+    cr_assert_eq(account_credit_balance(bobAccount, 100), EXIT_SUCCESS, "Withdrawal made no room");
+
+    cr_assert_neq(exchange_post_order(xchg, bob, 10, 100, 0, 0), 0, "Sell order was refused");
+    cr_assert_neq(exchange_post_order(xchg, alice, 10, 100, 1, 0), 0, "Buy order was refused");
+    assert_ledger(bob, UINT32_MAX, 0, 0, 0);
+    assert_ledger(alice, 0, 10, 0, 0);
+}
+
+/*
+ * A buy whose cost does not fit in 32 bits is refused rather than held
+ * for the wrapped amount, and nothing trades.
+ */
+Test(ledger_suite, wrapping_buy_refused, .timeout = 10) {
+    EXCHANGE *xchg = fixture_exchange();
+    exchange_set_inline(xchg, 1);
+    TRADER *alice = fixture_trader("alice", 100, 0);
+    TRADER *bob = fixture_trader("bob", 0, 65536);
+
+    cr_assert_neq(exchange_post_order(xchg, bob, 65536, 65536, 0, 0), 0, "Sell order was refused");
+    cr_assert_eq(exchange_post_order(xchg, alice, 65536, 65536, 1, 0), 0, "Buy order was accepted");
+    assert_ledger(alice, 100, 0, 0, 0);
+    assert_ledger(bob, 0, 0, 0, 65536);
+}
@@ -0,0 +1,65 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "exchange.h"
+#include "trader.h"
+#include "account.h"
+#include "structs.h"
+
+#define NUM_BOOKS 4
+#define NUM_TRADES 500
+
+typedef struct book {
+    MARKET market;
+    int numBought;              // BOUGHT handed to alice's sink
+    int numTraded;              // TRADED handed to bob's sink
+} BOOK;
+
+static int count_notices(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data, void *arg) {
+    BOOK *book = arg;
+    if(pkt->type == BRS_BOUGHT_PKT) book->numBought++;
+    if(pkt->type == BRS_TRADED_PKT) book->numTraded++;
+    return EXIT_SUCCESS;
+}
+
+static void *run_book(void *arg) {
+    BOOK *book = arg;
+    market_init(&book->market, 2);
+    EXCHANGE *xchg = exchange_embed(&book->market);
+    TRADER *alice = market_login(&book->market, "alice", count_notices, book);
+    TRADER *bob = market_login(&book->market, "bob", count_notices, book);
+    account_increase_balance(trader_get_account(alice), NUM_TRADES * 50);
+    account_increase_inventory(trader_get_account(bob), NUM_TRADES);
+
+    for(int i = 0; i < NUM_TRADES; i++) {
+        exchange_post_order(xchg, bob, 1, 50, 0, 0);
+        exchange_post_order(xchg, alice, 1, 50, 1, 0);
+    }
+    exchange_fini(xchg);
+    return NULL;
+}
+
+/*
+ * Embedded exchanges of markets of their own run side by side on the
+ * threads of their owners, each trader getting its notifications through
+ * its sink, and the same usernames in different markets are different
+ * accounts.
+ */
+Test(market_suite, parallel_books, .timeout = 20) {
+    static BOOK books[NUM_BOOKS];
+    pthread_t tids[NUM_BOOKS];
+    memset(books, 0, sizeof(books));
+    for(int i = 0; i < NUM_BOOKS; i++) pthread_create(&tids[i], NULL, run_book, &books[i]);
+    for(int i = 0; i < NUM_BOOKS; i++) pthread_join(tids[i], NULL);
+
+    for(int i = 0; i < NUM_BOOKS; i++) {
+        cr_assert_eq(books[i].numBought, NUM_TRADES, "Book %d sent %d BOUGHT", i, books[i].numBought);
+        cr_assert_eq(books[i].numTraded, 2 * NUM_TRADES, "Book %d sent %d TRADED", i, books[i].numTraded);
+
+        BRS_STATUS_INFO info;
+        account_get_status(market_account(&books[i].market, "alice"), &info);
+        cr_assert_eq(ntohl(info.inventory), NUM_TRADES, "Alice of book %d has inventory %u", i, ntohl(info.inventory));
+        cr_assert_eq(ntohl(info.balance), 0, "Alice of book %d has balance %u", i, ntohl(info.balance));
+        market_fini(&books[i].market);
+    }
+}
@@ -0,0 +1,79 @@
+#include <criterion/criterion.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "out_queue.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+
+#define NUM_PACKETS 50000
+
+/*
+ * Packets sent to a connection nobody reads are queued instead of waiting,
+ * and come out whole and in order once the other end reads them.
+ */
+Test(out_queue_suite, order_kept, .timeout = 30) {
+    int pair[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0, "No socket pair");
+    OUT_QUEUE queue;
+    outq_init(&queue, pair[0]);
+
+    BRS_PACKET_HEADER hdr;
+    BRS_NOTIFY_INFO notify;
+    memset(&notify, 0, sizeof(notify));
+    for(int i = 0; i < NUM_PACKETS; i++) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.type = BRS_POSTED_PKT;
+        hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
+        notify.buyer = htonl(i);
+        cr_assert_eq(outq_send(&queue, &hdr, &notify), EXIT_SUCCESS, "Packet %d was not sent", i);
+    }
+    cr_assert_gt(queue.len, 0, "Nothing was queued");
+
+    for(int i = 0; i < NUM_PACKETS; i++) {
+        void *payload = NULL;
+        cr_assert_eq(proto_recv_packet(pair[1], &hdr, &payload), 0, "Connection failed at %d", i);
+        cr_assert_eq(hdr.type, BRS_POSTED_PKT, "Packet %d of type %u", i, hdr.type);
+        cr_assert_eq(ntohl(((BRS_NOTIFY_INFO *)payload)->buyer), i, "Packet %d out of order", i);
+        free(payload);
+    }
+    outq_fini(&queue);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+/*
+ * A connection that leaves more than OUTQ_MAX_BYTES unread is shut down,
+ * and nothing more is sent to it.
+ */
+Test(out_queue_suite, slow_reader_dropped, .timeout = 30) {
+    int pair[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0, "No socket pair");
+    OUT_QUEUE queue;
+    outq_init(&queue, pair[0]);
+
+    BRS_PACKET_HEADER hdr;
+    BRS_NOTIFY_INFO notify;
+    memset(&notify, 0, sizeof(notify));
+    int status = EXIT_SUCCESS;
+    size_t sent = 0;
+    while(status == EXIT_SUCCESS && sent <= 2 * OUTQ_MAX_BYTES) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.type = BRS_POSTED_PKT;
+        hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
+        status = outq_send(&queue, &hdr, &notify);
+        sent = sent + sizeof(hdr) + sizeof(notify);
+    }
+    cr_assert_eq(status, EXIT_FAILURE, "%lu bytes were taken", sent);
+    cr_assert_eq(outq_send(&queue, &hdr, &notify), EXIT_FAILURE, "Sent after the shutdown");
+
+    // The reader sees what the connection took, then the end of the stream
+    char buf[65536];
+    ssize_t n;
+    while((n = read(pair[1], buf, sizeof(buf))) > 0);
+    cr_assert_eq(n, 0, "Connection was not shut down");
+    outq_fini(&queue);
+    close(pair[0]);
+    close(pair[1]);
+}
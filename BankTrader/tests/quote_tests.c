@@ -0,0 +1,83 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "test_helpers.h"
+
+static EXCHANGE *xchg;
+static TRADER *alice, *bob;
+
+/*
+ * Alice quotes two bids and one ask, and Bob rests a plain ask that none of
+ * them cross.  The exchange is left in call-auction mode with an interval
+ * longer than any test, so the matchmaker does not touch the book.
+ */
+static void setup(void) {
+    xchg = fixture_exchange();
+    exchange_set_auction(xchg, 1000ULL * 1000000);
+    alice = fixture_trader("alice", 1000, 10);
+    bob = fixture_trader("bob", 0, 10);
+
+    cr_assert_eq(exchange_post_order(xchg, bob, 5, 120, 0, 0), 1, "Bob's ask was refused");
+    QUOTE_LEVEL levels[] = {{4, 99}, {2, 98}, {3, 101}};
+    orderid_t firstId = 0;
+    cr_assert_eq(exchange_quote(xchg, alice, levels, 2, 1, &firstId), EXIT_SUCCESS, "Quote was refused");
+    cr_assert_eq(firstId, 2, "First quote has id %u", firstId);
+}
+
+// Nothing trades, so whatever Alice holds comes out of what she started with
+static void assert_alice(funds_t heldBalance, quantity_t heldInventory) {
+    assert_ledger(alice, 1000 - heldBalance, 10 - heldInventory, heldBalance, heldInventory);
+}
+
+/*
+ * A second quote takes the first one's orders off the book and holds only
+ * what the new levels need, leaving Bob's ask alone.
+ */
+Test(quote_suite, replaces_quotes, .timeout = 10, .init = setup) {
+    assert_alice(4 * 99 + 2 * 98, 3);
+
+    QUOTE_LEVEL levels[] = {{1, 100}, {6, 110}};
+    orderid_t firstId = 0;
+    cr_assert_eq(exchange_quote(xchg, alice, levels, 1, 1, &firstId), EXIT_SUCCESS, "Quote was refused");
+    cr_assert_eq(firstId, 5, "First quote has id %u", firstId);
+    assert_alice(100, 6);
+
+    pthread_mutex_lock(&xchg->mLock);
+    cr_assert_not_null(xchg->bids, "No bids are on the book");
+    cr_assert_eq(xchg->bids->orderid, 5, "Order %u leads the bids", xchg->bids->orderid);
+    cr_assert_null(xchg->bids->nextOrder, "Old bids are left on the book");
+    cr_assert_eq(xchg->asks->orderid, 6, "Order %u leads the asks", xchg->asks->orderid);
+    cr_assert_eq(xchg->asks->nextOrder->orderid, 1, "Bob's ask is not behind the quote");
+    cr_assert_null(xchg->asks->nextOrder->nextOrder, "Old ask is left on the book");
+    cr_assert_eq(alice->numOrders, 2, "Alice has %d orders", alice->numOrders);
+    pthread_mutex_unlock(&xchg->mLock);
+}
+
+/*
+ * A quote the account cannot cover is refused as a whole, and the quotes it
+ * would have replaced stay on the book with their holds.
+ */
+Test(quote_suite, refused_keeps_quotes, .timeout = 10, .init = setup) {
+    QUOTE_LEVEL levels[] = {{1, 100}, {11, 110}};
+    orderid_t firstId = 0;
+    cr_assert_eq(exchange_quote(xchg, alice, levels, 1, 1, &firstId), EXIT_FAILURE, "Quote was accepted");
+    assert_alice(4 * 99 + 2 * 98, 3);
+    pthread_mutex_lock(&xchg->mLock);
+    cr_assert_eq(alice->numOrders, 3, "Alice has %d orders", alice->numOrders);
+    cr_assert_eq(xchg->bids->orderid, 2, "Order %u leads the bids", xchg->bids->orderid);
+    pthread_mutex_unlock(&xchg->mLock);
+}
+
+/*
+ * A quote whose bids cost more than 32 bits can hold, one level at a time or
+ * all together, is refused instead of holding the wrapped amount.
+ */
+Test(quote_suite, refused_when_wrapping, .timeout = 10, .init = setup) {
+    QUOTE_LEVEL wideLevel[] = {{65536, 65536}};
+    orderid_t firstId = 0;
+    cr_assert_eq(exchange_quote(xchg, alice, wideLevel, 1, 0, &firstId), EXIT_FAILURE, "Wide level was accepted");
+
+    QUOTE_LEVEL wideTotal[] = {{1, 0x80000000}, {1, 0x80000000}};
+    cr_assert_eq(exchange_quote(xchg, alice, wideTotal, 2, 0, &firstId), EXIT_FAILURE, "Wide total was accepted");
+    assert_alice(4 * 99 + 2 * 98, 3);
+}
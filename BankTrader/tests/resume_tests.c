@@ -0,0 +1,93 @@
+#include <criterion/criterion.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "trader.h"
+#include "account.h"
+#include "structs.h"
+
+static void send_bought(TRADER *trader, quantity_t quantity) {
+    BRS_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = BRS_BOUGHT_PKT;
+    hdr.size = htons(sizeof(BRS_NOTIFY_INFO));
+    BRS_NOTIFY_INFO notify;
+    memset(&notify, 0, sizeof(notify));
+    notify.quantity = htonl(quantity);
+    notify.price = htonl(100);
+    trader_send_notice(trader, &hdr, &notify);
+}
+
+/*
+ * A session that lost its connection after the first of three fills is
+ * told what is kept when it logs in again, then gets the other two, with
+ * their sequence numbers, before anything new.
+ */
+Test(resume_suite, replays_missed, .timeout = 10) {
+    accounts_init();
+    traders_init();
+    int first[2], second[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, first), 0, "No socket pair");
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, second), 0, "No socket pair");
+
+    TRADER *trader = trader_login(first[0], "alice");
+    for(quantity_t q = 1; q <= 3; q++) send_bought(trader, q);
+    trader_logout(trader);
+    close(first[0]);
+    close(first[1]);
+
+    trader = trader_login(second[0], "alice");
+    cr_assert_eq(trader_resume(trader, 1), EXIT_SUCCESS, "Resume failed");
+    send_bought(trader, 4);
+
+    BRS_PACKET_HEADER hdr;
+    void *payload = NULL;
+    cr_assert_eq(proto_recv_packet(second[1], &hdr, &payload), 0, "Connection failed");
+    cr_assert_eq(hdr.type, BRS_ACK_PKT, "Packet of type %u instead of ACK", hdr.type);
+    cr_assert_eq(ntohs(hdr.size), sizeof(BRS_RESUME_INFO), "ACK of size %u", ntohs(hdr.size));
+    BRS_RESUME_INFO *resume = payload;
+    cr_assert_eq(ntohl(resume->first_seq), 1, "First kept is %u", ntohl(resume->first_seq));
+    cr_assert_eq(ntohl(resume->last_seq), 3, "Last kept is %u", ntohl(resume->last_seq));
+    free(payload);
+
+    for(uint32_t seq = 2; seq <= 4; seq++) {
+        cr_assert_eq(proto_recv_packet(second[1], &hdr, &payload), 0, "Connection failed");
+        cr_assert_eq(hdr.type, BRS_BOUGHT_PKT, "Packet of type %u instead of BOUGHT", hdr.type);
+        cr_assert_eq(ntohs(hdr.size), sizeof(BRS_NOTIFY_SEQ_INFO), "BOUGHT of size %u", ntohs(hdr.size));
+        BRS_NOTIFY_SEQ_INFO *info = payload;
+        cr_assert_eq(ntohl(info->seq), seq, "Sequence number %u instead of %u", ntohl(info->seq), seq);
+        cr_assert_eq(ntohl(info->notify.quantity), seq, "Quantity %u", ntohl(info->notify.quantity));
+        free(payload);
+    }
+}
+
+/*
+ * Once more fills than are kept were missed, the first one replayed is not
+ * the next one expected, and the ACK says so.  Everything kept is replayed
+ * before the test reads, so the connection gets room for it.
+ */
+Test(resume_suite, reports_gap, .timeout = 10) {
+    accounts_init();
+    traders_init();
+    int pair[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0, "No socket pair");
+    int size = 1 << 20;
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    TRADER *trader = trader_login(-1, "bob");
+    for(int i = 0; i < BRS_REPLAY_SLOTS + 10; i++) send_bought(trader, 1);
+    trader_logout(trader);
+
+    trader = trader_login(pair[0], "bob");
+    trader_resume(trader, 5);
+    BRS_PACKET_HEADER hdr;
+    void *payload = NULL;
+    cr_assert_eq(proto_recv_packet(pair[1], &hdr, &payload), 0, "Connection failed");
+    BRS_RESUME_INFO *resume = payload;
+    cr_assert_eq(ntohl(resume->first_seq), 11, "First kept is %u", ntohl(resume->first_seq));
+    free(payload);
+    cr_assert_eq(proto_recv_packet(pair[1], &hdr, &payload), 0, "Connection failed");
+    cr_assert_eq(ntohl(((BRS_NOTIFY_SEQ_INFO *)payload)->seq), 11, "Replay starts at %u",
+                 ntohl(((BRS_NOTIFY_SEQ_INFO *)payload)->seq));
+    free(payload);
+}
@@ -0,0 +1,69 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "bar_stats.h"
+
+static BRS_STATS_INFO *stats_info(void) {
+    return malloc(sizeof(BRS_STATS_INFO) + BRS_MAX_BARS * sizeof(BRS_BAR_INFO));
+}
+
+static void assert_bar(BRS_BAR_INFO *bar, uint32_t start, funds_t open, funds_t high, funds_t low,
+                       funds_t close, quantity_t volume, funds_t vwap) {
+    cr_assert_eq(ntohl(bar->start), start, "Bar starts at %u instead of %u", ntohl(bar->start), start);
+    cr_assert_eq(ntohl(bar->open), open, "Bar opens at %u instead of %u", ntohl(bar->open), open);
+    cr_assert_eq(ntohl(bar->high), high, "Bar high is %u instead of %u", ntohl(bar->high), high);
+    cr_assert_eq(ntohl(bar->low), low, "Bar low is %u instead of %u", ntohl(bar->low), low);
+    cr_assert_eq(ntohl(bar->close), close, "Bar closes at %u instead of %u", ntohl(bar->close), close);
+    cr_assert_eq(ntohl(bar->volume), volume, "Bar volume is %u instead of %u", ntohl(bar->volume), volume);
+    cr_assert_eq(ntohl(bar->vwap), vwap, "Bar VWAP is %u instead of %u", ntohl(bar->vwap), vwap);
+}
+
+/*
+ * Trades go into the bar of their interval, intervals without trades have
+ * no bar, and the session bar covers them all.
+ */
+Test(stats_suite, builds_bars, .timeout = 10) {
+    BAR_STATS *stats = malloc(sizeof(BAR_STATS));
+    stats_init(stats);
+    stats_trade(stats, 6000, 10, 100);
+    stats_trade(stats, 6030, 10, 110);
+    stats_trade(stats, 6059, 20, 95);
+    stats_trade(stats, 6200, 5, 120);
+
+    BRS_STATS_INFO *info = stats_info();
+    size_t size = stats_bars(stats, 60, 10, info);
+    cr_assert_eq(size, sizeof(BRS_STATS_INFO) + 2 * sizeof(BRS_BAR_INFO), "Reply has size %zu", size);
+    cr_assert_eq(ntohl(info->num_bars), 2, "%u minute bars", ntohl(info->num_bars));
+    assert_bar(&info->bars[0], 6000, 100, 110, 95, 95, 40, 100);
+    assert_bar(&info->bars[1], 6180, 120, 120, 120, 120, 5, 120);
+
+    stats_bars(stats, 0, 1, info);
+    cr_assert_eq(ntohl(info->num_bars), 1, "%u session bars", ntohl(info->num_bars));
+    assert_bar(&info->bars[0], 6000, 100, 120, 95, 120, 45, 102);
+
+    stats_bars(stats, 1, 2, info);
+    cr_assert_eq(ntohl(info->num_bars), 2, "%u second bars", ntohl(info->num_bars));
+    assert_bar(&info->bars[0], 6059, 95, 95, 95, 95, 20, 95);
+    cr_assert_eq(stats_bars(stats, 5, 1, info), 0, "Unknown interval was answered");
+    free(info);
+    free(stats);
+}
+
+/*
+ * Only the last BRS_MAX_BARS bars are kept, however many are asked for.
+ */
+Test(stats_suite, keeps_recent, .timeout = 10) {
+    BAR_STATS *stats = malloc(sizeof(BAR_STATS));
+    stats_init(stats);
+    for(int i = 0; i < 1000; i++) stats_trade(stats, 1000 + i, 1, 100 + i);
+
+    BRS_STATS_INFO *info = stats_info();
+    stats_bars(stats, 1, BRS_MAX_BARS, info);
+    cr_assert_eq(ntohl(info->num_bars), BRS_MAX_BARS, "%u bars", ntohl(info->num_bars));
+    cr_assert_eq(ntohl(info->bars[0].start), 2000 - BRS_MAX_BARS, "Oldest bar starts at %u",
+                 ntohl(info->bars[0].start));
+    cr_assert_eq(ntohl(info->bars[BRS_MAX_BARS - 1].close), 1099, "Newest bar closes at %u",
+                 ntohl(info->bars[BRS_MAX_BARS - 1].close));
+    free(info);
+    free(stats);
+}
@@ -0,0 +1,94 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "test_helpers.h"
+
+#define NUM_TRADERS 4
+
+static EXCHANGE *xchg;
+static TRADER *traders[NUM_TRADERS];
+
+static void setup(void) {
+    xchg = fixture_exchange();
+    char *names[NUM_TRADERS] = {"alice", "bob", "carol", "dave"};
+    for(int i = 0; i < NUM_TRADERS; i++) traders[i] = fixture_trader(names[i], 10000, 100);
+}
+
+// Make a trade between two traders at a price, which becomes the last trade price
+static void trade_at(TRADER *seller, TRADER *buyer, funds_t price) {
+    cr_assert_neq(exchange_post_order(xchg, seller, 1, price, 0, 0), 0, "Sell order was refused");
+    cr_assert_neq(exchange_post_order(xchg, buyer, 1, price, 1, 0), 0, "Buy order was refused");
+}
+
+// Run a matching pass (the matchmaker may already have), then hold the lock to inspect the book
+static void match(void) {
+    pthread_mutex_lock(&xchg->mLock);
+    exchange_match(xchg);
+}
+
+static orderid_t post_stop(TRADER *trader, quantity_t quantity, funds_t price, int isBuyer, funds_t stopPrice,
+                           int immediate) {
+    ORDER_TERMS terms;
+    memset(&terms, 0, sizeof(terms));
+    terms.stopPrice = stopPrice;
+    terms.immediate = immediate;
+    return exchange_post_terms(xchg, trader, quantity, price, isBuyer, &terms);
+}
+
+/*
+ * A sell stop stays off the book before the first trade and while the last
+ * price is above its stop price, and rests as a limit order once a trade
+ * reaches it.
+ */
+Test(stop_suite, waits_for_trigger, .timeout = 10, .init = setup) {
+    orderid_t stopId = post_stop(traders[0], 1, 90, 0, 95, 0);
+    cr_assert_neq(stopId, 0, "Stop order was refused");
+    match();
+    assert_order(xchg->sellStops, stopId, 1);
+    cr_assert_null(xchg->asks, "Stop is on the book before any trade");
+    pthread_mutex_unlock(&xchg->mLock);
+
+    trade_at(traders[1], traders[2], 100);
+    match();
+    assert_order(xchg->sellStops, stopId, 1);
+    cr_assert_null(xchg->asks, "Stop is on the book above its stop price");
+    pthread_mutex_unlock(&xchg->mLock);
+
+    trade_at(traders[1], traders[2], 94);
+    match();
+    cr_assert_null(xchg->sellStops, "Stop was not triggered");
+    assert_order(xchg->asks, stopId, 1);
+    pthread_mutex_unlock(&xchg->mLock);
+}
+
+/*
+ * Buy stops triggered by the same trade are activated from the lowest stop
+ * price up, whatever order they arrived in.
+ */
+Test(stop_suite, activation_order, .timeout = 10, .init = setup) {
+    orderid_t laterTrigger = post_stop(traders[0], 2, 105, 1, 102, 0);
+    orderid_t earlierTrigger = post_stop(traders[1], 2, 105, 1, 101, 0);
+    trade_at(traders[2], traders[3], 103);
+    match();
+    cr_assert_null(xchg->buyStops, "Stops were not triggered");
+    assert_order(xchg->bids, earlierTrigger, 2);
+    assert_order(xchg->bids->nextOrder, laterTrigger, 2);
+    pthread_mutex_unlock(&xchg->mLock);
+}
+
+/*
+ * A triggered stop-market sell fills what it can against the bids at or
+ * above its price, and the rest is canceled with its inventory released.
+ */
+Test(stop_suite, market_remainder_canceled, .timeout = 10, .init = setup) {
+    post_stop(traders[0], 5, 95, 0, 100, 1);
+    exchange_post_order(xchg, traders[1], 2, 98, 1, 0);
+    trade_at(traders[2], traders[3], 100);
+    match();
+    cr_assert_null(xchg->sellStops, "Stop was not triggered");
+    cr_assert_null(xchg->bids, "Bid was not filled");
+    cr_assert_null(xchg->asks, "Stop remainder rests on the book");
+    cr_assert_eq(xchg->last, 98, "Last trade price is %u", xchg->last);
+    assert_ledger(traders[0], 10000 + 2 * 98, 98, 0, 0);
+    pthread_mutex_unlock(&xchg->mLock);
+}
@@ -0,0 +1,103 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "test_helpers.h"
+
+static EXCHANGE *xchg;
+static TRADER *alice, *bob;
+
+/*
+ * Alice rests an ask, Bob rests a dearer one, then Alice sends a bid that
+ * crosses both.  The exchange is left in call-auction mode with an
+ * interval longer than any test, so the matchmaker does not touch the book
+ * and each test runs the matching pass itself.
+ */
+static void setup(void) {
+    xchg = fixture_exchange();
+    exchange_set_auction(xchg, 1000ULL * 1000000);
+    alice = fixture_trader("alice", 10000, 100);
+    bob = fixture_trader("bob", 0, 100);
+}
+
+static void cross_and_match(STP_MODE mode) {
+    exchange_set_stp(xchg, mode);
+    cr_assert_eq(exchange_post_order(xchg, alice, 10, 100, 0, 0), 1, "Alice's ask was refused");
+    cr_assert_eq(exchange_post_order(xchg, bob, 3, 101, 0, 0), 2, "Bob's ask was refused");
+    cr_assert_eq(exchange_post_order(xchg, alice, 4, 101, 1, 0), 3, "Alice's bid was refused");
+    pthread_mutex_lock(&xchg->mLock);
+    exchange_match(xchg);
+    pthread_mutex_unlock(&xchg->mLock);
+}
+
+/*
+ * The resting ask is canceled, and the incoming bid goes on to trade with
+ * Bob's ask behind it.
+ */
+Test(stp_suite, cancel_resting, .timeout = 10, .init = setup) {
+    cross_and_match(STP_CANCEL_RESTING);
+    assert_order(xchg->bids, 3, 1);
+    cr_assert_null(xchg->asks, "Asks are left on the book");
+    assert_ledger(alice, 10000 - 4 * 101, 100 + 3, 101, 0);
+    cr_assert_eq(xchg->last, 101, "Last trade price is %u", xchg->last);
+}
+
+/*
+ * The incoming bid is canceled, and both asks stay on the book.
+ */
+Test(stp_suite, cancel_incoming, .timeout = 10, .init = setup) {
+    cross_and_match(STP_CANCEL_INCOMING);
+    cr_assert_null(xchg->bids, "Bids are left on the book");
+    assert_order(xchg->asks, 1, 10);
+    assert_order(xchg->asks->nextOrder, 2, 3);
+    assert_ledger(alice, 10000, 90, 0, 10);
+}
+
+/*
+ * Both of Alice's orders are canceled, and Bob's ask is left alone.
+ */
+Test(stp_suite, cancel_both, .timeout = 10, .init = setup) {
+    cross_and_match(STP_CANCEL_BOTH);
+    cr_assert_null(xchg->bids, "Bids are left on the book");
+    assert_order(xchg->asks, 2, 3);
+    cr_assert_null(xchg->asks->nextOrder, "Alice's ask is left on the book");
+    assert_ledger(alice, 10000, 100, 0, 0);
+}
+
+/*
+ * The smaller bid is canceled in full, and the ask loses the same quantity
+ * but keeps its place at the front of the book.
+ */
+Test(stp_suite, decrement, .timeout = 10, .init = setup) {
+    cross_and_match(STP_DECREMENT);
+    cr_assert_null(xchg->bids, "Bids are left on the book");
+    assert_order(xchg->asks, 1, 6);
+    assert_order(xchg->asks->nextOrder, 2, 3);
+    assert_ledger(alice, 10000, 94, 0, 6);
+}
+
+static int count_uncrossed(TRADER *trader, BRS_PACKET_HEADER *pkt, void *data, void *arg) {
+    if(pkt->type == BRS_UNCROSSED_PKT) (*(int *)arg)++;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * An uncross where self-trade prevention takes out the only crossing pair
+ * executes nothing, so no UNCROSSED is broadcast and there is still no
+ * last trade price.
+ */
+Test(stp_suite, uncross_nothing_executed, .timeout = 10, .init = setup) {
+    int numUncrossed = 0;
+    market_login(&defaultMarket, "carol", count_uncrossed, &numUncrossed);
+    exchange_set_stp(xchg, STP_CANCEL_BOTH);
+    cr_assert_eq(exchange_post_order(xchg, alice, 5, 100, 0, 0), 1, "Alice's ask was refused");
+    cr_assert_eq(exchange_post_order(xchg, alice, 5, 100, 1, 0), 2, "Alice's bid was refused");
+    pthread_mutex_lock(&xchg->mLock);
+    exchange_uncross(xchg);
+    pthread_mutex_unlock(&xchg->mLock);
+
+    cr_assert_null(xchg->bids, "Bids are left on the book");
+    cr_assert_null(xchg->asks, "Asks are left on the book");
+    cr_assert_eq(numUncrossed, 0, "%d UNCROSSED were sent", numUncrossed);
+    cr_assert_eq(xchg->last, 0, "Last trade price is %u", xchg->last);
+    assert_ledger(alice, 10000, 100, 0, 0);
+}
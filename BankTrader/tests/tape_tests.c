@@ -0,0 +1,61 @@
+#include <criterion/criterion.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "trade_tape.h"
+
+#define TAPE_PATH "/tmp/brs_tape_test"
+
+/*
+ * Trades recorded past the first extension of the file are all read back
+ * in order, a second run appends to them, and the file is cut down to the
+ * records when the tape is closed.
+ */
+Test(tape_suite, records_and_appends, .timeout = 10) {
+    unlink(TAPE_PATH);
+    cr_assert_eq(tape_init(TAPE_PATH), EXIT_SUCCESS, "Tape was not created");
+    for(int i = 0; i < TAPE_GROWTH + 10; i++) tape_trade(2 * i + 1, 2 * i + 2, "alice", "bob", 1, 100 + i % 7);
+    tape_fini();
+    cr_assert_eq(tape_init(TAPE_PATH), EXIT_SUCCESS, "Tape was not reopened");
+    tape_trade(7, 8, "a-username-longer-than-the-record", "carol", 5, 99);
+    tape_fini();
+
+    struct stat st;
+    stat(TAPE_PATH, &st);
+    cr_assert_eq(st.st_size, sizeof(TAPE_HEADER) + (TAPE_GROWTH + 11) * sizeof(TAPE_RECORD),
+                 "Tape has size %ld", st.st_size);
+
+    TAPE tape;
+    cr_assert_eq(tape_open(TAPE_PATH, &tape), EXIT_SUCCESS, "Tape was not mapped");
+    cr_assert_eq(tape.numRecords, TAPE_GROWTH + 11, "Tape has %lu records", tape.numRecords);
+    TAPE_RECORD *record = &tape.records[TAPE_GROWTH + 5];
+    cr_assert_eq(record->buyOrder, 2 * (TAPE_GROWTH + 5) + 1, "Record has buy order %u", record->buyOrder);
+    cr_assert_eq(record->price, 100 + (TAPE_GROWTH + 5) % 7, "Record has price %u", record->price);
+    cr_assert_eq(strncmp(record->seller, "bob", TAPE_NAME_LEN), 0, "Record has seller %s", record->seller);
+    record = &tape.records[TAPE_GROWTH + 10];
+    cr_assert_eq(strncmp(record->buyer, "a-username-longer-than-the-record", TAPE_NAME_LEN), 0,
+                 "Long username was not cut short");
+    cr_assert_eq(tape_seek(&tape, record->timestamp), TAPE_GROWTH + 10, "Seek missed the last record");
+    cr_assert_eq(tape_seek(&tape, record->timestamp + 1), tape.numRecords, "Seek past the end found a record");
+    for(uint64_t i = 1; i < tape.numRecords; i++) {
+        cr_assert_geq(tape.records[i].timestamp, tape.records[i - 1].timestamp, "Record %lu is out of order", i);
+    }
+    tape_close(&tape);
+    unlink(TAPE_PATH);
+}
+
+/*
+ * A file that is not a tape is neither recorded into nor changed.
+ */
+Test(tape_suite, refuses_other_files, .timeout = 10) {
+    FILE *file = fopen(TAPE_PATH, "w");
+    fputs("not a tape\n", file);
+    fclose(file);
+    cr_assert_eq(tape_init(TAPE_PATH), EXIT_FAILURE, "Other file was taken for a tape");
+    struct stat st;
+    stat(TAPE_PATH, &st);
+    cr_assert_eq(st.st_size, 11, "Other file has size %ld", st.st_size);
+    tape_trade(1, 2, "alice", "bob", 1, 100);
+    unlink(TAPE_PATH);
+}
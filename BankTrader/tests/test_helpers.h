@@ -0,0 +1,56 @@
+#ifndef TEST_HELPERS_H
+#define TEST_HELPERS_H
+
+#include <criterion/criterion.h>
+
+#include "exchange.h"
+#include "trader.h"
+#include "account.h"
+#include "structs.h"
+
+/*
+ * Fixture and asserts shared by the exchange tests, which run against the
+ * server's market with traders that have no connection.
+ */
+
+// Start over with no accounts, no traders and a new exchange
+static inline EXCHANGE *fixture_exchange(void) {
+    accounts_init();
+    traders_init();
+    return exchange_init();
+}
+
+// Log a trader in without a connection, with funds and inventory to trade
+static inline TRADER *fixture_trader(char *name, funds_t balance, quantity_t inventory) {
+    TRADER *trader = trader_login(-1, name);
+    cr_assert_not_null(trader, "%s could not log in", name);
+    if(balance > 0) account_increase_balance(trader_get_account(trader), balance);
+    if(inventory > 0) account_increase_inventory(trader_get_account(trader), inventory);
+    return trader;
+}
+
+// The order is there with the id and the quantity shown on the book
+static inline void assert_order(ORDER *order, orderid_t orderid, quantity_t quantity) {
+    cr_assert_not_null(order, "Order %u is not on the book", orderid);
+    cr_assert_eq(order->orderid, orderid, "Order %u is there instead of order %u", order->orderid, orderid);
+    cr_assert_eq(order->quantity, quantity, "Order %u has quantity %u instead of %u", orderid, order->quantity,
+                 quantity);
+}
+
+// The trader's account has what is free to trade and what is held for its orders
+static inline void assert_ledger(TRADER *trader, funds_t balance, quantity_t inventory, funds_t heldBalance,
+                                 quantity_t heldInventory) {
+    BRS_STATUS_INFO status;
+    BRS_LEDGER_INFO ledger;
+    account_get_ledger(trader_get_account(trader), &status, &ledger);
+    cr_assert_eq(ntohl(status.balance), balance, "%s's balance is %u instead of %u", trader->username,
+                 ntohl(status.balance), balance);
+    cr_assert_eq(ntohl(status.inventory), inventory, "%s's inventory is %u instead of %u", trader->username,
+                 ntohl(status.inventory), inventory);
+    cr_assert_eq(ntohl(ledger.held_balance), heldBalance, "%s holds %u funds instead of %u", trader->username,
+                 ntohl(ledger.held_balance), heldBalance);
+    cr_assert_eq(ntohl(ledger.held_inventory), heldInventory, "%s holds %u inventory instead of %u",
+                 trader->username, ntohl(ledger.held_inventory), heldInventory);
+}
+
+#endif
@@ -0,0 +1,71 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define NUM_TIMERS 200
+
+static uint64_t firedAt[NUM_TIMERS];    // Time each timer expired at, 0 if it has not
+static uint64_t clockMs;                // Time the wheel has been advanced to
+static TIMER_WHEEL wheel;
+
+static void record(TIMER *timer) {
+    firedAt[(intptr_t)timer->arg] = clockMs;
+}
+
+// Advance the wheel one tick at a time, so expiry times are exact
+static void advance_to(uint64_t ms) {
+    while(clockMs < ms) {
+        clockMs = clockMs + TIMER_TICK_MS;
+        timer_wheel_advance(&wheel, clockMs);
+    }
+}
+
+static void setup(void) {
+    timer_wheel_init(&wheel);
+    memset(firedAt, 0, sizeof(firedAt));
+    clockMs = 0;
+}
+
+/*
+ * Timers spread over every level of the wheel each expire on the tick
+ * of their deadline, however many times they were moved down.
+ */
+Test(timer_wheel_suite, expires_on_time, .timeout = 30, .init = setup) {
+    static TIMER timers[NUM_TIMERS];
+    uint64_t delays[NUM_TIMERS];
+    for(int i = 0; i < NUM_TIMERS; i++) {
+        // Delays from one tick up to several spans of level 2
+        delays[i] = (uint64_t)TIMER_TICK_MS * (1 + (uint64_t)i * i * 37 % 900000);
+        timer_init(&timers[i], &wheel, record, (void *)(intptr_t)i);
+        timer_add(&timers[i], delays[i]);
+    }
+    advance_to(TIMER_TICK_MS * 900001ULL);
+    for(int i = 0; i < NUM_TIMERS; i++) {
+        cr_assert_eq(firedAt[i], delays[i], "Timer %d with delay %lu expired at %lu", i,
+                     (unsigned long)delays[i], (unsigned long)firedAt[i]);
+    }
+}
+
+/*
+ * A canceled timer does not expire, and adding a pending timer again
+ * replaces its deadline.
+ */
+Test(timer_wheel_suite, cancel_and_rearm, .timeout = 30, .init = setup) {
+    TIMER canceled, moved;
+    timer_init(&canceled, &wheel, record, (void *)0);
+    timer_init(&moved, &wheel, record, (void *)1);
+    timer_add(&canceled, 5000);
+    timer_add(&moved, 5000);
+
+    advance_to(1000);
+    cr_assert_eq(timer_cancel(&canceled), 1, "Pending timer was not reported as pending");
+    cr_assert_eq(timer_cancel(&canceled), 0, "Canceled timer was reported as pending");
+    timer_add(&moved, 200);
+
+    advance_to(10000);
+    cr_assert_eq(firedAt[0], 0, "Canceled timer expired at %lu", (unsigned long)firedAt[0]);
+    cr_assert(firedAt[1] >= 1200 && firedAt[1] <= 1200 + TIMER_TICK_MS, "Moved timer expired at %lu",
+              (unsigned long)firedAt[1]);
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "shm_feed.h"
+
+/*
+ * Example reader of the shared-memory market data feed.
+ *
+ * Maps the segment published by "bourse -s <name>" read-only and prints
+ * every top-of-book change and every trade.  Polling the segment makes
+ * no system calls; only printing does.
+ *
+ * Usage: md_reader [-s <shm name>] [-a]
+ *   -a  start from the oldest trade still in the ring instead of the newest
+ */
+int main(int argc, char *argv[]) {
+    char *name = SHM_FEED_NAME;
+    int fromStart = 0;
+    int option;
+    while((option = getopt(argc, argv, "s:a")) != EOF) {
+        switch(option) {
+            case 's':
+                name = optarg;
+                break;
+            case 'a':
+                fromStart = 1;
+                break;
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    SHM_FEED *feed = shm_feed_open(name);
+    if(feed == NULL) {
+        fprintf(stderr, "No market data feed at %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    // Pick the first trade to read
+    uint64_t published = atomic_load(&feed->numTrades);
+    uint64_t next = published + 1;
+    if(fromStart) next = (published > SHM_FEED_RING) ? published - SHM_FEED_RING + 1 : 1;
+
+    SHM_QUOTE quote;
+    SHM_TRADE trade;
+    uint64_t quoteSeq = 0;
+    while(1) {
+        // Print the top of book whenever its sequence moves
+        uint64_t seq = shm_feed_read_quote(feed, &quote);
+        if(seq != quoteSeq) {
+            printf("QUOTE bid %u ask %u last %u\n", quote.bid, quote.ask, quote.last);
+            fflush(stdout);
+            quoteSeq = seq;
+        }
+
+        // Print every trade published since the last poll
+        int ret;
+        while((ret = shm_feed_read_trade(feed, next, &trade)) != 1) {
+            if(ret < 0) {
+                // Lapped by the writer, skip to the oldest trade still in the ring
+                uint64_t oldest = atomic_load(&feed->numTrades) - SHM_FEED_RING + 1;
+                printf("GAP %lu trades lost\n", oldest - next);
+                next = oldest;
+                continue;
+            }
+            printf("TRADE %lu buy %u sell %u qty %u price %u\n", next,
+                   trade.buyer, trade.seller, trade.quantity, trade.price);
+            fflush(stdout);
+            next++;
+        }
+    }
+
+    shm_feed_close(feed);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exchange.h"
+#include "trader.h"
+#include "account.h"
+#include "structs.h"
+#include "trade_tape.h"
+#include "csapp.h"
+
+/*
+ * Deterministic replay of recorded order flow.
+ *
+ * Reads a file of order events, one per line, and feeds them into the
+ * exchange in order, as fast as it takes them, without a connection or a
+ * thread per trader: the exchange is embedded, in a market of its own, and
+ * the traders are logged in without a sink and subscribed to nothing, so
+ * what would have been sent to them is dropped.  Each order is matched
+ * completely by the post that places it, without a matchmaker, and the
+ * same events always give the same fills and the same accounts.
+ *
+ * The fills are recorded on a trade tape and printed once the replay is
+ * over, without their timestamps, followed by the final state of every
+ * account, so the output of two runs can be compared byte for byte.  The
+ * throughput of the replay alone, without reading the events or printing,
+ * goes to stderr.
+ *
+ * Events (prices and funds in the units of the exchange, order ids as the
+ * exchange numbers the orders, from 1):
+ *   DEPOSIT <trader> <funds>         WITHDRAW <trader> <funds>
+ *   ESCROW <trader> <quantity>       RELEASE <trader> <quantity>
+ *   BUY <trader> <quantity> <price>  SELL <trader> <quantity> <price>
+ *   CANCEL <trader> <order id>       MASS_CANCEL <trader>
+ * Blank lines and lines starting with '#' are skipped.  At most MAX_TRADERS
+ * traders can take part.
+ *
+ * Usage: replay [-q] [<event file>]   (standard input if none)
+ *   -q  print only the account states
+ */
+
+typedef enum {
+    EV_DEPOSIT, EV_WITHDRAW, EV_ESCROW, EV_RELEASE, EV_BUY, EV_SELL, EV_CANCEL, EV_MASS_CANCEL
+} EVENT_TYPE;
+
+static const char *eventNames[] = {
+    "DEPOSIT", "WITHDRAW", "ESCROW", "RELEASE", "BUY", "SELL", "CANCEL", "MASS_CANCEL"
+};
+static const int eventArgs[] = {1, 1, 1, 1, 2, 2, 1, 0};
+
+typedef struct event {
+    EVENT_TYPE type;
+    int trader;                 // Index in traders
+    uint32_t args[2];           // Amount, quantity and price, or order id
+} EVENT;
+
+static MARKET market;
+static TRADER *traders[MAX_TRADERS];
+static char *traderNames[MAX_TRADERS];
+static int numTraders = 0;
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Index of a trader, logged in the first time it is named, -1 if there are too many
+static int trader_index(char *name) {
+    for(int i = 0; i < numTraders; i++) {
+        if(!strcmp(traderNames[i], name)) return i;
+    }
+    if(numTraders == MAX_TRADERS) return -1;
+    TRADER *trader = market_login(&market, name, NULL, NULL);
+    if(trader == NULL) return -1;
+    trader_set_feeds(trader, BRS_FEED_ALL, 0);
+    traders[numTraders] = trader;
+    traderNames[numTraders] = trader->username;
+    numTraders++;
+    return numTraders - 1;
+}
+
+// Read every event before the replay, so reading is not timed with it
+static EVENT *read_events(FILE *in, size_t *numEvents) {
+    EVENT *events = NULL;
+    size_t count = 0, maxEvents = 0;
+    char line[256], type[32], name[128];
+    int lineNo = 0;
+    while(fgets(line, sizeof(line), in) != NULL) {
+        lineNo++;
+        uint32_t args[2] = {0, 0};
+        int numFields = sscanf(line, "%31s %127s %u %u", type, name, &args[0], &args[1]);
+        if(numFields <= 0 || type[0] == '#') continue;
+
+        int e = 0;
+        while(e <= EV_MASS_CANCEL && strcmp(type, eventNames[e]) != 0) e++;
+        int trader = (e <= EV_MASS_CANCEL && numFields == 2 + eventArgs[e]) ? trader_index(name) : -1;
+        if(trader < 0) {
+            fprintf(stderr, "Line %d: not a valid event, or too many traders\n", lineNo);
+            exit(EXIT_FAILURE);
+        }
+
+        if(count == maxEvents) {
+            maxEvents = (maxEvents == 0) ? 4096 : maxEvents * 2;
+            events = Realloc(events, maxEvents * sizeof(EVENT));
+        }
+        events[count].type = e;
+        events[count].trader = trader;
+        events[count].args[0] = args[0];
+        events[count].args[1] = args[1];
+        count++;
+    }
+    *numEvents = count;
+    return events;
+}
+
+static void replay_event(EXCHANGE *xchg, EVENT *event) {
+    TRADER *trader = traders[event->trader];
+    ACCOUNT *account = trader_get_account(trader);
+    quantity_t quantity;
+    switch(event->type) {
+        case EV_DEPOSIT:
+            account_increase_balance(account, event->args[0]);
+            break;
+        case EV_WITHDRAW:
+            account_decrease_balance(account, event->args[0]);
+            break;
+        case EV_ESCROW:
+            account_increase_inventory(account, event->args[0]);
+            break;
+        case EV_RELEASE:
+            account_decrease_inventory(account, event->args[0]);
+            break;
+        case EV_BUY:
+        case EV_SELL:
+            exchange_post_order(xchg, trader, event->args[0], event->args[1], event->type == EV_BUY, 0);
+            break;
+        case EV_CANCEL:
+            exchange_cancel(xchg, trader, event->args[0], &quantity);
+            break;
+        case EV_MASS_CANCEL:
+            exchange_cancel_all(xchg, trader, &quantity);
+            break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int quiet = 0;
+    int option;
+    while((option = getopt(argc, argv, "q")) != EOF) {
+        switch(option) {
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+    FILE *in = (optind < argc) ? fopen(argv[optind], "r") : stdin;
+    if(in == NULL) {
+        fprintf(stderr, "Unable to read %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    // The fills go on a tape of their own, removed once printed
+    char tapePath[] = "/tmp/replay_tapeXXXXXX";
+    int tapeFd = mkstemp(tapePath);
+    if(tapeFd < 0 || tape_init(tapePath) == EXIT_FAILURE) {
+        fprintf(stderr, "Unable to create a tape for the fills\n");
+        exit(EXIT_FAILURE);
+    }
+    close(tapeFd);
+
+    market_init(&market, MAX_TRADERS);
+    EXCHANGE *xchg = exchange_embed(&market);
+    size_t numEvents;
+    EVENT *events = read_events(in, &numEvents);
+    if(in != stdin) fclose(in);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(size_t i = 0; i < numEvents; i++) replay_event(xchg, &events[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tape_fini();
+
+    // The fills, in the order they were made
+    TAPE tape;
+    int isOpen = (tape_open(tapePath, &tape) == EXIT_SUCCESS);
+    uint64_t numFills = isOpen ? tape.numRecords : 0;
+    for(uint64_t i = 0; !quiet && i < numFills; i++) {
+        TAPE_RECORD *record = &tape.records[i];
+        printf("FILL buy %u (%.*s) sell %u (%.*s) qty %u price %u\n",
+               record->buyOrder, TAPE_NAME_LEN, record->buyer,
+               record->sellOrder, TAPE_NAME_LEN, record->seller, record->quantity, record->price);
+    }
+    if(isOpen) tape_close(&tape);
+    unlink(tapePath);
+
+    // Then every account, in the order the traders first appeared
+    for(int i = 0; i < numTraders; i++) {
+        BRS_STATUS_INFO info;
+        BRS_LEDGER_INFO ledger;
+        account_get_ledger(trader_get_account(traders[i]), &info, &ledger);
+        printf("ACCOUNT %s balance %u held %u inventory %u held %u\n", traderNames[i],
+               ntohl(info.balance), ntohl(ledger.held_balance),
+               ntohl(info.inventory), ntohl(ledger.held_inventory));
+    }
+
+    double time = elapsed(&start, &end);
+    fprintf(stderr, "%zu events, %lu fills in %.3f s: %.0f events/s, %.0f fills/s\n",
+            numEvents, numFills, time, numEvents / time, numFills / time);
+    Free(events);
+    return EXIT_SUCCESS;
+}
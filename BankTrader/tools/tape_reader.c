@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trade_tape.h"
+
+/*
+ * Query tool for the trade tape.
+ *
+ * Maps a tape recorded by "bourse -f <file>" read-only and prints the
+ * trades of a period, optionally only those of one trader, followed by
+ * their count, volume and VWAP.  The start of the period is found by
+ * bisection, so only the records in the period are read.
+ *
+ * Usage: tape_reader -f <tape file> [-s <start>] [-e <end>] [-t <username>] [-q]
+ *   -s, -e  period, in seconds since the epoch (fractions allowed), end excluded
+ *   -t      only trades in which the trader bought or sold
+ *   -q      print only the summary
+ */
+int main(int argc, char *argv[]) {
+    char *path = NULL;
+    char *name = NULL;
+    uint64_t start = 0, end = UINT64_MAX;
+    int quiet = 0;
+    int option;
+    while((option = getopt(argc, argv, "f:s:e:t:q")) != EOF) {
+        switch(option) {
+            case 'f':
+                path = optarg;
+                break;
+            case 's':
+                start = atof(optarg) * 1e9;
+                break;
+            case 'e':
+                end = atof(optarg) * 1e9;
+                break;
+            case 't':
+                name = optarg;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(path == NULL) exit(EXIT_FAILURE);
+
+    TAPE tape;
+    if(tape_open(path, &tape) == EXIT_FAILURE) {
+        fprintf(stderr, "No trade tape at %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // Records are in time order, so the period starts where bisection finds it
+    uint64_t numTrades = 0, volume = 0, notional = 0;
+    for(uint64_t i = tape_seek(&tape, start); i < tape.numRecords; i++) {
+        TAPE_RECORD *record = &tape.records[i];
+        if(record->timestamp >= end) break;
+        if(name != NULL && strncmp(record->buyer, name, TAPE_NAME_LEN) != 0 &&
+           strncmp(record->seller, name, TAPE_NAME_LEN) != 0) continue;
+
+        if(!quiet) {
+            printf("TRADE %lu.%09lu buy %u (%.*s) sell %u (%.*s) qty %u price %u\n",
+                   record->timestamp / 1000000000, record->timestamp % 1000000000,
+                   record->buyOrder, TAPE_NAME_LEN, record->buyer,
+                   record->sellOrder, TAPE_NAME_LEN, record->seller, record->quantity, record->price);
+        }
+        numTrades++;
+        volume = volume + record->quantity;
+        notional = notional + (uint64_t)record->quantity * record->price;
+    }
+    printf("%lu trades, volume %lu, vwap %lu\n", numTrades, volume, (volume > 0) ? notional / volume : 0);
+
+    tape_close(&tape);
+    return EXIT_SUCCESS;
+}